@@ -0,0 +1,348 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Throughput benchmarks over generated corpora. Every corpus is built
+   from a fixed seed, so runs are comparable across machines and
+   revisions. Output is one tab-separated line per corpus and operation:
+
+     corpus op messages bytes ns/msg MB/s allocs/msg pool_bytes/msg
+
+   where allocs counts pool pages and large blocks newly obtained from
+   malloc and pool_bytes the pool memory a message occupies, both over
+   one pass through the corpus with a single pool reset per message. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "extprot.h"
+
+#define REPEATS 5
+#define MIN_BYTES (64 << 20)	/* input processed per timed run */
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static unsigned rnd(unsigned n) {
+  return (unsigned) (rng() % n);
+}
+
+static void random_string(Extprot_Writer *w, Extprot_Tag tag, size_t len) {
+  char buf[16];
+  size_t i;
+  for (i = 0; i < len; i++) {
+    buf[i] = 'a' + rnd(26);
+  }
+  extprot_writer_bytes(w, tag, buf, len);
+}
+
+/* The complex_rtt message of doc/benchmark.md, with every list and
+   string of random length 0 to 9:
+
+     message complex_rtt =
+       A { a1 : [ ( int * [bool] ) ]; a2 : [ sum_type<int, string, long> ] }
+     | B { b1 : bool; b2 : (string * [int]) } */
+static void gen_complex_rtt(Extprot_Writer *w) {
+  unsigned i, j, n, m;
+
+  if (rnd(2) == 0) {
+    extprot_writer_begin_tuple(w, 0);
+    extprot_writer_begin_htuple(w, 0);
+    for (i = 0, n = rnd(10); i < n; i++) {
+      extprot_writer_begin_tuple(w, 0);
+      extprot_writer_vint(w, 0, rng() >> rnd(64));
+      extprot_writer_begin_htuple(w, 0);
+      for (j = 0, m = rnd(10); j < m; j++) {
+	extprot_writer_bits8(w, 0, rnd(2));
+      }
+      extprot_writer_end(w);
+      extprot_writer_end(w);
+    }
+    extprot_writer_end(w);
+    extprot_writer_begin_htuple(w, 0);
+    for (i = 0, n = rnd(10); i < n; i++) {
+      unsigned which = rnd(4);
+      if (which == 3) {
+	extprot_writer_enum(w, 0);
+	continue;
+      }
+      extprot_writer_begin_tuple(w, which);
+      switch (which) {
+	case 0: extprot_writer_vint(w, 0, rng() >> rnd(64)); break;
+	case 1: random_string(w, 0, rnd(10)); break;
+	default: extprot_writer_bits64_long(w, 0, (int64_t) rng()); break;
+      }
+      extprot_writer_end(w);
+    }
+    extprot_writer_end(w);
+    extprot_writer_end(w);
+  } else {
+    extprot_writer_begin_tuple(w, 1);
+    extprot_writer_bits8(w, 0, rnd(2));
+    extprot_writer_begin_tuple(w, 0);
+    random_string(w, 0, rnd(10));
+    extprot_writer_begin_htuple(w, 0);
+    for (i = 0, n = rnd(10); i < n; i++) {
+      extprot_writer_vint(w, 0, rng() >> rnd(64));
+    }
+    extprot_writer_end(w);
+    extprot_writer_end(w);
+    extprot_writer_end(w);
+  }
+}
+
+static void gen_deep(Extprot_Writer *w) {
+  int i, depth = 64;
+  for (i = 0; i < depth; i++) {
+    extprot_writer_begin_tuple(w, 0);
+    extprot_writer_vint(w, 0, i);
+  }
+  for (i = 0; i < depth; i++) {
+    extprot_writer_end(w);
+  }
+}
+
+static void gen_large_bytes(Extprot_Writer *w) {
+  static uint8_t payload[65536];
+  extprot_writer_begin_tuple(w, 0);
+  extprot_writer_bytes(w, 0, payload, sizeof(payload) - rnd(1024));
+  extprot_writer_end(w);
+}
+
+static void gen_large_htuple(Extprot_Writer *w) {
+  int i;
+  extprot_writer_begin_tuple(w, 0);
+  extprot_writer_begin_htuple(w, 0);
+  for (i = 0; i < 10000; i++) {
+    extprot_writer_bits32(w, 0, (uint32_t) rng());
+  }
+  extprot_writer_end(w);
+  extprot_writer_end(w);
+}
+
+typedef struct Corpus_ {
+  char const *name;
+  void (*gen)(Extprot_Writer *w);
+  size_t count;
+  unsigned decode_flags;
+} Corpus;
+
+static Corpus const corpora[] = {
+  { "complex_rtt", gen_complex_rtt, 200000, 0 },
+  { "deep", gen_deep, 20000, 0 },
+  { "large_bytes", gen_large_bytes, 500, 0 },
+  { "large_bytes_zc", gen_large_bytes, 500, EXTPROT_DECODE_ZERO_COPY },
+  { "large_htuple", gen_large_htuple, 200, 0 },
+  { "large_htuple_packed", gen_large_htuple, 200, EXTPROT_DECODE_PACK_ARRAYS },
+  { NULL, NULL, 0, 0 }
+};
+
+static size_t pool_allocs(Extprot_Pool const *pool) {
+  return pool->num_pages + pool->num_blocks;
+}
+
+static size_t pool_bytes(Extprot_Pool const *pool) {
+  size_t n = pool->pages_in_use > 0 ?
+    (pool->pages_in_use - 1) * pool->pagesize + pool->alloc_used : 0;
+  int i;
+  for (i = 0; i < pool->blocks_in_use; i++) {
+    n += pool->blocklist[i].size;
+  }
+  return n;
+}
+
+static void report(Corpus const *c, char const *op, size_t bytes,
+		   double seconds, double allocs, double pbytes)
+{
+  printf("%s\t%s\t%lu\t%lu\t%.1f\t%.1f\t%.3f\t%.1f\n",
+	 c->name, op, (unsigned long) c->count, (unsigned long) bytes,
+	 seconds * 1e9 / c->count, bytes / seconds / 1e6, allocs, pbytes);
+}
+
+/* Rounds needed for a timed run to cover MIN_BYTES of input. */
+static int rounds_for(size_t bytes) {
+  return bytes >= MIN_BYTES ? 1 : (int) (MIN_BYTES / bytes);
+}
+
+static void run_corpus(Corpus const *c) {
+  Extprot_Writer w;
+  Extprot_Frame *frames = malloc(c->count * sizeof(Extprot_Frame));
+  Extprot_Object **trees = malloc(c->count * sizeof(Extprot_Object *));
+  Extprot_Decode_Options opts;
+  Extprot_Pool pool, keep;
+  uint8_t *out;
+  size_t i, n, consumed, allocs, pbytes;
+  double t0, best;
+  int r, k, rounds;
+
+  rng_state = 88172645463325252ULL;
+  extprot_writer_init(&w, NULL, 0);
+  for (i = 0; i < c->count; i++) {
+    c->gen(&w);
+  }
+  rounds = rounds_for(w.used);
+  out = malloc(w.used);
+  extprot_decode_options_init(&opts);
+  opts.flags = c->decode_flags;
+
+  /* Header scanning. */
+  for (r = 0, best = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (k = 0; k < rounds; k++) {
+      extprot_scan_frames(w.buffer, w.used, frames, c->count, &n, &consumed);
+    }
+    t0 = (now() - t0) / rounds;
+    if (r == 0 || t0 < best) best = t0;
+  }
+  if (n != c->count || consumed != w.used) {
+    fprintf(stderr, "%s: scan found %lu of %lu messages\n", c->name,
+	    (unsigned long) n, (unsigned long) c->count);
+    exit(1);
+  }
+  report(c, "scan", w.used, best, 0, 0);
+
+  /* Validation, which allocates nothing. */
+  for (r = 0, best = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (k = 0; k < rounds; k++) {
+      for (i = 0; i < c->count; i++) {
+	if (extprot_validate(w.buffer + frames[i].offset, frames[i].length, NULL, NULL)) {
+	  fprintf(stderr, "%s: validation error\n", c->name);
+	  exit(1);
+	}
+      }
+    }
+    t0 = (now() - t0) / rounds;
+    if (r == 0 || t0 < best) best = t0;
+  }
+  report(c, "validate", w.used, best, 0, 0);
+
+  /* Decoding, one message at a time into a pool reset in between. The
+     first pass, untimed, measures the pool. */
+  init_extprot_pool(&pool, 0);
+  allocs = pbytes = 0;
+  for (i = 0; i < c->count; i++) {
+    size_t before = pool_allocs(&pool);
+    if (extprot_decode_with(&pool, w.buffer + frames[i].offset, frames[i].length, &opts)) {
+      fprintf(stderr, "%s: decode error\n", c->name);
+      exit(1);
+    }
+    allocs += pool_allocs(&pool) - before;
+    pbytes += pool_bytes(&pool);
+    reset_extprot_pool(&pool);
+  }
+  for (r = 0, best = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (k = 0; k < rounds; k++) {
+      for (i = 0; i < c->count; i++) {
+	extprot_decode_with(&pool, w.buffer + frames[i].offset, frames[i].length, &opts);
+	reset_extprot_pool(&pool);
+      }
+    }
+    t0 = (now() - t0) / rounds;
+    if (r == 0 || t0 < best) best = t0;
+  }
+  report(c, "decode", w.used, best, (double) allocs / c->count,
+	 (double) pbytes / c->count);
+  empty_extprot_pool(&pool);
+
+  /* Encoding works on trees kept from one more decoding pass. */
+  init_extprot_pool(&keep, 65536);
+  for (i = 0; i < c->count; i++) {
+    extprot_decode_with(&keep, w.buffer + frames[i].offset, frames[i].length, &opts);
+    trees[i] = keep.root;
+  }
+
+  for (r = 0, best = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (k = 0; k < rounds; k++) {
+      for (i = 0, n = 0; i < c->count; i++) {
+	n += extprot_compute_length(trees[i]);
+      }
+    }
+    t0 = (now() - t0) / rounds;
+    if (r == 0 || t0 < best) best = t0;
+  }
+  if (n != w.used) {
+    fprintf(stderr, "%s: compute_length gave %lu bytes, expected %lu\n", c->name,
+	    (unsigned long) n, (unsigned long) w.used);
+    exit(1);
+  }
+  report(c, "compute_length", w.used, best, 0, 0);
+
+  for (r = 0, best = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (k = 0; k < rounds; k++) {
+      for (i = 0; i < c->count; i++) {
+	extprot_encode(trees[i], out + frames[i].offset);
+      }
+    }
+    t0 = (now() - t0) / rounds;
+    if (r == 0 || t0 < best) best = t0;
+  }
+  if (memcmp(out, w.buffer, w.used) != 0) {
+    fprintf(stderr, "%s: encoding differs from the corpus\n", c->name);
+    exit(1);
+  }
+  report(c, "encode", w.used, best, 0, 0);
+
+  empty_extprot_pool(&keep);
+  extprot_writer_free(&w);
+  free(out);
+  free(trees);
+  free(frames);
+}
+
+/* With arguments, runs only the named corpora. */
+int main(int argc, char *argv[]) {
+  Corpus const *c;
+  int i;
+
+  printf("# bench_extprot: extprot version %s\n", extprot_version());
+  printf("# corpus\top\tmessages\tbytes\tns_per_msg\tMB_per_s\tallocs_per_msg\tpool_bytes_per_msg\n");
+  for (c = corpora; c->name != NULL; c++) {
+    if (argc > 1) {
+      for (i = 1; i < argc && strcmp(argv[i], c->name) != 0; i++)
+	;
+      if (i == argc) {
+	continue;
+      }
+    }
+    run_corpus(c);
+    fflush(stdout);
+  }
+  return 0;
+}
@@ -0,0 +1,167 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Micro-benchmarks for the varint paths: header scanning, decoding and
+   encoding of vint-dominated messages, at several value magnitudes. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "extprot.h"
+
+#define N_VALUES 100000
+#define REPEATS 5
+
+static double now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+/* A random value needing exactly nbytes bytes as a vint. */
+static uint64_t value_of_width(int nbytes) {
+  uint64_t lo = nbytes == 1 ? 0 : ((uint64_t) 1) << (7 * (nbytes - 1));
+  uint64_t span = (((uint64_t) 1) << (7 * nbytes)) - lo;
+  return lo + rng() % span;
+}
+
+/* Many small messages back to back: bits32 values under varying tags,
+   so every header is a multi-byte vint. */
+static void bench_headers(int nbytes) {
+  Extprot_Writer w;
+  uint32_t tag_and_type;
+  size_t total_len, off;
+  double t0, t1, best = 0;
+  int i, r, rounds = 20;
+  unsigned long count = 0;
+
+  extprot_writer_init(&w, NULL, 0);
+  for (i = 0; i < N_VALUES; i++) {
+    extprot_writer_bits32(&w, (Extprot_Tag) (value_of_width(nbytes) >> 4), i);
+  }
+
+  for (r = 0; r < REPEATS; r++) {
+    count = 0;
+    t0 = now();
+    for (i = 0; i < rounds; i++) {
+      for (off = 0; off < w.used; off += total_len) {
+	if (extprot_decode_header(w.buffer + off, w.used - off, &tag_and_type, &total_len)) {
+	  fprintf(stderr, "bench_headers: decode error\n");
+	  exit(1);
+	}
+	count++;
+      }
+    }
+    t1 = now();
+    if (r == 0 || (t1 - t0) < best) best = t1 - t0;
+  }
+  printf("decode_header\t%d\t%.2f ns/value\n", nbytes, best * 1e9 / count);
+  extprot_writer_free(&w);
+}
+
+static void bench_decode(int nbytes) {
+  Extprot_Writer w;
+  Extprot_Pool pool;
+  double t0, t1, best = 0;
+  int i, r, rounds = 10;
+
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_begin_htuple(&w, 0);
+  for (i = 0; i < N_VALUES; i++) {
+    extprot_writer_vint(&w, 0, value_of_width(nbytes));
+  }
+  extprot_writer_end(&w);
+
+  init_extprot_pool(&pool, 65536);
+  for (r = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (i = 0; i < rounds; i++) {
+      if (extprot_decode(&pool, w.buffer, w.used)) {
+	fprintf(stderr, "bench_decode: decode error\n");
+	exit(1);
+      }
+      reset_extprot_pool(&pool);
+    }
+    t1 = now();
+    if (r == 0 || (t1 - t0) < best) best = t1 - t0;
+  }
+  printf("decode\t%d\t%.2f ns/value\n", nbytes, best * 1e9 / ((double) rounds * N_VALUES));
+  empty_extprot_pool(&pool);
+  extprot_writer_free(&w);
+}
+
+/* compute_length followed by encode, as a producer holding a tree would. */
+static void bench_encode(int nbytes) {
+  Extprot_Pool pool;
+  Extprot_Object *o;
+  void *buffer;
+  double t0, t1, best = 0;
+  int i, r, rounds = 20;
+
+  init_extprot_pool(&pool, 65536);
+  o = extprot_htuple(&pool, 0, N_VALUES);
+  for (i = 0; i < N_VALUES; i++) {
+    o->body.tuple.vec[i] = extprot_vint_64(&pool, 0, value_of_width(nbytes));
+  }
+  buffer = malloc(extprot_compute_length(o));
+
+  for (r = 0; r < REPEATS; r++) {
+    t0 = now();
+    for (i = 0; i < rounds; i++) {
+      extprot_compute_length(o);
+      extprot_encode(o, buffer);
+    }
+    t1 = now();
+    if (r == 0 || (t1 - t0) < best) best = t1 - t0;
+  }
+  printf("encode\t%d\t%.2f ns/value\n", nbytes, best * 1e9 / ((double) rounds * N_VALUES));
+
+  free(buffer);
+  empty_extprot_pool(&pool);
+}
+
+int main(int argc, char *argv[]) {
+  int nbytes;
+
+  printf("bench_vint: extprot version %s\n", extprot_version());
+  for (nbytes = 1; nbytes <= 8; nbytes++) {
+    bench_headers(nbytes);
+  }
+  for (nbytes = 1; nbytes <= 8; nbytes++) {
+    bench_decode(nbytes);
+  }
+  for (nbytes = 1; nbytes <= 8; nbytes++) {
+    bench_encode(nbytes);
+  }
+  return 0;
+}
@@ -28,6 +28,8 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
 #ifndef EXTPROT_NO_BIGNUMS
 #include <gmp.h>
 #endif
@@ -48,14 +50,23 @@ typedef enum Extprot_ObjectKind_ {
   EXTPROT_ASSOC = 7
 } Extprot_ObjectKind;
 
+#define EXTPROT_FLAG_BYTES_REF	0x0001	/* bytes node points into a caller buffer */
+#define EXTPROT_FLAG_VINT_BIG	0x0002	/* vint node holds an mpz_t */
+#define EXTPROT_FLAG_PACKED	0x0004	/* htuple stored as a packed array */
+#define EXTPROT_FLAG_INDEXED	0x0008	/* assoc has a lookup index */
+#define EXTPROT_FLAG_RAW	0x0010	/* node holds a whole encoded value */
+#define EXTPROT_FLAG_LAZY	0x0020	/* elements decoded on first access */
+
 typedef struct Extprot_Object_ {
   uint32_t kind;
+  uint32_t flags;
   union {
 #ifndef EXTPROT_NO_BIGNUMS
+    uint64_t vint64;		/* unless EXTPROT_FLAG_VINT_BIG */
     struct {
       struct Extprot_Object_ *chain;
       mpz_t value;
-    } vint;
+    } vint;			/* if EXTPROT_FLAG_VINT_BIG */
 #else
     uint64_t vint;
 #endif
@@ -66,20 +77,86 @@ typedef struct Extprot_Object_ {
 
     struct {
       size_t length;
+      size_t body_length; /* cached by extprot_compute_length(); 0 if unknown */
       struct Extprot_Object_ *vec[1];
     } tuple;
     struct {
       size_t length;
       uint8_t vec[1];
     } bytes;
+    struct {
+      size_t length;
+      uint8_t const *ptr;
+    } bytes_ref;
+    struct {
+      size_t length;
+      uint32_t elem_kind;	/* tag and wire type shared by every element */
+      void const *data;		/* uint8_t, uint32_t, int64_t or double[length] */
+    } packed;
   } body;
 } Extprot_Object;
 
+/* Vints that fit in 64 bits are stored inline even in the bignum build;
+   only larger ones are spilled to an mpz_t. */
+#ifndef EXTPROT_NO_BIGNUMS
+#define EXTPROT_VINT_IS_BIG(o)	((o)->flags & EXTPROT_FLAG_VINT_BIG)
+#define EXTPROT_VINT_64(o)	((o)->body.vint64)
+#else
+#define EXTPROT_VINT_IS_BIG(o)	0
+#define EXTPROT_VINT_64(o)	((o)->body.vint)
+#endif
+
+#define EXTPROT_BYTES_DATA(o)					\
+  (((o)->flags & EXTPROT_FLAG_BYTES_REF)			\
+   ? (o)->body.bytes_ref.ptr					\
+   : (uint8_t const *) (o)->body.bytes.vec)
+
+/* What a lazy tuple, htuple or assoc keeps of its wire form. It sits
+   just past the element slots (and an assoc's index slot), which stay
+   NULL until their elements are decoded. */
+typedef struct Extprot_Lazy_ {
+  uint8_t const *data;		/* the elements' encodings */
+  size_t length;
+  size_t *offsets;		/* where each element starts, then the end;
+				   NULL until the first access */
+  size_t missing;		/* elements not yet decoded */
+  unsigned flags;		/* decode options for the elements */
+  size_t depth;			/* nesting depth of the elements */
+  size_t max_depth;
+  size_t budget;		/* pool bytes their decoding may still take */
+  int (*raw)(void *arg, size_t depth, size_t index, uint32_t tag_and_type);
+  void *raw_arg;
+} Extprot_Lazy;
+
+#define EXTPROT_LAZY_AT(o)					\
+  (((o)->kind & 0xf) == EXTPROT_ASSOC				\
+   ? 2 * (o)->body.tuple.length + 1				\
+   : (o)->body.tuple.length)
+#define EXTPROT_LAZY(o)						\
+  ((Extprot_Lazy *) (void *) &(o)->body.tuple.vec[EXTPROT_LAZY_AT(o)])
+
+typedef struct Extprot_Pool_Block_ {
+  char *block;
+  size_t size;
+  size_t used;			/* high-water mark, so reset knows what to re-zero */
+} Extprot_Pool_Block;
+
 typedef struct Extprot_Pool_ {
   Extprot_Object *root;
 
+  /* Allocations too big for a page. Blocks [0, blocks_in_use) are live;
+     the rest are zeroed, kept by reset_extprot_pool() for reuse. */
   int num_blocks;
-  void **blocklist;
+  int blocks_in_use;
+  int blocklist_capacity;
+  Extprot_Pool_Block *blocklist;
+
+  /* Pages, likewise: [0, pages_in_use) hold live data, the last of them
+     being alloc_block, and the rest are zeroed and kept for reuse. */
+  int num_pages;
+  int pages_in_use;
+  int pagelist_capacity;
+  Extprot_Pool_Block *pagelist;
 
   size_t pagesize;
   char *alloc_block;
@@ -88,25 +165,334 @@ typedef struct Extprot_Pool_ {
 #ifndef EXTPROT_NO_BIGNUMS
   Extprot_Object *bignum_chain;
 #endif
+
+  struct Extprot_Stats_ *stats;	/* NULL unless counting */
 } Extprot_Pool;
 
+/* Counters updated by a pool, and by decodes into it, once attached
+   with extprot_pool_set_stats(). Several pools may share one. */
+typedef struct Extprot_Stats_ {
+  uint64_t bytes_requested;	/* as passed to extprot_pool_alloc() */
+  uint64_t bytes_reserved;	/* after rounding, large blocks included */
+  uint64_t pages;		/* pages handed out, fresh or reused */
+  uint64_t page_tail_waste;	/* left unused at the end of filled pages */
+  uint64_t large_allocs;	/* allocations given a block of their own */
+  uint64_t large_bytes;
+  size_t footprint;		/* bytes currently held from malloc */
+  size_t peak_footprint;
+  uint64_t decodes;
+  uint64_t objects[16];		/* decoded objects, by wire type */
+  size_t max_depth;		/* deepest tuple nesting decoded */
+} Extprot_Stats;
+
 typedef enum Extprot_Error_ {
   Extprot_NoError = 0,
   Extprot_EarlyEOF,
   Extprot_VintOverflow,
   Extprot_SizeTOverflow,
   Extprot_InvalidTag,
+  Extprot_BufferFull,
+  Extprot_BadNesting,
+  Extprot_Incomplete,
+  Extprot_PathNotFound,
+  Extprot_TooDeep,
+  Extprot_IOError,
+  Extprot_BadLog,
+  Extprot_BadChecksum,
+  Extprot_BadWireType,
+  Extprot_UnknownTag,
+  Extprot_MissingField,
+  Extprot_BadSchema,
+  Extprot_BadLength,
+  Extprot_BadCount,
+  Extprot_OverBudget,
+  Extprot_NoMemory,
 
   Extprot_Error_MAX
 } Extprot_Error;
 
+#define EXTPROT_DECODE_ZERO_COPY	0x0001	/* bytes nodes reference the input */
+#define EXTPROT_DECODE_PACK_ARRAYS	0x0002	/* pack homogeneous scalar htuples */
+#define EXTPROT_DECODE_INDEX_ASSOC	0x0004	/* build assoc lookup indexes */
+#define EXTPROT_DECODE_LAZY		0x0008	/* decode elements on first access */
+
+typedef struct Extprot_Decode_Options_ {
+  unsigned flags;
+  size_t max_depth;		/* maximum tuple nesting; 0 for no limit */
+  size_t max_bytes;		/* pool memory one decode may take; 0 for no limit */
+  /* Values for which raw() returns nonzero are not decoded but kept as
+     EXTPROT_FLAG_RAW nodes. depth is 0 for the root and index is the
+     value's position in its parent. */
+  int (*raw)(void *arg, size_t depth, size_t index, uint32_t tag_and_type);
+  void *raw_arg;
+} Extprot_Decode_Options;
+
+/* Callbacks for extprot_decode_events(), returning one of these */
+#define EXTPROT_EVENT_CONTINUE	0
+#define EXTPROT_EVENT_SKIP	1
+#define EXTPROT_EVENT_STOP	2
+
+typedef struct Extprot_Events_ {
+  int (*on_scalar)(void *arg, Extprot_Tag tag, int wire_type, uint64_t value, size_t pos);
+  int (*on_bytes)(void *arg, Extprot_Tag tag, int wire_type,
+		  uint8_t const *data, size_t len, size_t pos);
+  int (*on_begin_tuple)(void *arg, Extprot_Tag tag, size_t count, size_t pos);
+  int (*on_begin_htuple)(void *arg, Extprot_Tag tag, size_t count, size_t pos);
+  int (*on_begin_assoc)(void *arg, Extprot_Tag tag, size_t count, size_t pos);
+  int (*on_end)(void *arg, Extprot_Tag tag, int wire_type, size_t pos);
+} Extprot_Events;
+
+/* One message located by extprot_scan_frames(). */
+typedef struct Extprot_Frame_ {
+  size_t offset;
+  size_t length;		/* header included */
+  uint32_t tag_and_type;
+} Extprot_Frame;
+
+/* Writes a log segment; see extprot_log.c for the layout. */
+typedef struct Extprot_Log_Writer_ {
+  FILE *f;
+  uint64_t position;
+  size_t count;
+  size_t capacity;
+  uint64_t *offsets;		/* of every frame so far, for the index */
+  uint8_t *scratch;
+  size_t scratch_capacity;
+  Extprot_Error error;		/* sticky */
+} Extprot_Log_Writer;
+
+/* A log segment mapped into memory for reading. */
+typedef struct Extprot_Log_ {
+  uint8_t const *base;
+  size_t size;
+  size_t count;			/* number of messages */
+  uint8_t const *index;
+  int owns_index;		/* index was rebuilt rather than mapped */
+} Extprot_Log;
+
+/* Output of extprot_encode_gather(): iov[0, iov_count) spell out the
+   length bytes of the encoding. Buffers are reused between calls.
+   iov_count stays within max_iov, which extprot_gather_init() sets to
+   IOV_MAX so that one writev() takes it all; payloads past that many
+   references are copied into scratch instead. */
+typedef struct Extprot_Gather_ {
+  size_t min_ref;		/* bytes payloads this long are referenced */
+  size_t max_iov;
+  size_t refs_left;		/* private to extprot_encode_gather() */
+  size_t length;
+  struct iovec *iov;
+  size_t iov_count;
+  size_t iov_capacity;
+  uint8_t *scratch;
+  size_t scratch_capacity;
+} Extprot_Gather;
+
+/* Schema-decoded structs hold strings this way, pointing into the input. */
+typedef struct Extprot_String_ {
+  size_t length;
+  char const *data;
+} Extprot_String;
+
+/* Results of extprot_decode_batch(). roots[i] is the value decoded
+   from frame i, or NULL if it failed to decode; the values live in
+   pools, one per worker thread, which are reused by the next batch. */
+typedef struct Extprot_Batch_ {
+  size_t num_frames;
+  size_t roots_capacity;
+  Extprot_Object **roots;
+  size_t num_pools;
+  Extprot_Pool *pools;
+  size_t failed_at;		/* first failed frame, or num_frames */
+} Extprot_Batch;
+
+/* Type codes of schema descriptors, and the C representation each
+   decodes to. */
+enum {
+  EXTPROT_T_BOOL = 1,		/* int */
+  EXTPROT_T_BYTE,		/* uint8_t */
+  EXTPROT_T_INT,		/* int64_t, zigzag vint */
+  EXTPROT_T_I32,		/* int32_t */
+  EXTPROT_T_LONG,		/* int64_t */
+  EXTPROT_T_FLOAT,		/* double */
+  EXTPROT_T_STRING,		/* Extprot_String */
+  EXTPROT_T_TUPLE,		/* struct of the elements */
+  EXTPROT_T_LIST,		/* Extprot_Vec */
+  EXTPROT_T_SUM,		/* int which; union of the non-constant cases */
+  EXTPROT_T_MESSAGE		/* the message's struct, inline */
+};
+
+/* Lists and arrays as decoded by extprot_schema_decode(). */
+typedef struct Extprot_Vec_ {
+  size_t length;
+  void *vec;
+} Extprot_Vec;
+
+typedef struct Extprot_Type_ Extprot_Type;
+typedef struct Extprot_Message_Desc_ Extprot_Message_Desc;
+
+typedef struct Extprot_Field_ {
+  char const *name;
+  size_t offset;
+  Extprot_Type *type;
+} Extprot_Field;
+
+/* A constructor of a sum, or the single case of a tuple. Field offsets
+   are relative to the case's struct. */
+typedef struct Extprot_Case_ {
+  char const *name;
+  uint32_t tag;
+  size_t num_fields;
+  Extprot_Field *fields;
+  size_t size;
+  size_t align;
+} Extprot_Case;
+
+struct Extprot_Type_ {
+  int code;			/* EXTPROT_T_* */
+  int has_default;
+  size_t size;
+  size_t align;
+  size_t num_cases;		/* sums: constant cases come first */
+  size_t num_constants;
+  Extprot_Case *cases;
+  size_t union_offset;		/* sums */
+  size_t enum_limit;		/* tag dispatch: case index or -1 */
+  int16_t *enum_dispatch;
+  size_t tuple_limit;
+  int16_t *tuple_dispatch;
+  Extprot_Type *elem;		/* lists */
+  char const *ref;		/* messages */
+  Extprot_Message_Desc *message;
+};
+
+struct Extprot_Message_Desc_ {
+  char const *name;
+  int is_sum;			/* of records, laid out as a sum */
+  Extprot_Type type;
+  int layout_state;
+};
+
+/* Loaded from the descriptor extprotc -l schema writes; see
+   extprot_schema.c. All tables live in pool. */
+typedef struct Extprot_Schema_ {
+  Extprot_Pool pool;
+  size_t num_messages;
+  Extprot_Message_Desc *messages;
+  size_t max_depth;		/* nesting allowed when decoding; 0 for no limit */
+} Extprot_Schema;
+
+typedef struct Extprot_Writer_Frame_ {
+  int wire_type;
+  size_t header_at;
+  size_t count;
+  size_t extra;			/* bytes its patches will add to its body */
+} Extprot_Writer_Frame;
+
+/* A length prefix and count that outgrew their reservation at at,
+   written when the outermost tuple ends. */
+typedef struct Extprot_Writer_Patch_ {
+  size_t at;
+  size_t body_len;
+  size_t count;
+} Extprot_Writer_Patch;
+
+typedef struct Extprot_Writer_ {
+  uint8_t *buffer;
+  size_t capacity;
+  size_t used;
+  int owns_buffer;
+
+  size_t depth;
+  size_t stack_capacity;
+  Extprot_Writer_Frame *stack;
+
+  size_t patches_count;
+  size_t patches_capacity;
+  Extprot_Writer_Patch *patches;
+
+  Extprot_Error error;
+} Extprot_Writer;
+
+typedef struct Extprot_Decode_Frame_ {
+  Extprot_Object *o;
+  size_t next;
+  size_t total;
+  uint32_t kind;		/* used by extprot_decode_events(), which has no o */
+} Extprot_Decode_Frame;
+
+/* A tuple the stream decoder is filling in: its elements so far sit in
+   the decoder's elems from first on, and its body ends at offset end. */
+typedef struct Extprot_Stream_Frame_ {
+  uint64_t tag_and_type;
+  size_t end;
+  size_t first;
+  size_t total;
+} Extprot_Stream_Frame;
+
+typedef struct Extprot_Stream_Decoder_ {
+  Extprot_Pool *pool;
+  int phase;
+  Extprot_Error error;
+  size_t max_depth;
+  size_t max_bytes;
+  size_t budget;
+
+  uint64_t tag_and_type;
+  size_t len;
+  size_t end;			/* where the current value's body ends */
+  size_t offset;		/* bytes of the value consumed so far */
+
+  uint64_t acc;
+  uint8_t vint[10];		/* a vint split across chunks */
+  size_t vint_got;
+  size_t got;
+  size_t need;
+
+  size_t depth;
+  size_t stack_capacity;
+  Extprot_Stream_Frame *stack;
+
+  Extprot_Object **elems;
+  size_t elems_count;
+  size_t elems_capacity;
+
+  uint8_t *scratch;		/* a bytes body or bignum as it arrives */
+  size_t scratch_capacity;
+} Extprot_Stream_Decoder;
+
 extern char const *extprot_version(void);
 
+/* Spare blocks for oversized allocations that a reset keeps beyond
+   those the pool has just used; see reset_extprot_pool(). */
+#ifndef EXTPROT_POOL_SPARE_LIMIT
+#define EXTPROT_POOL_SPARE_LIMIT	(8 * 1024 * 1024)
+#endif
+
 extern void init_extprot_pool(Extprot_Pool *pool, size_t pagesize);
 extern void empty_extprot_pool(Extprot_Pool *pool);
+/* Like empty_extprot_pool(), but keeps the pool's memory for reuse: its
+   pages, the oversized blocks used since the last reset, and other
+   spare blocks up to EXTPROT_POOL_SPARE_LIMIT bytes in all. */
+extern void reset_extprot_pool(Extprot_Pool *pool);
 
 extern void *extprot_pool_alloc(Extprot_Pool *pool, size_t amount);
 
+/* extprot_copy() deep-copies o into pool as one block, laid out
+   depth-first, that shares nothing with o's pool or with the buffer o
+   was decoded from. extprot_compact() swaps a pool's contents for such
+   a copy of its root, releasing everything else. Neither recurses; if
+   the heap stack they need for deep trees cannot be allocated,
+   extprot_copy_size() returns 0, extprot_copy() NULL, and
+   extprot_compact() leaves the pool as it was. */
+extern size_t extprot_copy_size(Extprot_Object const *o);
+extern Extprot_Object *extprot_copy(Extprot_Pool *pool, Extprot_Object const *o);
+extern void extprot_compact(Extprot_Pool *pool);
+
+/* Starts (or with NULL, stops) counting into stats, which the caller
+   owns and should zero with extprot_stats_init() first. */
+extern void extprot_stats_init(Extprot_Stats *stats);
+extern void extprot_pool_set_stats(Extprot_Pool *pool, Extprot_Stats *stats);
+
 extern char const *extprot_error_message(Extprot_Error error);
 
 extern Extprot_Error extprot_decode_header(void const *buffer,
@@ -117,14 +503,234 @@ extern Extprot_Error extprot_decode(Extprot_Pool *pool,
 				    void const *buffer,
 				    size_t len);
 
+/* The readers every decoder here is built on. extprot_read_vint() reads
+   a vint of up to 64 bits from [*p, end) and extprot_skip_body() steps
+   over the body of a value with the given prefix; both leave *p past
+   what they read, and leave it alone on failure. */
+extern Extprot_Error extprot_read_vint(uint8_t const **p, uint8_t const *end, uint64_t *val);
+extern Extprot_Error extprot_skip_body(uint8_t const **p, uint8_t const *end,
+				       uint64_t tag_and_type);
+
+/* Indexes a buffer of back-to-back messages, filling in at most
+   max_frames frames. *consumed is set to the end of the last frame
+   found, so a trailing partial message (or one that did not fit in
+   frames) is not an error and can be rescanned from there once more
+   data has arrived. */
+extern Extprot_Error extprot_scan_frames(void const *buffer,
+					 size_t len,
+					 Extprot_Frame *frames,
+					 size_t max_frames,
+					 size_t *num_frames,
+					 size_t *consumed);
+
+/* Decodes every frame of buffer using up to num_threads threads,
+   including the caller's. Returns the error of the first frame (in
+   input order) that failed; the others are decoded regardless. Built
+   with EXTPROT_NO_THREADS, the batch is decoded on the calling thread. */
+extern void extprot_batch_init(Extprot_Batch *b);
+extern void extprot_batch_free(Extprot_Batch *b);
+extern Extprot_Error extprot_decode_batch(Extprot_Batch *b,
+					  void const *buffer,
+					  Extprot_Frame const *frames,
+					  size_t num_frames,
+					  unsigned num_threads,
+					  Extprot_Decode_Options const *opts);
+
+/* Log segments. A segment is written once, from extprot_log_create()
+   to extprot_log_close(), which appends the index; an unclosed segment
+   can still be opened, up to its last intact message. Messages are
+   served straight out of the mapping: extprot_log_frames() fills in
+   frames with offsets from log->base, ready for extprot_decode_batch(),
+   after checking each frame's CRC-32C. Asking for messages past
+   log->count fails with Extprot_BadLog, as a damaged frame does. */
+extern Extprot_Error extprot_log_create(Extprot_Log_Writer *w, char const *path);
+extern Extprot_Error extprot_log_append(Extprot_Log_Writer *w, void const *msg, size_t len);
+extern Extprot_Error extprot_log_append_object(Extprot_Log_Writer *w, Extprot_Object const *o);
+extern Extprot_Error extprot_log_close(Extprot_Log_Writer *w);
+extern Extprot_Error extprot_log_open(Extprot_Log *log, char const *path);
+extern void extprot_log_unmap(Extprot_Log *log);
+extern Extprot_Error extprot_log_frames(Extprot_Log const *log, size_t first, size_t n,
+					Extprot_Frame *frames);
+extern Extprot_Error extprot_log_get(Extprot_Log const *log, size_t n,
+				     void const **msg, size_t *len);
+extern uint32_t extprot_crc32c(void const *buffer, size_t len);
+
+/* With EXTPROT_DECODE_ZERO_COPY, the buffer must outlive the pool, and
+   bytes payloads must be read through EXTPROT_BYTES_DATA(). With
+   EXTPROT_DECODE_PACK_ARRAYS, an htuple whose elements are all bits8,
+   bits32 or bits64 values with one and the same tag is decoded as a
+   single node with EXTPROT_FLAG_PACKED set instead of one per element.
+   EXTPROT_DECODE_INDEX_ASSOC indexes every non-empty assoc as it is
+   decoded, leaving the tree safe to look up from several threads.
+   With EXTPROT_DECODE_LAZY, each non-empty tuple, htuple or assoc is
+   left with EXTPROT_FLAG_LAZY set and its elements undecoded; read them
+   through extprot_tuple_get(), which decodes each on first access into
+   the pool, or decode them all with extprot_expand(). A lazy node
+   references the input only under EXTPROT_DECODE_ZERO_COPY; otherwise
+   the root's body is copied into the pool once. Encoding a lazy node
+   copies out the bytes of whatever has not been decoded. As with assoc
+   indexes, decoding on access writes to the tree, so lazy nodes must
+   not be shared between threads until they have been expanded.
+   extprot_decode_with(), extprot_decode_path(), extprot_decode_events()
+   and the stream decoder all reject element counts that the bytes
+   following them could not hold with Extprot_BadCount, before
+   allocating anything for them. A nonzero max_bytes caps the pool
+   memory a decode may take, in extprot_decode_with(),
+   extprot_decode_path() and a stream decoder set up with
+   extprot_stream_init_with(): each node is charged before it is
+   allocated, and going over fails with Extprot_OverBudget. Bignum
+   digits, which GMP keeps outside the pool, are not counted, except by
+   the stream decoder, which has to gather them first. A lazy node keeps the options it was decoded
+   with: its elements are decoded under the same max_depth and raw
+   callback, at the depth they would have had, and are charged against
+   whatever was left of max_bytes when the node itself was decoded. */
+extern void extprot_decode_options_init(Extprot_Decode_Options *opts);
+extern Extprot_Error extprot_decode_with(Extprot_Pool *pool,
+					 void const *buffer,
+					 size_t len,
+					 Extprot_Decode_Options const *opts);
+/* Element i of a tuple, htuple or assoc (whose keys and values count
+   as 2n elements), lazy or not. extprot_expand() decodes every element
+   of o, and with deep set, of the lazy nodes beneath it, after which
+   o->body.tuple.vec may be read directly. */
+extern Extprot_Error extprot_tuple_get(Extprot_Pool *pool, Extprot_Object *o,
+				       size_t i, Extprot_Object **out);
+extern Extprot_Error extprot_expand(Extprot_Pool *pool, Extprot_Object *o, int deep);
+
+/* Checks that buffer holds exactly one well-formed value, without
+   decoding it, and allocating only for deep nesting; see
+   extprot_validate.c. On failure, sets *error_at (if not NULL) to the
+   offset where the problem was found. Only opts->max_depth is used, and
+   as in decoding, 0 puts no limit on nesting. */
+extern Extprot_Error extprot_validate(void const *buffer,
+				      size_t len,
+				      Extprot_Decode_Options const *opts,
+				      size_t *error_at);
+
+/* Event decoding: walks one value, calling back for each value in it
+   in order, without building a tree or touching a pool. pos is the
+   offset of the value's first byte, or for on_end, of the byte just
+   past the tuple. Scalars arrive as their bits: bits64_long values two's
+   complement, floats as by memcpy, and enums as 0. Vints too wide for
+   64 bits arrive through on_bytes, as their little-endian base-128
+   digits. count is the number of elements, or of pairs for an assoc.
+   Any callback may be NULL. Returning EXTPROT_EVENT_SKIP from an
+   on_begin_ callback passes over that tuple, with no on_end, and
+   EXTPROT_EVENT_STOP from any callback ends the walk at once. Only
+   opts->max_depth is used. */
+extern Extprot_Error extprot_decode_events(void const *buffer,
+					   size_t len,
+					   Extprot_Decode_Options const *opts,
+					   Extprot_Events const *ev,
+					   void *arg);
+
+/* Resumable decoding of a single value arriving in pieces. Each call to
+   extprot_stream_feed() consumes as much of the chunk as belongs to the
+   value and returns Extprot_Incomplete until the value is finished, at
+   which point it returns Extprot_NoError and sets pool->root; any bytes
+   beyond *consumed belong to the next value. Nothing is allocated ahead
+   of the bytes that justify it: a tuple's elements are gathered as they
+   arrive and a bytes body as its bytes do, and no element may run past
+   the end of its parent. extprot_stream_init_with() applies
+   opts->max_depth and opts->max_bytes, as extprot_decode_with() does;
+   the rest of opts is ignored. */
+extern void extprot_stream_init(Extprot_Stream_Decoder *d, Extprot_Pool *pool);
+extern void extprot_stream_init_with(Extprot_Stream_Decoder *d, Extprot_Pool *pool,
+				     Extprot_Decode_Options const *opts);
+extern void extprot_stream_reset(Extprot_Stream_Decoder *d);
+extern void extprot_stream_free(Extprot_Stream_Decoder *d);
+extern Extprot_Error extprot_stream_feed(Extprot_Stream_Decoder *d,
+					 void const *chunk,
+					 size_t len,
+					 size_t *consumed);
+
+/* Decodes only the value reached by following path from the root: each
+   entry indexes the elements of a tuple or htuple, or the flattened
+   key/value sequence of an assoc (2k is key k, 2k + 1 its value).
+   Everything off the path is skipped over without being decoded. */
+extern Extprot_Error extprot_decode_path(Extprot_Pool *pool,
+					 void const *buffer,
+					 size_t len,
+					 size_t const *path,
+					 size_t path_len,
+					 Extprot_Decode_Options const *opts);
+
+/* extprot_compute_length() caches the body length of every tuple it
+   visits; extprot_encode() reuses those lengths, so recompute after
+   modifying a tree that has already been measured. The caches are
+   written through the const tree, by extprot_compute_length() on every
+   call and by extprot_encode() for tuples not yet measured, and so by
+   everything that measures a tree first: extprot_encode_gather(),
+   extprot_writer_object() and extprot_log_append_object(). Threads
+   sharing a tree, or any subtree, must not measure or encode it at the
+   same time. */
 extern size_t extprot_compute_length(Extprot_Object const *o);
 extern void extprot_encode(Extprot_Object const *o, void *buffer);
 
+/* Encodes o for writev() without copying any bytes payload of at least
+   min_ref bytes: those are referenced in place, so the object tree must
+   outlive the iovecs, and everything else is encoded into scratch.
+   Fails with Extprot_NoMemory, leaving no iovecs, if the buffers cannot
+   grow. */
+extern void extprot_gather_init(Extprot_Gather *g, size_t min_ref);
+extern void extprot_gather_free(Extprot_Gather *g);
+extern Extprot_Error extprot_encode_gather(Extprot_Gather *g, Extprot_Object const *o);
+
+/* Passing a NULL buffer to extprot_writer_init() makes the writer
+   allocate (and grow) its own, and failing to grow it is
+   Extprot_NoMemory; otherwise a full buffer is Extprot_BufferFull, and
+   one as long as the finished encoding always suffices. Errors are
+   sticky until extprot_writer_reset(). */
+extern void extprot_writer_init(Extprot_Writer *w, void *buffer, size_t capacity);
+extern void extprot_writer_reset(Extprot_Writer *w);
+extern void extprot_writer_free(Extprot_Writer *w);
+
+extern Extprot_Error extprot_writer_vint(Extprot_Writer *w, Extprot_Tag tag, uint64_t num);
+extern Extprot_Error extprot_writer_bits8(Extprot_Writer *w, Extprot_Tag tag, uint8_t num);
+extern Extprot_Error extprot_writer_bits32(Extprot_Writer *w, Extprot_Tag tag, uint32_t num);
+extern Extprot_Error extprot_writer_bits64_long(Extprot_Writer *w, Extprot_Tag tag, int64_t num);
+extern Extprot_Error extprot_writer_bits64_float(Extprot_Writer *w, Extprot_Tag tag, double num);
+extern Extprot_Error extprot_writer_enum(Extprot_Writer *w, Extprot_Tag tag);
+extern Extprot_Error extprot_writer_bytes(Extprot_Writer *w, Extprot_Tag tag,
+					  void const *bin, size_t len);
+extern Extprot_Error extprot_writer_cstring(Extprot_Writer *w, Extprot_Tag tag, char const *str);
+extern Extprot_Error extprot_writer_object(Extprot_Writer *w, Extprot_Object const *o);
+/* Copies one already-encoded value into the output. */
+extern Extprot_Error extprot_writer_raw(Extprot_Writer *w, void const *encoded, size_t len);
+extern Extprot_Error extprot_writer_begin_tuple(Extprot_Writer *w, Extprot_Tag tag);
+extern Extprot_Error extprot_writer_begin_htuple(Extprot_Writer *w, Extprot_Tag tag);
+extern Extprot_Error extprot_writer_begin_assoc(Extprot_Writer *w, Extprot_Tag tag);
+extern Extprot_Error extprot_writer_end(Extprot_Writer *w);
+
+/* Writes n as a relative int, the zigzag-coded vint of the OCaml
+   binding's int type. */
+extern Extprot_Error extprot_writer_rel_int(Extprot_Writer *w, Extprot_Tag tag, int64_t n);
+
+extern Extprot_Error extprot_schema_load(Extprot_Schema *s, void const *desc, size_t len);
+extern void extprot_schema_free(Extprot_Schema *s);
+extern Extprot_Message_Desc const *extprot_schema_find(Extprot_Schema const *s,
+							char const *name);
+extern Extprot_Field const *extprot_schema_field(Extprot_Message_Desc const *m,
+						 char const *name);
+/* Decodes one message into out, a struct laid out as m->type says.
+   Strings point into buffer and lists are allocated from pool. */
+extern Extprot_Error extprot_schema_decode(Extprot_Schema const *s,
+					   Extprot_Message_Desc const *m,
+					   Extprot_Pool *pool,
+					   void const *buffer, size_t len, void *out);
+
 #ifndef EXTPROT_NO_BIGNUMS
+/* Always spills; fill in o->body.vint.value. Prefer extprot_vint_mpz(). */
 extern Extprot_Object *extprot_vint(Extprot_Pool *pool, Extprot_Tag tag);
+extern Extprot_Object *extprot_vint_mpz(Extprot_Pool *pool, Extprot_Tag tag, mpz_srcptr num);
+extern void extprot_vint_get_mpz(Extprot_Object const *o, mpz_ptr out);
 #else
 extern Extprot_Object *extprot_vint(Extprot_Pool *pool, Extprot_Tag tag, uint64_t num);
 #endif
+extern Extprot_Object *extprot_vint_64(Extprot_Pool *pool, Extprot_Tag tag, uint64_t num);
+/* Builds a vint from its wire bytes (least significant group first). */
+extern Extprot_Object *extprot_vint_wire(Extprot_Pool *pool, Extprot_Tag tag,
+					 uint8_t const *bytes, size_t count);
 extern Extprot_Object *extprot_bits8(Extprot_Pool *pool, Extprot_Tag tag, uint8_t num);
 extern Extprot_Object *extprot_bits32(Extprot_Pool *pool, Extprot_Tag tag, uint32_t num);
 extern Extprot_Object *extprot_bits64_long(Extprot_Pool *pool, Extprot_Tag tag, int64_t num);
@@ -135,13 +741,51 @@ extern Extprot_Object *extprot_tuple_init(Extprot_Pool *pool, Extprot_Tag tag, s
 extern Extprot_Object *extprot_tuple(Extprot_Pool *pool, Extprot_Tag tag, size_t len);
 extern Extprot_Object *extprot_htuple_init(Extprot_Pool *pool, Extprot_Tag tag, size_t len, ...);
 extern Extprot_Object *extprot_htuple(Extprot_Pool *pool, Extprot_Tag tag, size_t len);
+/* The data array is referenced, not copied, and must outlive the pool. */
+extern Extprot_Object *extprot_htuple_packed(Extprot_Pool *pool, Extprot_Tag tag,
+					     Extprot_Tag elem_tag, int wire_type,
+					     void const *data, size_t len);
+extern size_t extprot_packed_width(int wire_type);
 extern Extprot_Object *extprot_cstring(Extprot_Pool *pool, Extprot_Tag tag, char const *str);
 extern Extprot_Object *extprot_bytes(Extprot_Pool *pool, Extprot_Tag tag,
 				     void const *bin, size_t len);
+extern Extprot_Object *extprot_bytes_ref(Extprot_Pool *pool, Extprot_Tag tag,
+					 void const *bin, size_t len);
 extern Extprot_Object *extprot_bytes_nocopy(Extprot_Pool *pool, Extprot_Tag tag, size_t len);
+/* A raw node holds the complete encoding of one value, header included,
+   which encoders emit verbatim; its kind is that of the value, but it
+   has no decoded body beyond the bytes, read with EXTPROT_BYTES_DATA().
+   The _ref variant references the bytes instead of copying them. */
+extern Extprot_Object *extprot_raw(Extprot_Pool *pool, uint32_t tag_and_type,
+				   void const *encoded, size_t len);
+extern Extprot_Object *extprot_raw_ref(Extprot_Pool *pool, uint32_t tag_and_type,
+				       void const *encoded, size_t len);
+/* A lazy tuple, htuple or assoc of n elements (pairs, for an assoc)
+   whose encodings are the len bytes at data; see EXTPROT_DECODE_LAZY. */
+extern Extprot_Object *extprot_lazy_tuple(Extprot_Pool *pool, uint32_t tag_and_type,
+					  size_t n, void const *data, size_t len,
+					  unsigned flags);
 extern Extprot_Object *extprot_assoc_init(Extprot_Pool *pool, Extprot_Tag tag, size_t len, ...);
 extern Extprot_Object *extprot_assoc(Extprot_Pool *pool, Extprot_Tag tag, size_t len);
 
+/* Key lookup on assoc nodes; see extprot_assoc.c. Keys are matched on
+   wire type and value, and only scalar and bytes keys are indexed. The
+   index is built from pool on the first lookup (pass NULL to scan
+   instead), so lazily indexed nodes must not be shared between threads
+   until they have been indexed. Other keys, such as tuples (which must
+   also share the tag) and bignums, are always found by a scan that
+   compares encodings, at the cost of encoding every candidate key of
+   the same kind; as extprot_encode() does, this caches body lengths in
+   the keys. A lazy assoc is expanded first, which also takes a pool.
+   Returns the value, or NULL. */
+extern Extprot_Error extprot_assoc_build_index(Extprot_Pool *pool, Extprot_Object *o);
+extern Extprot_Object *extprot_assoc_get(Extprot_Pool *pool, Extprot_Object *o,
+					 Extprot_Object const *key);
+extern Extprot_Object *extprot_assoc_get_bytes(Extprot_Pool *pool, Extprot_Object *o,
+					       void const *key, size_t len);
+extern Extprot_Object *extprot_assoc_get_vint(Extprot_Pool *pool, Extprot_Object *o,
+					      uint64_t key);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,292 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Lookup indexes for assoc nodes. extprot_assoc() allocates one slot
+   past the 2n keys and values (sizeof(Extprot_Object) already counts
+   vec[0]); once EXTPROT_FLAG_INDEXED is set, that slot points at an
+   open-addressed hash table of pair numbers, sized to stay at most half
+   full. When a key occurs more than once, the first pair wins, as it
+   does for a scan. Keys with no fixed-size spelling (tuples, bignums,
+   raw values) are left out of the index and looked up by a scan that
+   compares encodings. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "extprot.h"
+
+typedef struct Assoc_Index_ {
+  size_t mask;
+  size_t slots[1];		/* pair number + 1, or 0 if free */
+} Assoc_Index;
+
+#define INDEX_SLOT(o)	((o)->body.tuple.vec[2 * (o)->body.tuple.length])
+#define INDEX(o)	((Assoc_Index const *) (void const *) INDEX_SLOT(o))
+
+/* The bytes a key compares by: its payload, or its value spelled out in
+   scratch. Returns 0 for keys that are not indexed. */
+static int key_bytes(Extprot_Object const *k, uint8_t *scratch,
+		     uint8_t const **data, size_t *len)
+{
+  uint64_t v;
+  int i;
+
+  if (k->flags & EXTPROT_FLAG_RAW) {
+    return 0;
+  }
+  switch (k->kind & 0xf) {
+    case EXTPROT_BYTES:
+      *data = EXTPROT_BYTES_DATA(k);
+      *len = k->body.bytes.length;
+      return 1;
+    case EXTPROT_VINT:
+      if (EXTPROT_VINT_IS_BIG(k)) {
+	return 0;
+      }
+      v = EXTPROT_VINT_64(k);
+      break;
+    case EXTPROT_BITS8: v = k->body.bits8; break;
+    case EXTPROT_BITS32: v = k->body.bits32; break;
+    case EXTPROT_BITS64_LONG: v = (uint64_t) k->body.bits64_long; break;
+    case EXTPROT_BITS64_FLOAT: memcpy(&v, &k->body.bits64_float, 8); break;
+    case EXTPROT_ENUM: v = k->kind >> 4; break;
+    default:
+      return 0;
+  }
+  for (i = 0; i < 8; i++) {
+    scratch[i] = (uint8_t) (v >> (8 * i));
+  }
+  *data = scratch;
+  *len = 8;
+  return 1;
+}
+
+/* FNV-1a over the wire type and the key bytes */
+static size_t hash_key(int wire_type, uint8_t const *data, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+
+  h = (h ^ (uint8_t) wire_type) * 1099511628211ULL;
+  for (i = 0; i < len; i++) {
+    h = (h ^ data[i]) * 1099511628211ULL;
+  }
+  return (size_t) (h ^ (h >> 32));
+}
+
+static int same_key(Extprot_Object const *k, int wire_type, uint8_t const *data, size_t len) {
+  uint8_t scratch[8];
+  uint8_t const *kdata;
+  size_t klen;
+
+  return (int) (k->kind & 0xf) == wire_type
+    && key_bytes(k, scratch, &kdata, &klen)
+    && klen == len
+    && memcmp(kdata, data, len) == 0;
+}
+
+/* Raw and packed nodes carry an assoc's kind but no pairs to index */
+static int has_pairs(Extprot_Object const *o) {
+  return (o->kind & 0xf) == EXTPROT_ASSOC
+    && !(o->flags & (EXTPROT_FLAG_RAW | EXTPROT_FLAG_PACKED));
+}
+
+/* Tuples are told apart by their tags as well, as enums are; other
+   keys by their wire types only. */
+static int same_kind(Extprot_Object const *a, Extprot_Object const *b) {
+  switch (a->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+    case EXTPROT_ASSOC:
+      return a->kind == b->kind;
+    default:
+      return (a->kind & 0xf) == (b->kind & 0xf);
+  }
+}
+
+/* Encodes k into *buf, growing it as needed, and returns where the body
+   starts, past the tag/type vint; or NULL if out of memory. */
+static uint8_t *encode_key(Extprot_Object const *k, uint8_t **buf, size_t *cap, size_t *len) {
+  uint8_t *p;
+  uint8_t const *body;
+  uint64_t prefix;
+
+  *len = extprot_compute_length(k);
+  if (*len > *cap) {
+    p = realloc(*buf, *len);
+    if (p == NULL) {
+      return NULL;
+    }
+    *buf = p;
+    *cap = *len;
+  }
+  extprot_encode(k, *buf);
+  body = *buf;
+  extprot_read_vint(&body, *buf + *len, &prefix);
+  return (uint8_t *) body;
+}
+
+static Extprot_Object *scan_encoded(Extprot_Object *o, Extprot_Object const *key) {
+  uint8_t *want = NULL, *have = NULL, *wbody, *hbody;
+  size_t want_cap = 0, have_cap = 0, want_len, have_len, i;
+  Extprot_Object *found = NULL;
+
+  wbody = encode_key(key, &want, &want_cap, &want_len);
+  for (i = 0; wbody != NULL && i < o->body.tuple.length; i++) {
+    Extprot_Object const *k = o->body.tuple.vec[2 * i];
+    if (!same_kind(k, key)) {
+      continue;
+    }
+    hbody = encode_key(k, &have, &have_cap, &have_len);
+    if (hbody == NULL) {
+      break;
+    }
+    if (have_len - (size_t) (hbody - have) == want_len - (size_t) (wbody - want)
+	&& memcmp(hbody, wbody, want_len - (size_t) (wbody - want)) == 0) {
+      found = o->body.tuple.vec[2 * i + 1];
+      break;
+    }
+  }
+  free(want);
+  free(have);
+  return found;
+}
+
+Extprot_Error extprot_assoc_build_index(Extprot_Pool *pool, Extprot_Object *o) {
+  size_t n;
+  size_t cap = 2, i, j;
+  Assoc_Index *idx;
+
+  if (!has_pairs(o)) {
+    return Extprot_BadWireType;
+  }
+  n = o->body.tuple.length;
+  if (o->flags & EXTPROT_FLAG_INDEXED) {
+    return Extprot_NoError;
+  }
+  if (o->flags & EXTPROT_FLAG_LAZY) {
+    Extprot_Error e = extprot_expand(pool, o, 0);
+    if (e != Extprot_NoError) {
+      return e;
+    }
+  }
+  while (cap < 2 * n) {
+    cap *= 2;
+  }
+  idx = extprot_pool_alloc(pool, sizeof(Assoc_Index) + (cap - 1) * sizeof(size_t));
+  if (idx == NULL) {
+    return Extprot_NoMemory;
+  }
+  memset(idx->slots, 0, cap * sizeof(size_t));
+  idx->mask = cap - 1;
+
+  for (i = 0; i < n; i++) {
+    Extprot_Object const *k = o->body.tuple.vec[2 * i];
+    uint8_t scratch[8];
+    uint8_t const *data;
+    size_t len;
+
+    if (!key_bytes(k, scratch, &data, &len)) {
+      continue;
+    }
+    for (j = hash_key(k->kind & 0xf, data, len) & idx->mask;
+	 idx->slots[j] != 0;
+	 j = (j + 1) & idx->mask) {
+      if (same_key(o->body.tuple.vec[2 * (idx->slots[j] - 1)], k->kind & 0xf, data, len)) {
+	break;
+      }
+    }
+    if (idx->slots[j] == 0) {
+      idx->slots[j] = i + 1;
+    }
+  }
+
+  INDEX_SLOT(o) = (Extprot_Object *) (void *) idx;
+  o->flags |= EXTPROT_FLAG_INDEXED;
+  return Extprot_NoError;
+}
+
+Extprot_Object *extprot_assoc_get(Extprot_Pool *pool, Extprot_Object *o,
+				  Extprot_Object const *key)
+{
+  uint8_t scratch[8];
+  uint8_t const *data;
+  size_t len, i;
+  int wire_type = key->kind & 0xf;
+
+  if (!has_pairs(o)) {
+    return NULL;
+  }
+  if ((o->flags & EXTPROT_FLAG_LAZY)
+      && (pool == NULL || extprot_expand(pool, o, 0) != Extprot_NoError)) {
+    return NULL;
+  }
+  if (!key_bytes(key, scratch, &data, &len)) {
+    return scan_encoded(o, key);
+  }
+  if (!(o->flags & EXTPROT_FLAG_INDEXED) && pool != NULL) {
+    extprot_assoc_build_index(pool, o);
+  }
+
+  if (o->flags & EXTPROT_FLAG_INDEXED) {
+    Assoc_Index const *idx = INDEX(o);
+    for (i = hash_key(wire_type, data, len) & idx->mask;
+	 idx->slots[i] != 0;
+	 i = (i + 1) & idx->mask) {
+      size_t pair = idx->slots[i] - 1;
+      if (same_key(o->body.tuple.vec[2 * pair], wire_type, data, len)) {
+	return o->body.tuple.vec[2 * pair + 1];
+      }
+    }
+    return NULL;
+  }
+
+  for (i = 0; i < o->body.tuple.length; i++) {
+    if (same_key(o->body.tuple.vec[2 * i], wire_type, data, len)) {
+      return o->body.tuple.vec[2 * i + 1];
+    }
+  }
+  return NULL;
+}
+
+Extprot_Object *extprot_assoc_get_bytes(Extprot_Pool *pool, Extprot_Object *o,
+					void const *key, size_t len)
+{
+  Extprot_Object k;
+
+  k.kind = EXTPROT_BYTES;
+  k.flags = EXTPROT_FLAG_BYTES_REF;
+  k.body.bytes_ref.length = len;
+  k.body.bytes_ref.ptr = key;
+  return extprot_assoc_get(pool, o, &k);
+}
+
+Extprot_Object *extprot_assoc_get_vint(Extprot_Pool *pool, Extprot_Object *o, uint64_t key) {
+  Extprot_Object k;
+
+  k.kind = EXTPROT_VINT;
+  k.flags = 0;
+  EXTPROT_VINT_64(&k) = key;
+  return extprot_assoc_get(pool, o, &k);
+}
@@ -34,8 +34,31 @@ typedef struct Extprot_Decoder_State_ {
   void const *buffer;
   size_t input_length;
   size_t index;
+
+  unsigned flags;
+
+  /* Tuples currently being filled in by decode(). The first
+     INLINE_FRAMES live in inline_stack; deeper nesting spills to the
+     heap. max_depth of 0 means unlimited. */
+  Extprot_Decode_Frame *stack;
+  size_t depth;
+  size_t stack_capacity;
+  size_t max_depth;
+
+  /* Where the value sits when it is an element of a lazy node; both
+     are 0 for a root. Depths seen by max_depth and raw add outer_depth. */
+  size_t outer_depth;
+  size_t outer_index;
+
+  Extprot_Stats *stats;		/* the pool's, if it is counting */
+  size_t budget;		/* pool bytes the decode may still take */
+
+  int (*raw)(void *arg, size_t depth, size_t index, uint32_t tag_and_type);
+  void *raw_arg;
 } Extprot_Decoder_State;
 
+#define INLINE_FRAMES 32
+
 #define BUFFER_AT(state, n)	(((uint8_t *) (state)->buffer)[(n)])
 #define PEEK_BYTE(state)	(((uint8_t *) (state)->buffer)[(state)->index])
 #define ADVANCE(state)		((state)->index++)
@@ -61,40 +84,141 @@ typedef struct Extprot_Decoder_State_ {
     if (_err__ != Extprot_NoError) return _err__;	\
   }
 
-static Extprot_Error decode(Extprot_Decoder_State *state);
+/* Takes n bytes, rounded as extprot_pool_alloc() rounds them, out of
+   the decode's budget before they are allocated. */
+#define CHARGE(state, n)					\
+  {								\
+    size_t _n__ = ((n) + 7) & ~(size_t) 7;			\
+    if (_n__ > (state)->budget) return Extprot_OverBudget;	\
+    (state)->budget -= _n__;					\
+  }
 
-static Extprot_Error read_vint_64(Extprot_Decoder_State *state, uint64_t *val) {
+/* Every element takes at least one byte, and every assoc pair two, so
+   no more elements can follow than there are bytes left in the body. */
+static int plausible_count(uint64_t n_elems, int wire_type, size_t remaining) {
+  return n_elems <= (wire_type == EXTPROT_ASSOC ? remaining / 2 : remaining);
+}
+
+static Extprot_Error read_vint_slow(uint8_t const **pp, uint8_t const *end, uint64_t *val) {
+  uint8_t const *p = *pp;
   uint64_t v = 0;
   int shift_by = 0;
   while (1) {
     uint8_t b;
-    CHECK_LIMIT(state);
-    b = PEEK_BYTE(state);
-    ADVANCE(state);
-    v |= ((uint64_t) (b & 0x7f)) << shift_by;
-    if ((b & 0x80) == 0) break;
-    shift_by += 7;
-    if (shift_by > 57) {
+    if (p == end) {
+      return Extprot_EarlyEOF;
+    }
+    b = *p++;
+    if (shift_by == 63 && b > 1) {
       return Extprot_VintOverflow;
     }
+    v |= ((uint64_t) (b & 0x7f)) << shift_by;
+    if (b < 0x80) break;
+    shift_by += 7;
   }
+  *pp = p;
   *val = v;
   return Extprot_NoError;
 }
 
+#define VINT_STEP(n)						\
+  b = p[(n)];							\
+  v |= ((uint64_t) (b & 0x7f)) << (7 * (n));			\
+  if (b < 0x80) {						\
+    *pp = p + (n) + 1;						\
+    *val = v;							\
+    return Extprot_NoError;					\
+  }
+
+/* The vint kernel every reader in the library goes through. Vints of
+   up to 64 bits are accepted: the tenth byte may only hold bit 63.
+   Single-byte vints (most tags and lengths) return straight away. When
+   at least ten bytes remain no vint can run off the end, so the longer
+   ones are read by a fully unrolled loop with no limit checks; near the
+   end of the input we fall back to the bytewise loop. A branchy unrolled
+   loop beats word-at-a-time extraction here because the branches
+   predict well and keep the next read off the critical path. */
+Extprot_Error extprot_read_vint(uint8_t const **pp, uint8_t const *end, uint64_t *val) {
+  uint8_t const *p = *pp;
+  uint64_t v;
+  uint8_t b;
+
+  if (p < end && *p < 0x80) {
+    *pp = p + 1;
+    *val = *p;
+    return Extprot_NoError;
+  }
+  if ((size_t) (end - p) < 10) {
+    return read_vint_slow(pp, end, val);
+  }
+
+  v = p[0] & 0x7f;
+  VINT_STEP(1);
+  VINT_STEP(2);
+  VINT_STEP(3);
+  VINT_STEP(4);
+  VINT_STEP(5);
+  VINT_STEP(6);
+  VINT_STEP(7);
+  VINT_STEP(8);
+  b = p[9];
+  if (b > 1) {
+    return Extprot_VintOverflow;
+  }
+  *pp = p + 10;
+  *val = v | ((uint64_t) b << 63);
+  return Extprot_NoError;
+}
+
+#undef VINT_STEP
+
+static Extprot_Error read_vint_64(Extprot_Decoder_State *state, uint64_t *val) {
+  uint8_t const *p = &PEEK_BYTE(state);
+  CHECK(extprot_read_vint(&p, &BUFFER_AT(state, state->input_length), val));
+  state->index = p - (uint8_t const *) state->buffer;
+  return Extprot_NoError;
+}
+
+/* Steps over the body of a value whose prefix has been read. Vint
+   bodies may be of any length, as bignums are. */
+Extprot_Error extprot_skip_body(uint8_t const **pp, uint8_t const *end, uint64_t tag_and_type) {
+  uint8_t const *p = *pp;
+  uint64_t n;
+
+  if (tag_and_type & 1) {
+    CHECK(extprot_read_vint(&p, end, &n));
+  } else {
+    switch (tag_and_type & 0xf) {
+      case EXTPROT_VINT:
+	do {
+	  if (p == end) {
+	    return Extprot_EarlyEOF;
+	  }
+	} while (*p++ & 0x80);
+	n = 0;
+	break;
+      case EXTPROT_BITS8: n = 1; break;
+      case EXTPROT_BITS32: n = 4; break;
+      case EXTPROT_BITS64_LONG:
+      case EXTPROT_BITS64_FLOAT: n = 8; break;
+      case EXTPROT_ENUM: n = 0; break;
+      default: return Extprot_InvalidTag;
+    }
+  }
+  if (n > (uint64_t) (end - p)) {
+    return Extprot_EarlyEOF;
+  }
+  *pp = p + n;
+  return Extprot_NoError;
+}
+
 #ifndef EXTPROT_NO_BIGNUMS
 static Extprot_Error decode_vint(Extprot_Decoder_State *state, Extprot_Tag tag) {
-  size_t byte_count = 0;
-  size_t base_index = state->index;
-  uint8_t b;
-  do {
-    CHECK_LIMIT(state);
-    b = PEEK_BYTE(state);
-    ADVANCE(state);
-    byte_count++;
-  } while (b & 0x80);
-  SET_ACC(state, extprot_vint(state->pool, tag));
-  mpz_import(ACC(state)->body.vint.value, byte_count, -1, 1, 0, 1, &BUFFER_AT(state, base_index));
+  uint8_t const *start = &PEEK_BYTE(state);
+  uint8_t const *p = start;
+  CHECK(extprot_skip_body(&p, &BUFFER_AT(state, state->input_length), EXTPROT_VINT));
+  ADVANCE_BY(state, p - start);
+  SET_ACC(state, extprot_vint_wire(state->pool, tag, start, p - start));
   return Extprot_NoError;
 }
 #endif
@@ -114,17 +238,7 @@ static Extprot_Error read_fixed_int_64(Extprot_Decoder_State *state, int64_t *va
   return Extprot_NoError;
 }
 
-static Extprot_Error read_n_into(Extprot_Decoder_State *state, size_t count) {
-  Extprot_Object *o = ACC(state);
-  size_t i;
-  for (i = 0; i < count; i++) {
-    CHECK(decode(state));
-    o->body.tuple.vec[i] = ACC(state);
-  }
-  SET_ACC(state, o);
-  return Extprot_NoError;
-}
-
+/* Decodes a non-tuple value; tuples are handled by decode() itself. */
 static Extprot_Error decode1(Extprot_Decoder_State *state,
 			     Extprot_Tag tag,
 			     int wire_type,
@@ -172,8 +286,10 @@ static Extprot_Error decode1(Extprot_Decoder_State *state,
     case EXTPROT_BITS64_FLOAT:
       {
 	int64_t val;
+	double d;
 	CHECK(read_fixed_int_64(state, &val));
-	SET_ACC(state, extprot_bits64_float(state->pool, tag, * (double *) &val));
+	memcpy(&d, &val, 8);
+	SET_ACC(state, extprot_bits64_float(state->pool, tag, d));
 	return Extprot_NoError;
       }
 
@@ -181,53 +297,50 @@ static Extprot_Error decode1(Extprot_Decoder_State *state,
       SET_ACC(state, extprot_enum(state->pool, tag));
       return Extprot_NoError;
 
-    case EXTPROT_TUPLE:
-      {
-	uint64_t n_elems;
-	CHECK(read_vint_64(state, &n_elems));
-	SET_ACC(state, extprot_tuple(state->pool, tag, n_elems));
-	CHECK(read_n_into(state, n_elems));
-	return Extprot_NoError;
-      }
-
-    case EXTPROT_HTUPLE:
-      {
-	uint64_t n_elems;
-	CHECK(read_vint_64(state, &n_elems));
-	SET_ACC(state, extprot_htuple(state->pool, tag, n_elems));
-	CHECK(read_n_into(state, n_elems));
-	return Extprot_NoError;
-      }
-
     case EXTPROT_BYTES:
-      SET_ACC(state, extprot_bytes(state->pool, tag, &BUFFER_AT(state, state->index), len));
+      if (state->flags & EXTPROT_DECODE_ZERO_COPY) {
+	SET_ACC(state, extprot_bytes_ref(state->pool, tag, &BUFFER_AT(state, state->index), len));
+      } else {
+	SET_ACC(state, extprot_bytes(state->pool, tag, &BUFFER_AT(state, state->index), len));
+      }
       ADVANCE_BY(state, len);
       return Extprot_NoError;
 
-    case EXTPROT_ASSOC:
-      {
-	uint64_t n_pairs;
-	CHECK(read_vint_64(state, &n_pairs));
-	SET_ACC(state, extprot_assoc(state->pool, tag, n_pairs));
-	CHECK(read_n_into(state, n_pairs * 2));
-	return Extprot_NoError;
-      }
-
     default:
       return Extprot_InvalidTag;
   }
 }
 
+static void init_state(Extprot_Decoder_State *state,
+		       Extprot_Pool *pool,
+		       void const *buffer,
+		       size_t len,
+		       Extprot_Decode_Options const *opts)
+{
+  state->pool = pool;
+  state->buffer = buffer;
+  state->input_length = len;
+  state->index = 0;
+  state->flags = opts ? opts->flags : 0;
+  state->stack = NULL;
+  state->depth = 0;
+  state->stack_capacity = 0;
+  state->max_depth = opts ? opts->max_depth : 0;
+  state->outer_depth = 0;
+  state->outer_index = 0;
+  state->stats = pool ? pool->stats : NULL;
+  state->budget = opts && opts->max_bytes ? opts->max_bytes : (size_t) -1;
+  state->raw = opts ? opts->raw : NULL;
+  state->raw_arg = opts ? opts->raw_arg : NULL;
+}
+
 Extprot_Error extprot_decode_header(void const *buffer,
 				    size_t in_len,
 				    uint32_t *tag_and_type,
 				    size_t *total_len)
 {
   Extprot_Decoder_State stateRecord;
-  stateRecord.pool = NULL;
-  stateRecord.buffer = buffer;
-  stateRecord.input_length = in_len;
-  stateRecord.index = 0;
+  init_state(&stateRecord, NULL, buffer, in_len, NULL);
 
   uint64_t v;
   CHECK(read_vint_64(&stateRecord, &v));
@@ -265,34 +378,1241 @@ Extprot_Error extprot_decode_header(void const *buffer,
   }
 }
 
-static Extprot_Error decode(Extprot_Decoder_State *state) {
-  uint64_t tag_and_type;
-  CHECK(read_vint_64(state, &tag_and_type));
-  size_t len = 0;
-  if (tag_and_type & 1) {
-    uint64_t tmp_len;
-    CHECK(read_vint_64(state, &tmp_len));
-    len = (size_t) tmp_len;
-    if (len != tmp_len) {
-      return Extprot_SizeTOverflow;
+/* Same header logic as extprot_decode_header(), but kept in one loop
+   over a single state so that nothing is reinitialised per message. */
+Extprot_Error extprot_scan_frames(void const *buffer,
+				  size_t len,
+				  Extprot_Frame *frames,
+				  size_t max_frames,
+				  size_t *num_frames,
+				  size_t *consumed)
+{
+  Extprot_Decoder_State stateRecord;
+  Extprot_Decoder_State *state = &stateRecord;
+  Extprot_Error e = Extprot_NoError;
+  size_t n = 0, start = 0;
+
+  init_state(state, NULL, buffer, len, NULL);
+
+  while (n < max_frames && start < len) {
+    uint64_t kind, body;
+
+    e = read_vint_64(state, &kind);
+    if (e) {
+      break;
+    }
+    switch (kind & 0xf) {
+      case EXTPROT_BITS8: body = 1; break;
+      case EXTPROT_BITS32: body = 4; break;
+      case EXTPROT_BITS64_LONG:
+      case EXTPROT_BITS64_FLOAT: body = 8; break;
+      case EXTPROT_ENUM: body = 0; break;
+      case EXTPROT_TUPLE:
+      case EXTPROT_HTUPLE:
+      case EXTPROT_BYTES:
+      case EXTPROT_ASSOC:
+	e = read_vint_64(state, &body);
+	break;
+      default:
+	e = Extprot_InvalidTag;
+	break;
+    }
+    if (e) {
+      break;
+    }
+    if (body > len - state->index) {
+      e = Extprot_EarlyEOF;
+      break;
+    }
+    ADVANCE_BY(state, body);
+
+    frames[n].offset = start;
+    frames[n].length = state->index - start;
+    frames[n].tag_and_type = (uint32_t) kind;
+    n++;
+    start = state->index;
+  }
+
+  *num_frames = n;
+  *consumed = start;
+  return e == Extprot_EarlyEOF ? Extprot_NoError : e;
+}
+
+static Extprot_Error push_frame(Extprot_Decoder_State *state, Extprot_Object *o, size_t total) {
+  Extprot_Decode_Frame *f;
+
+  if (state->max_depth != 0 && state->outer_depth + state->depth >= state->max_depth) {
+    return Extprot_TooDeep;
+  }
+  if (state->depth == state->stack_capacity) {
+    size_t newcap = state->stack_capacity * 2;
+    Extprot_Decode_Frame *newstack;
+    if (state->stack_capacity == INLINE_FRAMES) {
+      newstack = malloc(newcap * sizeof(Extprot_Decode_Frame));
+      if (newstack != NULL) {
+	memcpy(newstack, state->stack, state->depth * sizeof(Extprot_Decode_Frame));
+      }
+    } else {
+      newstack = realloc(state->stack, newcap * sizeof(Extprot_Decode_Frame));
+    }
+    if (newstack == NULL) {
+      return Extprot_NoMemory;
+    }
+    state->stack = newstack;
+    state->stack_capacity = newcap;
+  }
+
+  f = &state->stack[state->depth++];
+  if (state->stats != NULL && state->outer_depth + state->depth > state->stats->max_depth) {
+    state->stats->max_depth = state->outer_depth + state->depth;
+  }
+  f->o = o;
+  f->next = 0;
+  f->total = total;
+  return Extprot_NoError;
+}
+
+/* Called with the index just past an htuple's element count. If all
+   n_elems elements are fixed-width scalars sharing one tag, which shows
+   in the body being exactly n_elems equal-sized, equal-headed records,
+   decodes them into a packed array and sets *out; otherwise leaves the
+   input untouched and *out NULL. */
+static Extprot_Error decode_packed(Extprot_Decoder_State *state,
+				   Extprot_Tag tag,
+				   size_t remaining,
+				   uint64_t n_elems,
+				   Extprot_Object **out)
+{
+  Extprot_Decoder_State probe = *state;
+  uint64_t elem_kind;
+  size_t klen, width, stride, i;
+  uint8_t const *base;
+  Extprot_Object *o;
+  void *data;
+
+  *out = NULL;
+  CHECK(read_vint_64(&probe, &elem_kind));
+  klen = probe.index - state->index;
+  width = extprot_packed_width((int) (elem_kind & 0xf));
+  if (width == 0 || (elem_kind >> 32) != 0) {
+    return Extprot_NoError;
+  }
+  stride = klen + width;
+  if (n_elems != remaining / stride || remaining % stride != 0) {
+    return Extprot_NoError;
+  }
+
+  base = &PEEK_BYTE(state);
+  for (i = 1; i < n_elems; i++) {
+    if (memcmp(base + i * stride, base, klen) != 0) {
+      return Extprot_NoError;
     }
-    PRE_CHECK_LIMIT(state, len);
   }
-  CHECK(decode1(state, (Extprot_Tag) (tag_and_type >> 4), (int) (tag_and_type & 0xf), len));
-  ACC(state)->kind |= ((uint32_t) tag_and_type) & ~0xf;
+
+  CHARGE(state, sizeof(Extprot_Object));
+  CHARGE(state, n_elems * width);
+  data = extprot_pool_alloc(state->pool, n_elems * width);
+  for (i = 0; i < n_elems; i++) {
+    uint8_t const *p = base + i * stride + klen;
+    uint64_t v = 0;
+    size_t j;
+    for (j = width; j > 0; j--) {
+      v = (v << 8) | p[j - 1];
+    }
+    switch (width) {
+      case 1: ((uint8_t *) data)[i] = (uint8_t) v; break;
+      case 4: ((uint32_t *) data)[i] = (uint32_t) v; break;
+      default: memcpy((uint64_t *) data + i, &v, 8); break;
+    }
+  }
+  ADVANCE_BY(state, remaining);
+
+  o = extprot_htuple_packed(state->pool, tag, (Extprot_Tag) (elem_kind >> 4),
+			    (int) (elem_kind & 0xf), data, n_elems);
+  *out = o;
   return Extprot_NoError;
 }
 
+static Extprot_Error skip_value(Extprot_Decoder_State *state);
+
+/* Keeps the value starting at start, whose header has been read, as a
+   raw node covering its whole encoding. */
+static Extprot_Error decode_raw(Extprot_Decoder_State *state, size_t start,
+				uint32_t tag_and_type, size_t len,
+				Extprot_Object **out)
+{
+  uint8_t const *p = &BUFFER_AT(state, start);
+
+  if (tag_and_type & 1) {
+    ADVANCE_BY(state, len);
+  } else {
+    state->index = start;
+    CHECK(skip_value(state));
+  }
+  if (state->flags & EXTPROT_DECODE_ZERO_COPY) {
+    CHARGE(state, sizeof(Extprot_Object));
+    *out = extprot_raw_ref(state->pool, tag_and_type, p, state->index - start);
+  } else {
+    CHARGE(state, sizeof(Extprot_Object) + state->index - start + 1);
+    *out = extprot_raw(state->pool, tag_and_type, p, state->index - start);
+  }
+  return Extprot_NoError;
+}
+
+/* Keeps a tuple's elements undecoded, as a lazy node over the rest of
+   its body; body_at is where the body began, before the count. The node
+   takes the place of a frame, so is subject to the same depth limit. */
+static Extprot_Error decode_lazy(Extprot_Decoder_State *state, uint32_t tag_and_type,
+				 uint64_t n_elems, size_t body_at, size_t len,
+				 Extprot_Object **out)
+{
+  uint8_t const *data = &PEEK_BYTE(state);
+  unsigned flags = state->flags;
+  size_t rest;
+  Extprot_Lazy *l;
+
+  if (state->index - body_at > len) {
+    return Extprot_EarlyEOF;
+  }
+  if (state->max_depth != 0 && state->outer_depth + state->depth >= state->max_depth) {
+    return Extprot_TooDeep;
+  }
+  rest = len - (state->index - body_at);
+  CHARGE(state, sizeof(Extprot_Object) + sizeof(Extprot_Lazy) + sizeof(Extprot_Object *) *
+	 ((tag_and_type & 0xf) == EXTPROT_ASSOC ? 2 * (size_t) n_elems + 1 : (size_t) n_elems));
+  if (!(flags & EXTPROT_DECODE_ZERO_COPY)) {
+    uint8_t *copy;
+    CHARGE(state, rest);
+    copy = extprot_pool_alloc(state->pool, rest);
+    memcpy(copy, data, rest);
+    data = copy;
+    flags |= EXTPROT_DECODE_ZERO_COPY;
+  }
+  *out = extprot_lazy_tuple(state->pool, tag_and_type, (size_t) n_elems, data, rest, flags);
+  l = EXTPROT_LAZY(*out);
+  l->depth = state->outer_depth + state->depth + 1;
+  l->max_depth = state->max_depth;
+  l->budget = state->budget;
+  l->raw = state->raw;
+  l->raw_arg = state->raw_arg;
+  ADVANCE_BY(state, rest);
+  return Extprot_NoError;
+}
+
+#define COUNT_OBJECT(state, o)				\
+  do {							\
+    if ((state)->stats != NULL) {			\
+      (state)->stats->objects[(o)->kind & 0xf]++;	\
+    }							\
+  } while (0)
+
+/* Decodes one value without recursing: each tuple with elements still
+   to come sits on the frame stack, and every finished value is filed
+   into its parent, completing (and popping) parents as it goes. */
+static Extprot_Error decode_iter(Extprot_Decoder_State *state) {
+  while (1) {
+    uint64_t tag_and_type;
+    size_t len = 0;
+    Extprot_Tag tag;
+    Extprot_Object *o;
+    size_t start = state->index;
+
+    CHECK(read_vint_64(state, &tag_and_type));
+    if (tag_and_type & 1) {
+      uint64_t tmp_len;
+      CHECK(read_vint_64(state, &tmp_len));
+      len = (size_t) tmp_len;
+      if (len != tmp_len) {
+	return Extprot_SizeTOverflow;
+      }
+      PRE_CHECK_LIMIT(state, len);
+    }
+    tag = (Extprot_Tag) (tag_and_type >> 4);
+
+    if (state->raw != NULL &&
+	state->raw(state->raw_arg, state->outer_depth + state->depth,
+		   state->depth > 0 ? state->stack[state->depth - 1].next : state->outer_index,
+		   (uint32_t) tag_and_type)) {
+      CHECK(decode_raw(state, start, (uint32_t) tag_and_type, len, &o));
+    } else {
+      switch (tag_and_type & 0xf) {
+	case EXTPROT_TUPLE:
+	case EXTPROT_HTUPLE:
+	case EXTPROT_ASSOC:
+	  {
+	    size_t body_at = state->index;
+	    uint64_t n_elems;
+	    CHECK(read_vint_64(state, &n_elems));
+	    if (state->index - body_at > len ||
+		!plausible_count(n_elems, (int) (tag_and_type & 0xf), len - (state->index - body_at))) {
+	      return Extprot_BadCount;
+	    }
+	    if ((tag_and_type & 0xf) == EXTPROT_HTUPLE &&
+		(state->flags & EXTPROT_DECODE_PACK_ARRAYS) && n_elems > 0 &&
+		state->index - body_at <= len) {
+	      CHECK(decode_packed(state, tag, len - (state->index - body_at), n_elems, &o));
+	      if (o != NULL) {
+		o->kind |= ((uint32_t) tag_and_type) & ~0xf;
+		break;
+	      }
+	    }
+	    if ((state->flags & EXTPROT_DECODE_LAZY) && n_elems > 0) {
+	      CHECK(decode_lazy(state, (uint32_t) tag_and_type, n_elems, body_at, len, &o));
+	      break;
+	    }
+	    CHARGE(state, sizeof(Extprot_Object) +
+		   ((tag_and_type & 0xf) == EXTPROT_ASSOC ? 2 : 1) * (size_t) n_elems
+		   * sizeof(Extprot_Object *));
+	    switch (tag_and_type & 0xf) {
+	      case EXTPROT_TUPLE: o = extprot_tuple(state->pool, tag, n_elems); break;
+	      case EXTPROT_HTUPLE: o = extprot_htuple(state->pool, tag, n_elems); break;
+	      default: o = extprot_assoc(state->pool, tag, n_elems); n_elems *= 2; break;
+	    }
+	    o->kind |= ((uint32_t) tag_and_type) & ~0xf;
+	    if (n_elems > 0) {
+	      COUNT_OBJECT(state, o);
+	      CHECK(push_frame(state, o, n_elems));
+	      continue;
+	    }
+	    break;
+	  }
+
+	default:
+	  CHARGE(state, sizeof(Extprot_Object) +
+		 ((tag_and_type & 0xf) == EXTPROT_BYTES && !(state->flags & EXTPROT_DECODE_ZERO_COPY)
+		  ? len + 1 : 0));
+	  CHECK(decode1(state, tag, (int) (tag_and_type & 0xf), len));
+	  o = ACC(state);
+	  o->kind |= ((uint32_t) tag_and_type) & ~0xf;
+	  break;
+      }
+    }
+    COUNT_OBJECT(state, o);
+
+    while (1) {
+      Extprot_Decode_Frame *f;
+      if (state->depth == 0) {
+	SET_ACC(state, o);
+	return Extprot_NoError;
+      }
+      f = &state->stack[state->depth - 1];
+      f->o->body.tuple.vec[f->next++] = o;
+      if (f->next < f->total) {
+	break;
+      }
+      o = f->o;
+      state->depth--;
+      if ((state->flags & EXTPROT_DECODE_INDEX_ASSOC) && (o->kind & 0xf) == EXTPROT_ASSOC) {
+	CHARGE(state, (4 * o->body.tuple.length + 2) * sizeof(size_t));	/* at most */
+	CHECK(extprot_assoc_build_index(state->pool, o));
+      }
+    }
+  }
+}
+
+static Extprot_Error decode(Extprot_Decoder_State *state) {
+  Extprot_Decode_Frame inline_stack[INLINE_FRAMES];
+  Extprot_Error e;
+
+  state->stack = inline_stack;
+  state->depth = 0;
+  state->stack_capacity = INLINE_FRAMES;
+  if (state->stats != NULL) {
+    state->stats->decodes++;
+  }
+
+  e = decode_iter(state);
+
+  if (state->stack != inline_stack) {
+    free(state->stack);
+  }
+  state->stack = NULL;
+  return e;
+}
+
 Extprot_Error extprot_decode(Extprot_Pool *pool,
 			     void const *buffer,
 			     size_t len)
+{
+  return extprot_decode_with(pool, buffer, len, NULL);
+}
+
+static Extprot_Error skip_value(Extprot_Decoder_State *state) {
+  uint64_t tag_and_type;
+  uint8_t const *p;
+  CHECK(read_vint_64(state, &tag_and_type));
+  p = &PEEK_BYTE(state);
+  CHECK(extprot_skip_body(&p, &BUFFER_AT(state, state->input_length), tag_and_type));
+  state->index = p - (uint8_t const *) state->buffer;
+  return Extprot_NoError;
+}
+
+/* Walks down the path, jumping over unwanted elements using their
+   length prefixes, then decodes just the value found at the end. The
+   input limit shrinks to each enclosing value as we descend, so a
+   corrupt inner value cannot run past its parent. */
+Extprot_Error extprot_decode_path(Extprot_Pool *pool,
+				  void const *buffer,
+				  size_t len,
+				  size_t const *path,
+				  size_t path_len,
+				  Extprot_Decode_Options const *opts)
 {
   Extprot_Decoder_State stateRecord;
-  stateRecord.pool = pool;
-  stateRecord.buffer = buffer;
-  stateRecord.input_length = len;
-  stateRecord.index = 0;
+  size_t i, j;
+
+  init_state(&stateRecord, pool, buffer, len, opts);
+
+  for (i = 0; i < path_len; i++) {
+    uint64_t tag_and_type;
+    uint64_t body_len;
+    uint64_t n_elems;
+
+    CHECK(read_vint_64(&stateRecord, &tag_and_type));
+    switch (tag_and_type & 0xf) {
+      case EXTPROT_TUPLE:
+      case EXTPROT_HTUPLE:
+      case EXTPROT_ASSOC:
+	break;
+      default:
+	return Extprot_PathNotFound;
+    }
+
+    CHECK(read_vint_64(&stateRecord, &body_len));
+    if (body_len > stateRecord.input_length - stateRecord.index) {
+      return Extprot_EarlyEOF;
+    }
+    stateRecord.input_length = stateRecord.index + (size_t) body_len;
+
+    CHECK(read_vint_64(&stateRecord, &n_elems));
+    if (!plausible_count(n_elems, (int) (tag_and_type & 0xf),
+			 stateRecord.input_length - stateRecord.index)) {
+      return Extprot_BadCount;
+    }
+    if ((tag_and_type & 0xf) == EXTPROT_ASSOC) {
+      n_elems *= 2;
+    }
+    if (path[i] >= n_elems) {
+      return Extprot_PathNotFound;
+    }
+    for (j = 0; j < path[i]; j++) {
+      CHECK(skip_value(&stateRecord));
+    }
+  }
+
+  /* the value keeps its depth and index in the whole message */
+  if (path_len > 0) {
+    stateRecord.outer_depth = path_len;
+    stateRecord.outer_index = path[path_len - 1];
+  }
+  return decode(&stateRecord);
+}
+
+void extprot_decode_options_init(Extprot_Decode_Options *opts) {
+  opts->flags = 0;
+  opts->max_depth = 0;
+  opts->max_bytes = 0;
+  opts->raw = NULL;
+  opts->raw_arg = NULL;
+}
 
+Extprot_Error extprot_decode_with(Extprot_Pool *pool,
+				  void const *buffer,
+				  size_t len,
+				  Extprot_Decode_Options const *opts)
+{
+  Extprot_Decoder_State stateRecord;
+  init_state(&stateRecord, pool, buffer, len, opts);
   return decode(&stateRecord);
 }
 
+/* Lazy tuples. The first access to an element finds where each one
+   starts by skipping over them all; elements are then decoded one at
+   a time, with the options the tuple itself was decoded with. */
+
+/* Finds the number of element slots in o; returns 0 if o has none */
+static int tuple_slots(Extprot_Object const *o, size_t *n) {
+  if (o->flags & (EXTPROT_FLAG_PACKED | EXTPROT_FLAG_RAW)) {
+    return 0;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+      *n = o->body.tuple.length;
+      return 1;
+    case EXTPROT_ASSOC:
+      *n = 2 * o->body.tuple.length;
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static Extprot_Error lazy_scan(Extprot_Pool *pool, Extprot_Object *o, size_t n) {
+  Extprot_Lazy *l = EXTPROT_LAZY(o);
+  Extprot_Decoder_State stateRecord;
+  size_t *offsets;
+  size_t i;
+
+  init_state(&stateRecord, pool, l->data, l->length, NULL);
+  stateRecord.budget = l->budget;
+  CHARGE(&stateRecord, (n + 1) * sizeof(size_t));
+  l->budget = stateRecord.budget;
+  offsets = extprot_pool_alloc(pool, (n + 1) * sizeof(size_t));
+  for (i = 0; i < n; i++) {
+    offsets[i] = stateRecord.index;
+    CHECK(skip_value(&stateRecord));
+  }
+  offsets[n] = stateRecord.index;
+  l->offsets = offsets;
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_tuple_get(Extprot_Pool *pool, Extprot_Object *o,
+				size_t i, Extprot_Object **out)
+{
+  size_t n;
+
+  if (!tuple_slots(o, &n)) {
+    return Extprot_BadWireType;
+  }
+  if (i >= n) {
+    return Extprot_PathNotFound;
+  }
+  if (o->body.tuple.vec[i] == NULL && (o->flags & EXTPROT_FLAG_LAZY)) {
+    Extprot_Lazy *l = EXTPROT_LAZY(o);
+    Extprot_Decoder_State stateRecord;
+    Extprot_Object *root = pool->root;
+    Extprot_Error e;
+
+    if (l->offsets == NULL) {
+      CHECK(lazy_scan(pool, o, n));
+    }
+    init_state(&stateRecord, pool, l->data + l->offsets[i],
+	       l->offsets[i + 1] - l->offsets[i], NULL);
+    stateRecord.flags = l->flags;
+    stateRecord.max_depth = l->max_depth;
+    stateRecord.outer_depth = l->depth;
+    stateRecord.outer_index = i;
+    stateRecord.budget = l->budget;
+    stateRecord.raw = l->raw;
+    stateRecord.raw_arg = l->raw_arg;
+    e = decode(&stateRecord);
+    l->budget = stateRecord.budget;
+    if (e == Extprot_NoError) {
+      o->body.tuple.vec[i] = ACC(&stateRecord);
+      if (--l->missing == 0) {
+	o->flags &= ~EXTPROT_FLAG_LAZY;
+      }
+    }
+    pool->root = root;
+    CHECK(e);
+  }
+  *out = o->body.tuple.vec[i];
+  return Extprot_NoError;
+}
+
+/* Walks the tree depth-first with a frame per node whose elements are
+   still being expanded, spilling to the heap as decode() does. */
+Extprot_Error extprot_expand(Extprot_Pool *pool, Extprot_Object *o, int deep) {
+  Extprot_Decode_Frame inline_stack[INLINE_FRAMES];
+  Extprot_Decode_Frame *stack = inline_stack, *f;
+  size_t depth = 0, capacity = INLINE_FRAMES;
+  Extprot_Error e = Extprot_NoError;
+  Extprot_Object *elem;
+  size_t n;
+
+  if (!tuple_slots(o, &n) || (!deep && !(o->flags & EXTPROT_FLAG_LAZY))) {
+    return Extprot_NoError;
+  }
+  stack[0].o = o;
+  stack[0].next = 0;
+  stack[0].total = n;
+  depth = 1;
+  while (depth > 0) {
+    f = &stack[depth - 1];
+    if (f->next == f->total) {
+      depth--;
+      continue;
+    }
+    e = extprot_tuple_get(pool, f->o, f->next++, &elem);
+    if (e != Extprot_NoError) {
+      break;
+    }
+    if (!deep || !tuple_slots(elem, &n) || n == 0) {
+      continue;
+    }
+    if (depth == capacity) {
+      Extprot_Decode_Frame *newstack;
+      if (stack == inline_stack) {
+	newstack = malloc(2 * capacity * sizeof(Extprot_Decode_Frame));
+	if (newstack != NULL) {
+	  memcpy(newstack, stack, depth * sizeof(Extprot_Decode_Frame));
+	}
+      } else {
+	newstack = realloc(stack, 2 * capacity * sizeof(Extprot_Decode_Frame));
+      }
+      if (newstack == NULL) {
+	e = Extprot_NoMemory;
+	break;
+      }
+      stack = newstack;
+      capacity *= 2;
+    }
+    f = &stack[depth++];
+    f->o = elem;
+    f->next = 0;
+    f->total = n;
+  }
+
+  if (stack != inline_stack) {
+    free(stack);
+  }
+  return e;
+}
+
+
+/* Event decoding walks the input as decode_iter() does, keeping only
+   element counts on the frame stack, which stays on the C stack unless
+   nesting goes past INLINE_FRAMES. */
+
+#define ON_SCALAR(v)							\
+  if (ev->on_scalar != NULL) {						\
+    r = ev->on_scalar(arg, tag, (int) (tag_and_type & 0xf), (v), start); \
+  }
+
+static Extprot_Error events_iter(Extprot_Decoder_State *state,
+				 Extprot_Events const *ev, void *arg)
+{
+  while (1) {
+    uint64_t tag_and_type, v;
+    size_t len = 0;
+    size_t start = state->index;
+    Extprot_Tag tag;
+    int r = EXTPROT_EVENT_CONTINUE;
+
+    CHECK(read_vint_64(state, &tag_and_type));
+    if (tag_and_type & 1) {
+      CHECK(read_vint_64(state, &v));
+      len = (size_t) v;
+      if (len != v) {
+	return Extprot_SizeTOverflow;
+      }
+      PRE_CHECK_LIMIT(state, len);
+    }
+    tag = (Extprot_Tag) (tag_and_type >> 4);
+
+    switch (tag_and_type & 0xf) {
+      case EXTPROT_TUPLE:
+      case EXTPROT_HTUPLE:
+      case EXTPROT_ASSOC:
+	{
+	  size_t body_at = state->index;
+	  int (*begin)(void *, Extprot_Tag, size_t, size_t);
+	  uint64_t n_elems;
+
+	  CHECK(read_vint_64(state, &n_elems));
+	  if (state->index - body_at > len ||
+	      !plausible_count(n_elems, (int) (tag_and_type & 0xf), len - (state->index - body_at))) {
+	    return Extprot_BadCount;
+	  }
+	  switch (tag_and_type & 0xf) {
+	    case EXTPROT_TUPLE: begin = ev->on_begin_tuple; break;
+	    case EXTPROT_HTUPLE: begin = ev->on_begin_htuple; break;
+	    default: begin = ev->on_begin_assoc; break;
+	  }
+	  if (begin != NULL) {
+	    r = begin(arg, tag, (size_t) n_elems, start);
+	  }
+	  if (r == EXTPROT_EVENT_SKIP) {
+	    state->index = body_at + len;
+	    r = EXTPROT_EVENT_CONTINUE;
+	    break;
+	  }
+	  if ((tag_and_type & 0xf) == EXTPROT_ASSOC) {
+	    n_elems *= 2;
+	  }
+	  if (r == EXTPROT_EVENT_CONTINUE && n_elems > 0) {
+	    CHECK(push_frame(state, NULL, (size_t) n_elems));
+	    state->stack[state->depth - 1].kind = (uint32_t) tag_and_type;
+	    continue;
+	  }
+	  if (r == EXTPROT_EVENT_CONTINUE && ev->on_end != NULL) {
+	    r = ev->on_end(arg, tag, (int) (tag_and_type & 0xf), state->index);
+	  }
+	  break;
+	}
+
+      case EXTPROT_BYTES:
+	if (ev->on_bytes != NULL) {
+	  r = ev->on_bytes(arg, tag, EXTPROT_BYTES, &BUFFER_AT(state, state->index), len, start);
+	}
+	ADVANCE_BY(state, len);
+	break;
+
+      case EXTPROT_VINT:
+	{
+	  size_t value_at = state->index;
+	  Extprot_Error e = read_vint_64(state, &v);
+	  if (e == Extprot_VintOverflow) {
+	    uint8_t const *p = &PEEK_BYTE(state);
+	    CHECK(extprot_skip_body(&p, &BUFFER_AT(state, state->input_length), EXTPROT_VINT));
+	    state->index = p - (uint8_t const *) state->buffer;
+	    if (ev->on_bytes != NULL) {
+	      r = ev->on_bytes(arg, tag, EXTPROT_VINT, &BUFFER_AT(state, value_at),
+			       state->index - value_at, start);
+	    }
+	    break;
+	  }
+	  CHECK(e);
+	  ON_SCALAR(v);
+	  break;
+	}
+
+      case EXTPROT_BITS8:
+	CHECK_LIMIT(state);
+	v = PEEK_BYTE(state);
+	ADVANCE(state);
+	ON_SCALAR(v);
+	break;
+
+      case EXTPROT_BITS32:
+	PRE_CHECK_LIMIT(state, 4);
+	v = (uint32_t) BUFFER_AT(state, state->index)
+	  | (uint32_t) BUFFER_AT(state, state->index + 1) << 8
+	  | (uint32_t) BUFFER_AT(state, state->index + 2) << 16
+	  | (uint32_t) BUFFER_AT(state, state->index + 3) << 24;
+	ADVANCE_BY(state, 4);
+	ON_SCALAR(v);
+	break;
+
+      case EXTPROT_BITS64_LONG:
+      case EXTPROT_BITS64_FLOAT:
+	{
+	  int64_t val;
+	  CHECK(read_fixed_int_64(state, &val));
+	  ON_SCALAR((uint64_t) val);
+	  break;
+	}
+
+      case EXTPROT_ENUM:
+	ON_SCALAR(0);
+	break;
+
+      default:
+	return Extprot_InvalidTag;
+    }
+
+    while (1) {
+      Extprot_Decode_Frame *f;
+      if (r == EXTPROT_EVENT_STOP || state->depth == 0) {
+	return Extprot_NoError;
+      }
+      f = &state->stack[state->depth - 1];
+      if (++f->next < f->total) {
+	break;
+      }
+      state->depth--;
+      r = EXTPROT_EVENT_CONTINUE;
+      if (ev->on_end != NULL) {
+	r = ev->on_end(arg, (Extprot_Tag) (f->kind >> 4), (int) (f->kind & 0xf), state->index);
+      }
+    }
+  }
+}
+
+Extprot_Error extprot_decode_events(void const *buffer,
+				    size_t len,
+				    Extprot_Decode_Options const *opts,
+				    Extprot_Events const *ev,
+				    void *arg)
+{
+  Extprot_Decoder_State stateRecord;
+  Extprot_Decode_Frame inline_stack[INLINE_FRAMES];
+  Extprot_Error e;
+
+  init_state(&stateRecord, NULL, buffer, len, opts);
+  stateRecord.stack = inline_stack;
+  stateRecord.stack_capacity = INLINE_FRAMES;
+
+  e = events_iter(&stateRecord, ev, arg);
+
+  if (stateRecord.stack != inline_stack) {
+    free(stateRecord.stack);
+  }
+  return e;
+}
+
+/* Incremental decoding. The state machine below keeps everything it
+   needs between calls in the Extprot_Stream_Decoder: a partially read
+   vint or fixed-width value, the bytes of a bytes body or bignum read
+   so far, and an explicit stack of the tuples still being filled in,
+   whose elements are gathered in elems until the last one arrives. */
+
+enum {
+  STREAM_KIND,
+  STREAM_LENGTH,
+  STREAM_COUNT,
+  STREAM_VINT,
+  STREAM_FIXED,
+  STREAM_BYTES,
+  STREAM_DONE
+};
+
+void extprot_stream_init_with(Extprot_Stream_Decoder *d, Extprot_Pool *pool,
+			      Extprot_Decode_Options const *opts)
+{
+  d->pool = pool;
+  d->max_depth = opts ? opts->max_depth : 0;
+  d->max_bytes = opts ? opts->max_bytes : 0;
+
+  d->depth = 0;
+  d->stack_capacity = 0;
+  d->stack = NULL;
+
+  d->elems = NULL;
+  d->elems_count = 0;
+  d->elems_capacity = 0;
+
+  d->scratch = NULL;
+  d->scratch_capacity = 0;
+
+  extprot_stream_reset(d);
+}
+
+void extprot_stream_init(Extprot_Stream_Decoder *d, Extprot_Pool *pool) {
+  extprot_stream_init_with(d, pool, NULL);
+}
+
+void extprot_stream_reset(Extprot_Stream_Decoder *d) {
+  d->phase = STREAM_KIND;
+  d->error = Extprot_NoError;
+  d->budget = d->max_bytes ? d->max_bytes : (size_t) -1;
+  d->tag_and_type = 0;
+  d->len = 0;
+  d->end = 0;
+  d->offset = 0;
+  d->acc = 0;
+  d->vint_got = 0;
+  d->got = 0;
+  d->need = 0;
+  d->depth = 0;
+  d->elems_count = 0;
+}
+
+void extprot_stream_free(Extprot_Stream_Decoder *d) {
+  if (d->stack != NULL) {
+    free(d->stack);
+  }
+  d->stack = NULL;
+  d->stack_capacity = 0;
+  d->depth = 0;
+
+  if (d->elems != NULL) {
+    free(d->elems);
+  }
+  d->elems = NULL;
+  d->elems_capacity = 0;
+  d->elems_count = 0;
+
+  if (d->scratch != NULL) {
+    free(d->scratch);
+  }
+  d->scratch = NULL;
+  d->scratch_capacity = 0;
+}
+
+#define STREAM_TAG(d)		((Extprot_Tag) ((d)->tag_and_type >> 4))
+
+/* Builds a tuple, htuple or assoc (n counting keys and values) holding
+   the n elements at elems, tagged as decode() tags it. */
+static Extprot_Object *stream_node(Extprot_Stream_Decoder *d, uint64_t tag_and_type,
+				   Extprot_Object **elems, size_t n)
+{
+  Extprot_Tag tag = (Extprot_Tag) (tag_and_type >> 4);
+  Extprot_Object *o;
+
+  switch (tag_and_type & 0xf) {
+    case EXTPROT_TUPLE: o = extprot_tuple(d->pool, tag, n); break;
+    case EXTPROT_HTUPLE: o = extprot_htuple(d->pool, tag, n); break;
+    default: o = extprot_assoc(d->pool, tag, n / 2); break;
+  }
+  if (o == NULL) {
+    return NULL;
+  }
+  if (n > 0) {
+    memcpy(o->body.tuple.vec, elems, n * sizeof(Extprot_Object *));
+  }
+  o->kind |= ((uint32_t) tag_and_type) & ~0xf;
+  return o;
+}
+
+static Extprot_Error stream_append(Extprot_Stream_Decoder *d, Extprot_Object *o) {
+  if (d->elems_count == d->elems_capacity) {
+    size_t newcap = d->elems_capacity ? d->elems_capacity * 2 : 16;
+    Extprot_Object **newelems = realloc(d->elems, newcap * sizeof(Extprot_Object *));
+    if (newelems == NULL) {
+      return Extprot_NoMemory;
+    }
+    d->elems = newelems;
+    d->elems_capacity = newcap;
+  }
+  d->elems[d->elems_count++] = o;
+  return Extprot_NoError;
+}
+
+/* Files a finished value (NULL if it could not be allocated) into its
+   parent, building every parent that thereby becomes complete, and sets
+   up for the next value. */
+static Extprot_Error stream_complete(Extprot_Stream_Decoder *d, Extprot_Object *o) {
+  if (o == NULL) {
+    return Extprot_NoMemory;
+  }
+  o->kind |= ((uint32_t) d->tag_and_type) & ~0xf;
+
+  while (d->depth > 0) {
+    Extprot_Stream_Frame *f = &d->stack[d->depth - 1];
+    CHECK(stream_append(d, o));
+    if (d->elems_count - f->first < f->total) {
+      d->phase = STREAM_KIND;
+      return Extprot_NoError;
+    }
+    if (d->offset != f->end) {
+      return Extprot_BadLength;
+    }
+    o = stream_node(d, f->tag_and_type, d->elems + f->first, f->total);
+    if (o == NULL) {
+      return Extprot_NoMemory;
+    }
+    d->elems_count = f->first;
+    d->depth--;
+  }
+  d->pool->root = o;
+  d->phase = STREAM_DONE;
+  return Extprot_NoError;
+}
+
+static Extprot_Error stream_push(Extprot_Stream_Decoder *d, size_t total) {
+  Extprot_Stream_Frame *f;
+
+  if (d->max_depth != 0 && d->depth >= d->max_depth) {
+    return Extprot_TooDeep;
+  }
+  if (d->depth == d->stack_capacity) {
+    size_t newcap = d->stack_capacity ? d->stack_capacity * 2 : 16;
+    Extprot_Stream_Frame *newstack = realloc(d->stack, newcap * sizeof(Extprot_Stream_Frame));
+    if (newstack == NULL) {
+      return Extprot_NoMemory;
+    }
+    d->stack = newstack;
+    d->stack_capacity = newcap;
+  }
+  f = &d->stack[d->depth++];
+  f->tag_and_type = d->tag_and_type;
+  f->end = d->end;
+  f->first = d->elems_count;
+  f->total = total;
+  d->phase = STREAM_KIND;
+  return Extprot_NoError;
+}
+
+/* Makes room for want bytes in scratch, growing it geometrically but
+   never past cap (no less than want), the most the value can need. */
+static Extprot_Error stream_reserve(Extprot_Stream_Decoder *d, size_t want, size_t cap) {
+  size_t newcap;
+  uint8_t *newscratch;
+
+  if (want <= d->scratch_capacity) {
+    return Extprot_NoError;
+  }
+  newcap = d->scratch_capacity ? d->scratch_capacity : 64;
+  while (newcap < want) {
+    newcap *= 2;
+  }
+  if (newcap > cap) {
+    newcap = cap;
+  }
+  newscratch = realloc(d->scratch, newcap);
+  if (newscratch == NULL) {
+    return Extprot_NoMemory;
+  }
+  d->scratch = newscratch;
+  d->scratch_capacity = newcap;
+  return Extprot_NoError;
+}
+
+static Extprot_Error stream_start_body(Extprot_Stream_Decoder *d) {
+  d->got = 0;
+  switch (d->tag_and_type & 0xf) {
+    case EXTPROT_VINT:
+      CHARGE(d, sizeof(Extprot_Object));
+      d->phase = STREAM_VINT;
+      return Extprot_NoError;
+
+    case EXTPROT_BITS8:
+      CHARGE(d, sizeof(Extprot_Object));
+      d->phase = STREAM_FIXED;
+      d->need = 1;
+      return Extprot_NoError;
+
+    case EXTPROT_BITS32:
+      CHARGE(d, sizeof(Extprot_Object));
+      d->phase = STREAM_FIXED;
+      d->need = 4;
+      return Extprot_NoError;
+
+    case EXTPROT_BITS64_LONG:
+    case EXTPROT_BITS64_FLOAT:
+      CHARGE(d, sizeof(Extprot_Object));
+      d->phase = STREAM_FIXED;
+      d->need = 8;
+      return Extprot_NoError;
+
+    case EXTPROT_ENUM:
+      CHARGE(d, sizeof(Extprot_Object));
+      return stream_complete(d, extprot_enum(d->pool, STREAM_TAG(d)));
+
+    case EXTPROT_BYTES:
+      if (d->len > d->budget || d->budget - d->len < sizeof(Extprot_Object) + 1) {
+	return Extprot_OverBudget;
+      }
+      CHARGE(d, sizeof(Extprot_Object) + d->len + 1);
+      if (d->len == 0) {
+	return stream_complete(d, extprot_bytes(d->pool, STREAM_TAG(d), "", 0));
+      }
+      d->phase = STREAM_BYTES;
+      return Extprot_NoError;
+
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+    case EXTPROT_ASSOC:
+      d->phase = STREAM_COUNT;
+      return Extprot_NoError;
+
+    default:
+      return Extprot_InvalidTag;
+  }
+}
+
+/* Acts on a complete vint, read with d->offset already past it. */
+static Extprot_Error stream_got_vint(Extprot_Stream_Decoder *d, uint64_t v) {
+  switch (d->phase) {
+    case STREAM_KIND:
+      d->tag_and_type = v;
+      if (v & 1) {
+	d->phase = STREAM_LENGTH;
+	return Extprot_NoError;
+      }
+      d->len = 0;
+      return stream_start_body(d);
+
+    case STREAM_LENGTH:
+      d->len = (size_t) v;
+      if (d->len != v) {
+	return Extprot_SizeTOverflow;
+      }
+      if (d->depth > 0 ? d->len > d->stack[d->depth - 1].end - d->offset
+	  : d->len > (size_t) -1 - d->offset) {
+	return Extprot_BadLength;
+      }
+      d->end = d->offset + d->len;
+      return stream_start_body(d);
+
+    case STREAM_COUNT:
+      {
+	size_t per = (d->tag_and_type & 0xf) == EXTPROT_ASSOC ? 2 : 1;
+	if (d->offset > d->end ||
+	    !plausible_count(v, (int) (d->tag_and_type & 0xf), d->end - d->offset)) {
+	  return Extprot_BadCount;
+	}
+	if (v > d->budget / (per * sizeof(Extprot_Object *))) {
+	  return Extprot_OverBudget;
+	}
+	CHARGE(d, sizeof(Extprot_Object) + per * (size_t) v * sizeof(Extprot_Object *));
+	if (v == 0) {
+	  if (d->offset != d->end) {
+	    return Extprot_BadLength;
+	  }
+	  return stream_complete(d, stream_node(d, d->tag_and_type, NULL, 0));
+	}
+	return stream_push(d, per * (size_t) v);
+      }
+
+#ifdef EXTPROT_NO_BIGNUMS
+    case STREAM_VINT:
+      return stream_complete(d, extprot_vint(d->pool, STREAM_TAG(d), v));
+#endif
+
+    default:
+      return Extprot_InvalidTag;
+  }
+}
+
+#ifndef EXTPROT_NO_BIGNUMS
+/* A bignum's digits are gathered in scratch, each eight of them
+   charged to the budget as they arrive. */
+static Extprot_Error stream_bignum_byte(Extprot_Stream_Decoder *d, uint8_t b) {
+  if (d->got % 8 == 0) {
+    CHARGE(d, 8);
+  }
+  CHECK(stream_reserve(d, d->got + 1, (size_t) -1));
+  d->scratch[d->got++] = b;
+  if (b & 0x80) {
+    return Extprot_NoError;
+  }
+  return stream_complete(d, extprot_vint_wire(d->pool, STREAM_TAG(d), d->scratch, d->got));
+}
+#endif
+
+/* Reads the vint at *pp with the kernel, straight from the chunk when
+   it is all there; one split across chunks is gathered in d->vint
+   first. *n is set to the vint's length, or to 0 if it is still
+   incomplete at the end of the chunk. */
+static Extprot_Error stream_vint(Extprot_Stream_Decoder *d, uint8_t const **pp,
+				 uint8_t const *limit, uint64_t *v, size_t *n)
+{
+  uint8_t const *p = *pp;
+  uint8_t const *q = p;
+  Extprot_Error e;
+
+  *n = 0;
+  if (d->vint_got == 0) {
+    e = extprot_read_vint(&q, limit, v);
+    if (e != Extprot_EarlyEOF) {
+      *n = q - p;
+      *pp = q;
+      return e;
+    }
+  }
+  while (p < limit && d->vint_got < sizeof(d->vint)) {
+    d->vint[d->vint_got++] = *p;
+    if (*p++ < 0x80) {
+      break;
+    }
+  }
+  *pp = p;
+  if ((d->vint[d->vint_got - 1] & 0x80) && d->vint_got < sizeof(d->vint)) {
+    return Extprot_NoError;
+  }
+  q = d->vint;
+  e = extprot_read_vint(&q, d->vint + d->vint_got, v);
+  *n = d->vint_got;
+  d->vint_got = 0;
+  return e;
+}
+
+static Extprot_Object *stream_fixed_object(Extprot_Stream_Decoder *d) {
+  Extprot_Tag tag = STREAM_TAG(d);
+  uint64_t v = d->acc;
+  double f;
+  switch (d->tag_and_type & 0xf) {
+    case EXTPROT_BITS8: return extprot_bits8(d->pool, tag, (uint8_t) v);
+    case EXTPROT_BITS32: return extprot_bits32(d->pool, tag, (uint32_t) v);
+    case EXTPROT_BITS64_LONG: return extprot_bits64_long(d->pool, tag, (int64_t) v);
+    default:
+      memcpy(&f, &v, 8);
+      return extprot_bits64_float(d->pool, tag, f);
+  }
+}
+
+Extprot_Error extprot_stream_feed(Extprot_Stream_Decoder *d,
+				  void const *chunk,
+				  size_t len,
+				  size_t *consumed)
+{
+  uint8_t const *p = chunk;
+  uint8_t const *limit = p + len;
+  Extprot_Error e = Extprot_NoError;
+
+  *consumed = 0;
+  if (d->error != Extprot_NoError) {
+    return d->error;
+  }
+
+  while (d->phase != STREAM_DONE && p < limit) {
+    /* nothing inside a tuple may be read past the tuple's end */
+    uint8_t const *lim = limit;
+    uint8_t const *q = p;
+    if (d->depth > 0) {
+      size_t room = d->stack[d->depth - 1].end - d->offset;
+      if (room == 0) {
+	e = Extprot_BadLength;
+	break;
+      }
+      if (room < (size_t) (limit - p)) {
+	lim = p + room;
+      }
+    }
+
+    switch (d->phase) {
+      case STREAM_KIND:
+      case STREAM_LENGTH:
+      case STREAM_COUNT:
+#ifdef EXTPROT_NO_BIGNUMS
+      case STREAM_VINT:
+#endif
+	{
+	  uint64_t v;
+	  size_t n;
+	  e = stream_vint(d, &p, lim, &v, &n);
+	  d->offset += p - q;
+	  if (e == Extprot_NoError && n != 0) {
+	    e = stream_got_vint(d, v);
+	  }
+	  break;
+	}
+
+#ifndef EXTPROT_NO_BIGNUMS
+      case STREAM_VINT:
+	d->offset++;
+	e = stream_bignum_byte(d, *p++);
+	break;
+#endif
+
+      case STREAM_FIXED:
+	d->offset++;
+	d->acc |= ((uint64_t) *p++) << (8 * d->got);
+	if (++d->got == d->need) {
+	  Extprot_Object *o = stream_fixed_object(d);
+	  d->acc = 0;
+	  e = stream_complete(d, o);
+	}
+	break;
+
+      case STREAM_BYTES:
+	{
+	  size_t n = d->len - d->got;
+	  if (n > (size_t) (lim - p)) {
+	    n = lim - p;
+	  }
+	  e = stream_reserve(d, d->got + n, d->len);
+	  if (e != Extprot_NoError) {
+	    break;
+	  }
+	  memcpy(d->scratch + d->got, p, n);
+	  p += n;
+	  d->offset += n;
+	  d->got += n;
+	  if (d->got == d->len) {
+	    Extprot_Object *o = extprot_bytes(d->pool, STREAM_TAG(d), d->scratch, d->len);
+	    if (o != NULL) {
+	      o->body.bytes.vec[d->len] = '\0';
+	    }
+	    e = stream_complete(d, o);
+	  }
+	  break;
+	}
+    }
+
+    if (e != Extprot_NoError) {
+      break;
+    }
+  }
+
+  *consumed = p - (uint8_t const *) chunk;
+  if (e != Extprot_NoError) {
+    d->error = e;
+    return e;
+  }
+  return (d->phase == STREAM_DONE) ? Extprot_NoError : Extprot_Incomplete;
+}
@@ -25,10 +25,19 @@ THE SOFTWARE.
 #include <string.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <limits.h>
 
 #include "extprot.h"
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 static size_t length_of_vint_64(uint64_t val) {
+#ifdef __GNUC__
+  /* ceil(significant bits / 7), with zero taking one byte */
+  return (64 - __builtin_clzll(val | 1) + 6) / 7;
+#else
   if (val < 128) return 1;
   if (val < 16384) return 2;
   if (val < 2097152) return 3;
@@ -39,6 +48,7 @@ static size_t length_of_vint_64(uint64_t val) {
   if (val < 72057594037927936LL) return 8;
   if (val < 9223372036854775808ULL) return 9;
   return 10;
+#endif
 }
 
 static size_t sum_of_lengths(Extprot_Object * const *v, size_t count) {
@@ -50,14 +60,46 @@ static size_t sum_of_lengths(Extprot_Object * const *v, size_t count) {
   return sum;
 }
 
+static size_t lazy_slots(Extprot_Object const *o) {
+  return ((o->kind & 0xf) == EXTPROT_ASSOC ? 2 : 1) * o->body.tuple.length;
+}
+
+/* A lazy node's elements take the bytes they were read from until they
+   are decoded, and whatever they now encode to after. */
+static size_t length_of_lazy(Extprot_Object const *o) {
+  Extprot_Lazy const *l = EXTPROT_LAZY(o);
+  size_t i, n = lazy_slots(o);
+  size_t len = 0;
+
+  if (l->missing == n) {
+    return l->length;
+  }
+  for (i = 0; i < n; i++) {
+    len += o->body.tuple.vec[i] != NULL
+      ? extprot_compute_length(o->body.tuple.vec[i])
+      : l->offsets[i + 1] - l->offsets[i];
+  }
+  return len;
+}
+
+/* Computes the body length of o, storing it in the node when o is a
+   tuple, htuple or assoc so that encode() never has to walk the
+   subtree again. The cache is logically mutable state, hence the cast. */
 static size_t length_of_body(Extprot_Object const *o) {
+  size_t len;
+  if (o->flags & EXTPROT_FLAG_LAZY) {
+    len = length_of_vint_64(o->body.tuple.length) + length_of_lazy(o);
+    ((Extprot_Object *) o)->body.tuple.body_length = len;
+    return len;
+  }
   switch (o->kind & 0xf) {
     case EXTPROT_VINT:
 #ifndef EXTPROT_NO_BIGNUMS
-      return (mpz_sizeinbase(o->body.vint.value, 2) + 6) / 7;
-#else
-      return length_of_vint_64(o->body.vint);
+      if (EXTPROT_VINT_IS_BIG(o)) {
+	return (mpz_sizeinbase(o->body.vint.value, 2) + 6) / 7;
+      }
 #endif
+      return length_of_vint_64(EXTPROT_VINT_64(o));
     case EXTPROT_BITS8:
       return 1;
     case EXTPROT_BITS32:
@@ -67,24 +109,60 @@ static size_t length_of_body(Extprot_Object const *o) {
       return 8;
     case EXTPROT_ENUM:
       return 0;
-    case EXTPROT_TUPLE:
     case EXTPROT_HTUPLE:
-      return
+      if (o->flags & EXTPROT_FLAG_PACKED) {
+	return
+	  length_of_vint_64(o->body.packed.length) +
+	  o->body.packed.length *
+	  (length_of_vint_64(o->body.packed.elem_kind) +
+	   extprot_packed_width(o->body.packed.elem_kind & 0xf));
+      }
+      /* fall through */
+    case EXTPROT_TUPLE:
+      len =
 	length_of_vint_64(o->body.tuple.length) +
 	sum_of_lengths(o->body.tuple.vec, o->body.tuple.length);
+      ((Extprot_Object *) o)->body.tuple.body_length = len;
+      return len;
     case EXTPROT_BYTES:
       return o->body.bytes.length;
     case EXTPROT_ASSOC:
-      return
+      len =
 	length_of_vint_64(o->body.tuple.length) +
 	sum_of_lengths(o->body.tuple.vec, o->body.tuple.length * 2);
+      ((Extprot_Object *) o)->body.tuple.body_length = len;
+      return len;
     default:
       return 0;
   }
 }
 
+/* Like length_of_body(), but reuses a body length cached by a previous
+   measurement instead of recomputing it. A tuple body is never empty (it
+   holds at least the element count), so 0 means "not yet measured". */
+static size_t cached_length_of_body(Extprot_Object const *o) {
+  if (o->flags & EXTPROT_FLAG_PACKED) {
+    return length_of_body(o);
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+    case EXTPROT_ASSOC:
+      if (o->body.tuple.body_length != 0) {
+	return o->body.tuple.body_length;
+      }
+      return length_of_body(o);
+    default:
+      return length_of_body(o);
+  }
+}
+
 size_t extprot_compute_length(Extprot_Object const *o) {
-  size_t bodylen = length_of_body(o);
+  size_t bodylen;
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    return o->body.bytes.length;
+  }
+  bodylen = length_of_body(o);
   return
     length_of_vint_64(o->kind) +
     ((o->kind & 1) ? length_of_vint_64(bodylen) : 0) +
@@ -99,12 +177,24 @@ static void encode(Extprot_Object const *o, void **buffer);
 #define ADVANCE_BY(bufp, n)	(BUFP_TO_BYTEP(bufp) += (n))
 
 static void encode_vint_64(uint64_t value, void **buffer) {
-  do {
-    uint8_t v = value & 0x7f;
+  uint8_t *p = BUFP_TO_BYTEP(buffer);
+  if (value < 0x80) {
+    *p = (uint8_t) value;
+    BUFP_TO_BYTEP(buffer) = p + 1;
+    return;
+  }
+  if (value < 0x4000) {
+    p[0] = (uint8_t) (value | 0x80);
+    p[1] = (uint8_t) (value >> 7);
+    BUFP_TO_BYTEP(buffer) = p + 2;
+    return;
+  }
+  while (value >= 0x80) {
+    *p++ = (uint8_t) (value | 0x80);
     value >>= 7;
-    if (value != 0) v |= 0x80;
-    PLACE_BYTE(buffer, v);
-  } while (value > 0);
+  }
+  *p++ = (uint8_t) value;
+  BUFP_TO_BYTEP(buffer) = p;
 }
 
 static void encode_fixed_int_64(uint64_t value, void **buffer) {
@@ -118,6 +208,44 @@ static void encode_fixed_int_64(uint64_t value, void **buffer) {
   PLACE_BYTE(buffer, value >> 56);
 }
 
+/* Every element of a packed htuple gets the same header bytes, so they
+   are encoded once and copied. */
+static void save_packed(Extprot_Object const *o, void **buffer) {
+  uint8_t header[10];
+  void *hp = header;
+  size_t hlen, i;
+  size_t width = extprot_packed_width(o->body.packed.elem_kind & 0xf);
+
+  encode_vint_64(o->body.packed.elem_kind, &hp);
+  hlen = (uint8_t *) hp - header;
+
+  for (i = 0; i < o->body.packed.length; i++) {
+    memcpy(&BUFFER_AT(buffer, 0), header, hlen);
+    ADVANCE_BY(buffer, hlen);
+    switch (width) {
+      case 1:
+	PLACE_BYTE(buffer, ((uint8_t const *) o->body.packed.data)[i]);
+	break;
+      case 4:
+	{
+	  uint32_t v = ((uint32_t const *) o->body.packed.data)[i];
+	  PLACE_BYTE(buffer, v >> 0);
+	  PLACE_BYTE(buffer, v >> 8);
+	  PLACE_BYTE(buffer, v >> 16);
+	  PLACE_BYTE(buffer, v >> 24);
+	  break;
+	}
+      default:
+	{
+	  uint64_t v;
+	  memcpy(&v, (uint64_t const *) o->body.packed.data + i, 8);
+	  encode_fixed_int_64(v, buffer);
+	  break;
+	}
+    }
+  }
+}
+
 static void save_n(Extprot_Object * const *v, size_t count, void **buffer) {
   size_t i;
   for (i = 0; i < count; i++) {
@@ -125,28 +253,57 @@ static void save_n(Extprot_Object * const *v, size_t count, void **buffer) {
   }
 }
 
+static void save_lazy(Extprot_Object const *o, void **buffer) {
+  Extprot_Lazy const *l = EXTPROT_LAZY(o);
+  size_t i, n = lazy_slots(o);
+
+  if (l->missing == n) {
+    memcpy(&BUFFER_AT(buffer, 0), l->data, l->length);
+    ADVANCE_BY(buffer, l->length);
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    if (o->body.tuple.vec[i] != NULL) {
+      encode(o->body.tuple.vec[i], buffer);
+    } else {
+      memcpy(&BUFFER_AT(buffer, 0), l->data + l->offsets[i], l->offsets[i + 1] - l->offsets[i]);
+      ADVANCE_BY(buffer, l->offsets[i + 1] - l->offsets[i]);
+    }
+  }
+}
+
 static void encode(Extprot_Object const *o, void **buffer) {
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    memcpy(&BUFFER_AT(buffer, 0), EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+    ADVANCE_BY(buffer, o->body.bytes.length);
+    return;
+  }
   encode_vint_64(o->kind, buffer);
   if (o->kind & 1) {
-    encode_vint_64(length_of_body(o), buffer);
+    encode_vint_64(cached_length_of_body(o), buffer);
+  }
+  if (o->flags & EXTPROT_FLAG_LAZY) {
+    encode_vint_64(o->body.tuple.length, buffer);
+    save_lazy(o, buffer);
+    return;
   }
   switch (o->kind & 0xf) {
     case EXTPROT_VINT:
 #ifndef EXTPROT_NO_BIGNUMS
-      {
+      if (EXTPROT_VINT_IS_BIG(o)) {
 	size_t i;
 	size_t count = (mpz_sizeinbase(o->body.vint.value, 2) + 6) / 7;
+	BUFFER_AT(buffer, 0) = 0; /* mpz_export writes nothing for zero */
 	mpz_export(*buffer, NULL, -1, 1, 0, 1, o->body.vint.value);
 	for (i = 0; i < count - 1; i++) {
 	  ((uint8_t *) (*buffer))[i] |= 0x80;
 	}
 	ADVANCE_BY(buffer, count);
+	break;
       }
-      break;
-#else
-      encode_vint_64(o->body.vint, buffer);
-      break;
 #endif
+      encode_vint_64(EXTPROT_VINT_64(o), buffer);
+      break;
 
     case EXTPROT_BITS8:
       PLACE_BYTE(buffer, o->body.bits8);
@@ -164,7 +321,11 @@ static void encode(Extprot_Object const *o, void **buffer) {
       break;
 
     case EXTPROT_BITS64_FLOAT:
-      encode_fixed_int_64(* (uint64_t *) &o->body.bits64_float, buffer);
+      {
+	uint64_t bits;
+	memcpy(&bits, &o->body.bits64_float, 8);
+	encode_fixed_int_64(bits, buffer);
+      }
       break;
 
     case EXTPROT_ENUM:
@@ -172,12 +333,17 @@ static void encode(Extprot_Object const *o, void **buffer) {
 
     case EXTPROT_TUPLE:
     case EXTPROT_HTUPLE:
+      if (o->flags & EXTPROT_FLAG_PACKED) {
+	encode_vint_64(o->body.packed.length, buffer);
+	save_packed(o, buffer);
+	break;
+      }
       encode_vint_64(o->body.tuple.length, buffer);
       save_n(o->body.tuple.vec, o->body.tuple.length, buffer);
       break;
 
     case EXTPROT_BYTES:
-      memcpy(&BUFFER_AT(buffer, 0), o->body.bytes.vec, o->body.bytes.length);
+      memcpy(&BUFFER_AT(buffer, 0), EXTPROT_BYTES_DATA(o), o->body.bytes.length);
       ADVANCE_BY(buffer, o->body.bytes.length);
       break;
 
@@ -194,3 +360,505 @@ static void encode(Extprot_Object const *o, void **buffer) {
 void extprot_encode(Extprot_Object const *o, void *buffer) {
   encode(o, &buffer);
 }
+
+/* Scatter-gather encoding. A first walk totals the bytes payloads big
+   enough to be referenced, which sizes the scratch buffer and the iovec
+   array; the second encodes everything else into the scratch buffer,
+   cutting an iovec off it wherever a referenced payload goes. Raw
+   nodes are referenced whole, header and all. Each reference takes at
+   most two iovecs, so only the first (max_iov - 1) / 2 payloads big
+   enough are referenced, by both walks alike. */
+
+/* Whether o is referenced, which uses up one of g->refs_left */
+static int gather_ref(Extprot_Gather *g, Extprot_Object const *o) {
+  if (((o->flags & EXTPROT_FLAG_RAW) || (o->kind & 0xf) == EXTPROT_BYTES)
+      && o->body.bytes.length >= g->min_ref && g->refs_left > 0) {
+    g->refs_left--;
+    return 1;
+  }
+  return 0;
+}
+
+static void gather_plan(Extprot_Gather *g, Extprot_Object const *o,
+			size_t *ref_bytes, size_t *refs)
+{
+  size_t i, n = 0;
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    if (gather_ref(g, o)) {
+      *ref_bytes += o->body.bytes.length;
+      (*refs)++;
+    }
+    return;
+  }
+  if (o->flags & EXTPROT_FLAG_LAZY) {
+    return;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+      n = (o->flags & EXTPROT_FLAG_PACKED) ? 0 : o->body.tuple.length;
+      break;
+    case EXTPROT_ASSOC:
+      n = o->body.tuple.length * 2;
+      break;
+    case EXTPROT_BYTES:
+      if (gather_ref(g, o)) {
+	*ref_bytes += o->body.bytes.length;
+	(*refs)++;
+      }
+      return;
+    default:
+      return;
+  }
+  for (i = 0; i < n; i++) {
+    gather_plan(g, o->body.tuple.vec[i], ref_bytes, refs);
+  }
+}
+
+static void gather_push(Extprot_Gather *g, void const *base, size_t len) {
+  if (len > 0) {
+    g->iov[g->iov_count].iov_base = (void *) base;
+    g->iov[g->iov_count].iov_len = len;
+    g->iov_count++;
+  }
+}
+
+static void gather_encode(Extprot_Gather *g, Extprot_Object const *o,
+			  void **buffer, uint8_t **mark)
+{
+  size_t i, n;
+
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    if (gather_ref(g, o)) {
+      gather_push(g, *mark, BUFP_TO_BYTEP(buffer) - *mark);
+      gather_push(g, EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+      *mark = BUFP_TO_BYTEP(buffer);
+    } else {
+      encode(o, buffer);
+    }
+    return;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_BYTES:
+      if (!gather_ref(g, o)) {
+	break;
+      }
+      encode_vint_64(o->kind, buffer);
+      encode_vint_64(o->body.bytes.length, buffer);
+      gather_push(g, *mark, BUFP_TO_BYTEP(buffer) - *mark);
+      gather_push(g, EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+      *mark = BUFP_TO_BYTEP(buffer);
+      return;
+
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+    case EXTPROT_ASSOC:
+      if (o->flags & (EXTPROT_FLAG_PACKED | EXTPROT_FLAG_LAZY)) {
+	break;
+      }
+      n = o->body.tuple.length;
+      encode_vint_64(o->kind, buffer);
+      encode_vint_64(cached_length_of_body(o), buffer);
+      encode_vint_64(n, buffer);
+      if ((o->kind & 0xf) == EXTPROT_ASSOC) {
+	n *= 2;
+      }
+      for (i = 0; i < n; i++) {
+	gather_encode(g, o->body.tuple.vec[i], buffer, mark);
+      }
+      return;
+  }
+  encode(o, buffer);
+}
+
+void extprot_gather_init(Extprot_Gather *g, size_t min_ref) {
+  g->min_ref = min_ref;
+  g->max_iov = IOV_MAX;
+  g->refs_left = 0;
+  g->length = 0;
+  g->iov = NULL;
+  g->iov_count = 0;
+  g->iov_capacity = 0;
+  g->scratch = NULL;
+  g->scratch_capacity = 0;
+}
+
+void extprot_gather_free(Extprot_Gather *g) {
+  size_t max_iov = g->max_iov;
+  free(g->iov);
+  free(g->scratch);
+  extprot_gather_init(g, g->min_ref);
+  g->max_iov = max_iov;
+}
+
+Extprot_Error extprot_encode_gather(Extprot_Gather *g, Extprot_Object const *o) {
+  size_t ref_bytes = 0, refs = 0;
+  void *buffer;
+  uint8_t *mark;
+
+  g->length = extprot_compute_length(o);
+  g->refs_left = g->max_iov > 0 ? (g->max_iov - 1) / 2 : 0;
+  gather_plan(g, o, &ref_bytes, &refs);
+  g->refs_left = refs;
+
+  g->iov_count = 0;
+  if (2 * refs + 1 > g->iov_capacity) {
+    struct iovec *newiov = realloc(g->iov, (2 * refs + 1) * sizeof(struct iovec));
+    if (newiov == NULL) {
+      return Extprot_NoMemory;
+    }
+    g->iov = newiov;
+    g->iov_capacity = 2 * refs + 1;
+  }
+  if (g->length - ref_bytes > g->scratch_capacity) {
+    uint8_t *newscratch = realloc(g->scratch, g->length - ref_bytes);
+    if (newscratch == NULL) {
+      return Extprot_NoMemory;
+    }
+    g->scratch = newscratch;
+    g->scratch_capacity = g->length - ref_bytes;
+  }
+
+  g->iov_count = 0;
+  buffer = g->scratch;
+  mark = g->scratch;
+  gather_encode(g, o, &buffer, &mark);
+  gather_push(g, mark, (uint8_t *) buffer - mark);
+  return Extprot_NoError;
+}
+
+/* Streaming writer. Values are emitted straight into the output buffer;
+   each open tuple reserves one byte for its length prefix and one for
+   its element count, and extprot_writer_end() backpatches them. A tuple
+   whose prefix needs more room is recorded instead, and when the
+   outermost tuple ends a single backward pass slides everything after
+   each recorded prefix along by the room all of them need, so no byte
+   moves more than once however deep the nesting. The output is
+   byte-for-byte what extprot_encode() would produce. */
+
+#define WRITER_RESERVE 2
+
+void extprot_writer_init(Extprot_Writer *w, void *buffer, size_t capacity) {
+  w->buffer = buffer;
+  w->capacity = buffer ? capacity : 0;
+  w->used = 0;
+  w->owns_buffer = (buffer == NULL);
+
+  w->depth = 0;
+  w->stack_capacity = 0;
+  w->stack = NULL;
+
+  w->patches_count = 0;
+  w->patches_capacity = 0;
+  w->patches = NULL;
+
+  w->error = Extprot_NoError;
+}
+
+void extprot_writer_reset(Extprot_Writer *w) {
+  w->used = 0;
+  w->depth = 0;
+  w->patches_count = 0;
+  w->error = Extprot_NoError;
+}
+
+void extprot_writer_free(Extprot_Writer *w) {
+  if (w->owns_buffer && w->buffer != NULL) {
+    free(w->buffer);
+  }
+  w->buffer = NULL;
+  w->capacity = 0;
+  w->used = 0;
+
+  if (w->stack != NULL) {
+    free(w->stack);
+  }
+  w->stack = NULL;
+  w->stack_capacity = 0;
+  w->depth = 0;
+
+  if (w->patches != NULL) {
+    free(w->patches);
+  }
+  w->patches = NULL;
+  w->patches_capacity = 0;
+  w->patches_count = 0;
+}
+
+static Extprot_Error writer_fail(Extprot_Writer *w, Extprot_Error e) {
+  if (w->error == Extprot_NoError) {
+    w->error = e;
+  }
+  return w->error;
+}
+
+static Extprot_Error writer_ensure(Extprot_Writer *w, size_t amount) {
+  size_t newcap;
+  uint8_t *newbuf;
+
+  if (w->error != Extprot_NoError) {
+    return w->error;
+  }
+  if (w->used + amount <= w->capacity) {
+    return Extprot_NoError;
+  }
+  if (!w->owns_buffer) {
+    return writer_fail(w, Extprot_BufferFull);
+  }
+
+  newcap = w->capacity ? w->capacity : 256;
+  while (newcap < w->used + amount) {
+    newcap *= 2;
+  }
+  newbuf = realloc(w->buffer, newcap);
+  if (newbuf == NULL) {
+    return writer_fail(w, Extprot_NoMemory);
+  }
+  w->buffer = newbuf;
+  w->capacity = newcap;
+  return Extprot_NoError;
+}
+
+/* Emits the tag/type vint of a new value, making sure that body_room
+   further bytes are available, and returns a cursor for the body. */
+static void *writer_open(Extprot_Writer *w, uint32_t kind, size_t body_room) {
+  void *p;
+  if (writer_ensure(w, length_of_vint_64(kind) + body_room) != Extprot_NoError) {
+    return NULL;
+  }
+  if (w->depth > 0) {
+    w->stack[w->depth - 1].count++;
+  }
+  p = w->buffer + w->used;
+  encode_vint_64(kind, &p);
+  return p;
+}
+
+#define WRITER_SYNC(w, p)	((w)->used = (uint8_t *) (p) - (w)->buffer)
+
+Extprot_Error extprot_writer_vint(Extprot_Writer *w, Extprot_Tag tag, uint64_t num) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_VINT, length_of_vint_64(num));
+  if (p == NULL) return w->error;
+  encode_vint_64(num, &p);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_rel_int(Extprot_Writer *w, Extprot_Tag tag, int64_t n) {
+  return extprot_writer_vint(w, tag, ((uint64_t) n << 1) ^ (uint64_t) (n >> 63));
+}
+
+Extprot_Error extprot_writer_bits8(Extprot_Writer *w, Extprot_Tag tag, uint8_t num) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_BITS8, 1);
+  if (p == NULL) return w->error;
+  PLACE_BYTE(&p, num);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_bits32(Extprot_Writer *w, Extprot_Tag tag, uint32_t num) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_BITS32, 4);
+  if (p == NULL) return w->error;
+  PLACE_BYTE(&p, num >> 0);
+  PLACE_BYTE(&p, num >> 8);
+  PLACE_BYTE(&p, num >> 16);
+  PLACE_BYTE(&p, num >> 24);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_bits64_long(Extprot_Writer *w, Extprot_Tag tag, int64_t num) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_BITS64_LONG, 8);
+  if (p == NULL) return w->error;
+  encode_fixed_int_64(num, &p);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_bits64_float(Extprot_Writer *w, Extprot_Tag tag, double num) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_BITS64_FLOAT, 8);
+  uint64_t bits;
+  if (p == NULL) return w->error;
+  memcpy(&bits, &num, 8);
+  encode_fixed_int_64(bits, &p);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_enum(Extprot_Writer *w, Extprot_Tag tag) {
+  void *p = writer_open(w, (tag << 4) | EXTPROT_ENUM, 0);
+  if (p == NULL) return w->error;
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_bytes(Extprot_Writer *w, Extprot_Tag tag,
+				   void const *bin, size_t len)
+{
+  void *p = writer_open(w, (tag << 4) | EXTPROT_BYTES, length_of_vint_64(len) + len);
+  if (p == NULL) return w->error;
+  encode_vint_64(len, &p);
+  memcpy(p, bin, len);
+  ADVANCE_BY(&p, len);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_cstring(Extprot_Writer *w, Extprot_Tag tag, char const *str) {
+  return extprot_writer_bytes(w, tag, str, strlen(str));
+}
+
+Extprot_Error extprot_writer_object(Extprot_Writer *w, Extprot_Object const *o) {
+  size_t len = extprot_compute_length(o);
+  void *p;
+  if (writer_ensure(w, len) != Extprot_NoError) return w->error;
+  if (w->depth > 0) {
+    w->stack[w->depth - 1].count++;
+  }
+  p = w->buffer + w->used;
+  encode(o, &p);
+  WRITER_SYNC(w, p);
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_raw(Extprot_Writer *w, void const *encoded, size_t len) {
+  if (writer_ensure(w, len) != Extprot_NoError) return w->error;
+  if (w->depth > 0) {
+    w->stack[w->depth - 1].count++;
+  }
+  memcpy(w->buffer + w->used, encoded, len);
+  w->used += len;
+  return Extprot_NoError;
+}
+
+static Extprot_Error writer_begin(Extprot_Writer *w, Extprot_Tag tag, int wire_type) {
+  Extprot_Writer_Frame *f;
+  void *p;
+
+  if (w->error != Extprot_NoError) {
+    return w->error;
+  }
+  if (w->depth == w->stack_capacity) {
+    size_t newcap = w->stack_capacity ? w->stack_capacity * 2 : 16;
+    Extprot_Writer_Frame *newstack = realloc(w->stack, newcap * sizeof(Extprot_Writer_Frame));
+    if (newstack == NULL) {
+      return writer_fail(w, Extprot_NoMemory);
+    }
+    w->stack = newstack;
+    w->stack_capacity = newcap;
+  }
+
+  p = writer_open(w, (tag << 4) | wire_type, WRITER_RESERVE);
+  if (p == NULL) return w->error;
+  WRITER_SYNC(w, p);
+
+  f = &w->stack[w->depth++];
+  f->wire_type = wire_type;
+  f->header_at = w->used;
+  f->count = 0;
+  f->extra = 0;
+  w->used += WRITER_RESERVE;
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_begin_tuple(Extprot_Writer *w, Extprot_Tag tag) {
+  return writer_begin(w, tag, EXTPROT_TUPLE);
+}
+
+Extprot_Error extprot_writer_begin_htuple(Extprot_Writer *w, Extprot_Tag tag) {
+  return writer_begin(w, tag, EXTPROT_HTUPLE);
+}
+
+Extprot_Error extprot_writer_begin_assoc(Extprot_Writer *w, Extprot_Tag tag) {
+  return writer_begin(w, tag, EXTPROT_ASSOC);
+}
+
+static int patch_cmp(void const *a, void const *b) {
+  size_t x = ((Extprot_Writer_Patch const *) a)->at;
+  size_t y = ((Extprot_Writer_Patch const *) b)->at;
+  return (x > y) - (x < y);
+}
+
+/* Writes every recorded prefix, growing the buffer by extra bytes in
+   all: working back from the end, the bytes after each patch move up
+   by the room still owed to it and the patches before it. */
+static Extprot_Error writer_patch(Extprot_Writer *w, size_t extra) {
+  size_t src_end = w->used, dst_end = w->used + extra, i, len;
+  void *p;
+
+  if (writer_ensure(w, extra) != Extprot_NoError) {
+    return w->error;
+  }
+  qsort(w->patches, w->patches_count, sizeof(Extprot_Writer_Patch), patch_cmp);
+  for (i = w->patches_count; i > 0; i--) {
+    Extprot_Writer_Patch *pt = &w->patches[i - 1];
+    size_t body_at = pt->at + WRITER_RESERVE;
+    len = src_end - body_at;
+    memmove(w->buffer + dst_end - len, w->buffer + body_at, len);
+    dst_end -= len + length_of_vint_64(pt->body_len) + length_of_vint_64(pt->count);
+    p = w->buffer + dst_end;
+    encode_vint_64(pt->body_len, &p);
+    encode_vint_64(pt->count, &p);
+    src_end = pt->at;
+  }
+  w->used += extra;
+  w->patches_count = 0;
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_writer_end(Extprot_Writer *w) {
+  Extprot_Writer_Frame *f;
+  size_t n, body_len, needed, extra;
+  void *p;
+
+  if (w->error != Extprot_NoError) {
+    return w->error;
+  }
+  if (w->depth == 0) {
+    return writer_fail(w, Extprot_BadNesting);
+  }
+  f = &w->stack[w->depth - 1];
+
+  n = f->count;
+  if (f->wire_type == EXTPROT_ASSOC) {
+    if (n & 1) {
+      return writer_fail(w, Extprot_BadNesting);
+    }
+    n >>= 1;
+  }
+
+  /* the body as it will be once the patches inside it are written */
+  body_len = length_of_vint_64(n) + w->used - (f->header_at + WRITER_RESERVE) + f->extra;
+  needed = length_of_vint_64(body_len) + length_of_vint_64(n);
+  extra = f->extra;
+
+  if (needed == WRITER_RESERVE) {
+    p = w->buffer + f->header_at;
+    encode_vint_64(body_len, &p);
+    encode_vint_64(n, &p);
+  } else {
+    /* needed is never smaller than the reservation. */
+    if (w->patches_count == w->patches_capacity) {
+      size_t newcap = w->patches_capacity ? w->patches_capacity * 2 : 16;
+      Extprot_Writer_Patch *newpatches = realloc(w->patches, newcap * sizeof(Extprot_Writer_Patch));
+      if (newpatches == NULL) {
+	return writer_fail(w, Extprot_NoMemory);
+      }
+      w->patches = newpatches;
+      w->patches_capacity = newcap;
+    }
+    w->patches[w->patches_count].at = f->header_at;
+    w->patches[w->patches_count].body_len = body_len;
+    w->patches[w->patches_count].count = n;
+    w->patches_count++;
+    extra += needed - WRITER_RESERVE;
+  }
+
+  w->depth--;
+  if (w->depth > 0) {
+    w->stack[w->depth - 1].extra += extra;
+  } else if (extra > 0) {
+    return writer_patch(w, extra);
+  }
+  return Extprot_NoError;
+}
@@ -0,0 +1,391 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* Log segments: a file of framed messages with a trailing index, for
+   random access through mmap without reading the whole file.
+
+     "EXTPLOG1"
+     frame*		u32 length, u32 crc32c of length and message, message
+     index		u64 offset of each frame
+     u64 count, "EXTPIDX1"
+
+   All integers are little-endian. A segment whose writer did not get
+   to extprot_log_close() has no index; opening it rebuilds one from the
+   frames that are intact. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "extprot.h"
+
+#define LOG_MAGIC	"EXTPLOG1"
+#define INDEX_MAGIC	"EXTPIDX1"
+#define MAGIC_LEN	8
+#define FRAME_HEADER	8
+#define TRAILER_LEN	16
+
+/* CRC-32C (Castagnoli), reflected polynomial 0x82f63b78. */
+static uint32_t const crc32c_table[256] = {
+  0x00000000U, 0xf26b8303U, 0xe13b70f7U, 0x1350f3f4U,
+  0xc79a971fU, 0x35f1141cU, 0x26a1e7e8U, 0xd4ca64ebU,
+  0x8ad958cfU, 0x78b2dbccU, 0x6be22838U, 0x9989ab3bU,
+  0x4d43cfd0U, 0xbf284cd3U, 0xac78bf27U, 0x5e133c24U,
+  0x105ec76fU, 0xe235446cU, 0xf165b798U, 0x030e349bU,
+  0xd7c45070U, 0x25afd373U, 0x36ff2087U, 0xc494a384U,
+  0x9a879fa0U, 0x68ec1ca3U, 0x7bbcef57U, 0x89d76c54U,
+  0x5d1d08bfU, 0xaf768bbcU, 0xbc267848U, 0x4e4dfb4bU,
+  0x20bd8edeU, 0xd2d60dddU, 0xc186fe29U, 0x33ed7d2aU,
+  0xe72719c1U, 0x154c9ac2U, 0x061c6936U, 0xf477ea35U,
+  0xaa64d611U, 0x580f5512U, 0x4b5fa6e6U, 0xb93425e5U,
+  0x6dfe410eU, 0x9f95c20dU, 0x8cc531f9U, 0x7eaeb2faU,
+  0x30e349b1U, 0xc288cab2U, 0xd1d83946U, 0x23b3ba45U,
+  0xf779deaeU, 0x05125dadU, 0x1642ae59U, 0xe4292d5aU,
+  0xba3a117eU, 0x4851927dU, 0x5b016189U, 0xa96ae28aU,
+  0x7da08661U, 0x8fcb0562U, 0x9c9bf696U, 0x6ef07595U,
+  0x417b1dbcU, 0xb3109ebfU, 0xa0406d4bU, 0x522bee48U,
+  0x86e18aa3U, 0x748a09a0U, 0x67dafa54U, 0x95b17957U,
+  0xcba24573U, 0x39c9c670U, 0x2a993584U, 0xd8f2b687U,
+  0x0c38d26cU, 0xfe53516fU, 0xed03a29bU, 0x1f682198U,
+  0x5125dad3U, 0xa34e59d0U, 0xb01eaa24U, 0x42752927U,
+  0x96bf4dccU, 0x64d4cecfU, 0x77843d3bU, 0x85efbe38U,
+  0xdbfc821cU, 0x2997011fU, 0x3ac7f2ebU, 0xc8ac71e8U,
+  0x1c661503U, 0xee0d9600U, 0xfd5d65f4U, 0x0f36e6f7U,
+  0x61c69362U, 0x93ad1061U, 0x80fde395U, 0x72966096U,
+  0xa65c047dU, 0x5437877eU, 0x4767748aU, 0xb50cf789U,
+  0xeb1fcbadU, 0x197448aeU, 0x0a24bb5aU, 0xf84f3859U,
+  0x2c855cb2U, 0xdeeedfb1U, 0xcdbe2c45U, 0x3fd5af46U,
+  0x7198540dU, 0x83f3d70eU, 0x90a324faU, 0x62c8a7f9U,
+  0xb602c312U, 0x44694011U, 0x5739b3e5U, 0xa55230e6U,
+  0xfb410cc2U, 0x092a8fc1U, 0x1a7a7c35U, 0xe811ff36U,
+  0x3cdb9bddU, 0xceb018deU, 0xdde0eb2aU, 0x2f8b6829U,
+  0x82f63b78U, 0x709db87bU, 0x63cd4b8fU, 0x91a6c88cU,
+  0x456cac67U, 0xb7072f64U, 0xa457dc90U, 0x563c5f93U,
+  0x082f63b7U, 0xfa44e0b4U, 0xe9141340U, 0x1b7f9043U,
+  0xcfb5f4a8U, 0x3dde77abU, 0x2e8e845fU, 0xdce5075cU,
+  0x92a8fc17U, 0x60c37f14U, 0x73938ce0U, 0x81f80fe3U,
+  0x55326b08U, 0xa759e80bU, 0xb4091bffU, 0x466298fcU,
+  0x1871a4d8U, 0xea1a27dbU, 0xf94ad42fU, 0x0b21572cU,
+  0xdfeb33c7U, 0x2d80b0c4U, 0x3ed04330U, 0xccbbc033U,
+  0xa24bb5a6U, 0x502036a5U, 0x4370c551U, 0xb11b4652U,
+  0x65d122b9U, 0x97baa1baU, 0x84ea524eU, 0x7681d14dU,
+  0x2892ed69U, 0xdaf96e6aU, 0xc9a99d9eU, 0x3bc21e9dU,
+  0xef087a76U, 0x1d63f975U, 0x0e330a81U, 0xfc588982U,
+  0xb21572c9U, 0x407ef1caU, 0x532e023eU, 0xa145813dU,
+  0x758fe5d6U, 0x87e466d5U, 0x94b49521U, 0x66df1622U,
+  0x38cc2a06U, 0xcaa7a905U, 0xd9f75af1U, 0x2b9cd9f2U,
+  0xff56bd19U, 0x0d3d3e1aU, 0x1e6dcdeeU, 0xec064eedU,
+  0xc38d26c4U, 0x31e6a5c7U, 0x22b65633U, 0xd0ddd530U,
+  0x0417b1dbU, 0xf67c32d8U, 0xe52cc12cU, 0x1747422fU,
+  0x49547e0bU, 0xbb3ffd08U, 0xa86f0efcU, 0x5a048dffU,
+  0x8ecee914U, 0x7ca56a17U, 0x6ff599e3U, 0x9d9e1ae0U,
+  0xd3d3e1abU, 0x21b862a8U, 0x32e8915cU, 0xc083125fU,
+  0x144976b4U, 0xe622f5b7U, 0xf5720643U, 0x07198540U,
+  0x590ab964U, 0xab613a67U, 0xb831c993U, 0x4a5a4a90U,
+  0x9e902e7bU, 0x6cfbad78U, 0x7fab5e8cU, 0x8dc0dd8fU,
+  0xe330a81aU, 0x115b2b19U, 0x020bd8edU, 0xf0605beeU,
+  0x24aa3f05U, 0xd6c1bc06U, 0xc5914ff2U, 0x37faccf1U,
+  0x69e9f0d5U, 0x9b8273d6U, 0x88d28022U, 0x7ab90321U,
+  0xae7367caU, 0x5c18e4c9U, 0x4f48173dU, 0xbd23943eU,
+  0xf36e6f75U, 0x0105ec76U, 0x12551f82U, 0xe03e9c81U,
+  0x34f4f86aU, 0xc69f7b69U, 0xd5cf889dU, 0x27a40b9eU,
+  0x79b737baU, 0x8bdcb4b9U, 0x988c474dU, 0x6ae7c44eU,
+  0xbe2da0a5U, 0x4c4623a6U, 0x5f16d052U, 0xad7d5351U
+};
+
+static uint32_t crc32c_update(uint32_t crc, uint8_t const *p, size_t len) {
+  while (len--) {
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+uint32_t extprot_crc32c(void const *buffer, size_t len) {
+  return ~crc32c_update(0xffffffff, buffer, len);
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    p[i] = (uint8_t) (v >> (8 * i));
+  }
+}
+
+static uint64_t get_le(uint8_t const *p, int n) {
+  uint64_t v = 0;
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+  return v;
+}
+
+static uint32_t frame_crc(uint8_t const *length_bytes, uint8_t const *msg, size_t len) {
+  uint32_t crc = crc32c_update(0xffffffff, length_bytes, 4);
+  return ~crc32c_update(crc, msg, len);
+}
+
+Extprot_Error extprot_log_create(Extprot_Log_Writer *w, char const *path) {
+  w->count = 0;
+  w->capacity = 0;
+  w->offsets = NULL;
+  w->position = MAGIC_LEN;
+  w->scratch = NULL;
+  w->scratch_capacity = 0;
+  w->error = Extprot_NoError;
+
+  w->f = fopen(path, "wb");
+  if (w->f == NULL || fwrite(LOG_MAGIC, 1, MAGIC_LEN, w->f) != MAGIC_LEN) {
+    w->error = Extprot_IOError;
+  }
+  return w->error;
+}
+
+Extprot_Error extprot_log_append(Extprot_Log_Writer *w, void const *msg, size_t len) {
+  uint8_t header[FRAME_HEADER];
+
+  if (w->error) {
+    return w->error;
+  }
+  if ((uint32_t) len != len) {
+    return w->error = Extprot_SizeTOverflow;
+  }
+
+  if (w->count == w->capacity) {
+    size_t newcap = w->capacity ? w->capacity * 2 : 1024;
+    uint64_t *newoffsets = realloc(w->offsets, newcap * sizeof(uint64_t));
+    if (newoffsets == NULL) {
+      return w->error = Extprot_NoMemory;
+    }
+    w->offsets = newoffsets;
+    w->capacity = newcap;
+  }
+  w->offsets[w->count++] = w->position;
+
+  put_le(header, len, 4);
+  put_le(header + 4, frame_crc(header, msg, len), 4);
+  if (fwrite(header, 1, FRAME_HEADER, w->f) != FRAME_HEADER ||
+      fwrite(msg, 1, len, w->f) != len) {
+    return w->error = Extprot_IOError;
+  }
+  w->position += FRAME_HEADER + len;
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_log_append_object(Extprot_Log_Writer *w, Extprot_Object const *o) {
+  size_t len = extprot_compute_length(o);
+  if (len > w->scratch_capacity) {
+    uint8_t *newscratch = realloc(w->scratch, len);
+    if (newscratch == NULL) {
+      return Extprot_NoMemory;
+    }
+    w->scratch = newscratch;
+    w->scratch_capacity = len;
+  }
+  extprot_encode(o, w->scratch);
+  return extprot_log_append(w, w->scratch, len);
+}
+
+Extprot_Error extprot_log_close(Extprot_Log_Writer *w) {
+  Extprot_Error e = w->error;
+  uint8_t entry[MAGIC_LEN];
+  size_t i;
+
+  if (w->f != NULL) {
+    for (i = 0; i < w->count && !e; i++) {
+      put_le(entry, w->offsets[i], 8);
+      if (fwrite(entry, 1, 8, w->f) != 8) {
+	e = Extprot_IOError;
+      }
+    }
+    put_le(entry, w->count, 8);
+    if (!e && (fwrite(entry, 1, 8, w->f) != 8 ||
+	       fwrite(INDEX_MAGIC, 1, MAGIC_LEN, w->f) != MAGIC_LEN)) {
+      e = Extprot_IOError;
+    }
+    if (fclose(w->f) != 0 && !e) {
+      e = Extprot_IOError;
+    }
+    w->f = NULL;
+  }
+
+  free(w->offsets);
+  free(w->scratch);
+  w->offsets = NULL;
+  w->scratch = NULL;
+  return e;
+}
+
+/* Rebuilds the index of a segment without one by walking its frames,
+   stopping at the first that is truncated or fails its checksum. */
+static Extprot_Error recover_index(Extprot_Log *log) {
+  size_t capacity = 0;
+  size_t pos = MAGIC_LEN;
+  uint8_t *index = NULL;
+
+  log->count = 0;
+  while (log->size - pos >= FRAME_HEADER) {
+    uint8_t const *p = log->base + pos;
+    size_t len = (size_t) get_le(p, 4);
+    if (len > log->size - pos - FRAME_HEADER ||
+	frame_crc(p, p + FRAME_HEADER, len) != (uint32_t) get_le(p + 4, 4)) {
+      break;
+    }
+    if (log->count == capacity) {
+      uint8_t *newindex;
+      capacity = capacity ? capacity * 2 : 1024;
+      newindex = realloc(index, capacity * 8);
+      if (newindex == NULL) {
+	free(index);
+	log->count = 0;
+	return Extprot_NoMemory;
+      }
+      index = newindex;
+    }
+    put_le(index + 8 * log->count++, pos, 8);
+    pos += FRAME_HEADER + len;
+  }
+
+  log->index = index;
+  log->owns_index = 1;
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_log_open(Extprot_Log *log, char const *path) {
+  struct stat st;
+  int fd;
+  void *map;
+
+  log->base = NULL;
+  log->size = 0;
+  log->count = 0;
+  log->index = NULL;
+  log->owns_index = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return Extprot_IOError;
+  }
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return Extprot_IOError;
+  }
+  if ((size_t) st.st_size < MAGIC_LEN) {
+    close(fd);
+    return Extprot_BadLog;
+  }
+  map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return Extprot_IOError;
+  }
+  log->base = map;
+  log->size = (size_t) st.st_size;
+
+  if (memcmp(log->base, LOG_MAGIC, MAGIC_LEN) != 0) {
+    extprot_log_unmap(log);
+    return Extprot_BadLog;
+  }
+
+  if (log->size >= MAGIC_LEN + TRAILER_LEN &&
+      memcmp(log->base + log->size - MAGIC_LEN, INDEX_MAGIC, MAGIC_LEN) == 0) {
+    uint64_t count = get_le(log->base + log->size - TRAILER_LEN, 8);
+    if (count <= (log->size - MAGIC_LEN - TRAILER_LEN) / 8) {
+      log->count = (size_t) count;
+      log->index = log->base + log->size - TRAILER_LEN - 8 * log->count;
+      return Extprot_NoError;
+    }
+  }
+
+  if (recover_index(log) != Extprot_NoError) {
+    extprot_log_unmap(log);
+    return Extprot_NoMemory;
+  }
+  return Extprot_NoError;
+}
+
+void extprot_log_unmap(Extprot_Log *log) {
+  if (log->owns_index) {
+    free((void *) log->index);
+  }
+  if (log->base != NULL) {
+    munmap((void *) log->base, log->size);
+  }
+  log->base = NULL;
+  log->size = 0;
+  log->count = 0;
+  log->index = NULL;
+  log->owns_index = 0;
+}
+
+Extprot_Error extprot_log_frames(Extprot_Log const *log, size_t first, size_t n,
+				 Extprot_Frame *frames)
+{
+  size_t i;
+
+  if (first > log->count || n > log->count - first) {
+    return Extprot_BadLog;
+  }
+  for (i = 0; i < n; i++) {
+    uint64_t pos = get_le(log->index + 8 * (first + i), 8);
+    uint8_t const *p;
+    size_t len;
+
+    if (pos < MAGIC_LEN || pos > log->size - FRAME_HEADER) {
+      return Extprot_BadLog;
+    }
+    p = log->base + pos;
+    len = (size_t) get_le(p, 4);
+    if (len > log->size - pos - FRAME_HEADER) {
+      return Extprot_BadLog;
+    }
+    if (frame_crc(p, p + FRAME_HEADER, len) != (uint32_t) get_le(p + 4, 4)) {
+      return Extprot_BadChecksum;
+    }
+    frames[i].offset = (size_t) pos + FRAME_HEADER;
+    frames[i].length = len;
+    {
+      size_t total;
+      if (extprot_decode_header(p + FRAME_HEADER, len, &frames[i].tag_and_type, &total)) {
+	frames[i].tag_and_type = 0;
+      }
+    }
+  }
+  return Extprot_NoError;
+}
+
+Extprot_Error extprot_log_get(Extprot_Log const *log, size_t n,
+			      void const **msg, size_t *len)
+{
+  Extprot_Frame f;
+  Extprot_Error e = extprot_log_frames(log, n, 1, &f);
+  if (e) {
+    return e;
+  }
+  *msg = log->base + f.offset;
+  *len = f.length;
+  return Extprot_NoError;
+}
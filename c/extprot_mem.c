@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include <sys/types.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "extprot.h"
 
@@ -37,8 +38,15 @@ void init_extprot_pool(Extprot_Pool *pool, size_t pagesize) {
   pool->root = NULL;
 
   pool->num_blocks = 0;
+  pool->blocks_in_use = 0;
+  pool->blocklist_capacity = 0;
   pool->blocklist = NULL;
 
+  pool->num_pages = 0;
+  pool->pages_in_use = 0;
+  pool->pagelist_capacity = 0;
+  pool->pagelist = NULL;
+
   pool->pagesize = pagesize ? pagesize : 4096;
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
@@ -46,50 +54,197 @@ void init_extprot_pool(Extprot_Pool *pool, size_t pagesize) {
 #ifndef EXTPROT_NO_BIGNUMS
   pool->bignum_chain = NULL;
 #endif
+
+  pool->stats = NULL;
 }
 
-void empty_extprot_pool(Extprot_Pool *pool) {
+void extprot_stats_init(Extprot_Stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void extprot_pool_set_stats(Extprot_Pool *pool, Extprot_Stats *stats) {
+  pool->stats = stats;
+}
+
+static void note_footprint(Extprot_Pool *pool, size_t grown, size_t shrunk) {
+  Extprot_Stats *stats = pool->stats;
+  if (stats != NULL) {
+    stats->footprint += grown;
+    stats->footprint -= shrunk < stats->footprint ? shrunk : stats->footprint;
+    if (stats->footprint > stats->peak_footprint) {
+      stats->peak_footprint = stats->footprint;
+    }
+  }
+}
+
+static size_t total_size(Extprot_Pool_Block const *list, int count) {
+  size_t n = 0;
   int i;
+  for (i = 0; i < count; i++) {
+    n += list[i].size;
+  }
+  return n;
+}
 
-  pool->root = NULL;
+static void free_blocks(Extprot_Pool_Block **list, int *count, int *in_use, int *capacity) {
+  int i;
+  for (i = 0; i < *count; i++) {
+    free((*list)[i].block);
+  }
+  if (*list != NULL) {
+    free(*list);
+  }
+  *list = NULL;
+  *count = 0;
+  *in_use = 0;
+  *capacity = 0;
+}
 
+/* Re-zeroes just the parts of the live blocks that were handed out, and
+   marks every block spare. */
+static void recycle_blocks(Extprot_Pool_Block *list, int *in_use) {
+  int i;
+  for (i = 0; i < *in_use; i++) {
+    memset(list[i].block, 0, list[i].used);
+    list[i].used = 0;
+  }
+  *in_use = 0;
+}
+
+static void clear_bignums(Extprot_Pool *pool) {
 #ifndef EXTPROT_NO_BIGNUMS
-  {
-    Extprot_Object *p = pool->bignum_chain;
-    while (p != NULL) {
-      mpz_clear(p->body.vint.value);
-      p = p->body.vint.chain;
-    }
+  Extprot_Object *p = pool->bignum_chain;
+  while (p != NULL) {
+    mpz_clear(p->body.vint.value);
+    p = p->body.vint.chain;
   }
+  pool->bignum_chain = NULL;
 #endif
+}
 
-  for (i = 0; i < pool->num_blocks; i++) {
-    free(pool->blocklist[i]);
-  }
-  if (pool->blocklist != NULL) {
-    free(pool->blocklist);
+void empty_extprot_pool(Extprot_Pool *pool) {
+  pool->root = NULL;
+  clear_bignums(pool);
+
+  note_footprint(pool, 0, total_size(pool->blocklist, pool->num_blocks) +
+		 total_size(pool->pagelist, pool->num_pages));
+  free_blocks(&pool->blocklist, &pool->num_blocks, &pool->blocks_in_use,
+	      &pool->blocklist_capacity);
+  free_blocks(&pool->pagelist, &pool->num_pages, &pool->pages_in_use,
+	      &pool->pagelist_capacity);
+
+  pool->alloc_block = NULL;
+  pool->alloc_used = 0;
+}
+
+/* Frees the spare blocks that went unused since the last reset, once
+   the blocks kept would exceed EXTPROT_POOL_SPARE_LIMIT. The blocks just
+   used are always kept, in order, since the next message is likely to
+   want them again. */
+static void trim_spares(Extprot_Pool *pool) {
+  Extprot_Pool_Block *list = pool->blocklist;
+  size_t kept = total_size(list, pool->blocks_in_use), freed = 0;
+  int i, n = pool->blocks_in_use;
+
+  for (i = pool->blocks_in_use; i < pool->num_blocks; i++) {
+    if (kept + list[i].size <= EXTPROT_POOL_SPARE_LIMIT) {
+      kept += list[i].size;
+      list[n++] = list[i];
+    } else {
+      freed += list[i].size;
+      free(list[i].block);
+    }
   }
-  pool->num_blocks = 0;
-  pool->blocklist = NULL;
+  pool->num_blocks = n;
+  note_footprint(pool, 0, freed);
+}
 
-  if (pool->alloc_block != NULL) {
-    free(pool->alloc_block);
+void reset_extprot_pool(Extprot_Pool *pool) {
+  pool->root = NULL;
+  clear_bignums(pool);
+
+  if (pool->pages_in_use > 0) {
+    pool->pagelist[pool->pages_in_use - 1].used = pool->alloc_used;
   }
+  trim_spares(pool);
+  recycle_blocks(pool->blocklist, &pool->blocks_in_use);
+  recycle_blocks(pool->pagelist, &pool->pages_in_use);
+
   pool->alloc_block = NULL;
   pool->alloc_used = 0;
 }
 
-static void record_pool_block(Extprot_Pool *pool, void *block) {
-  size_t blocklistlength = sizeof(void *) * (pool->num_blocks + 1);
+/* Appends a fresh zeroed block of the given size. The bookkeeping arrays
+   grow geometrically, so recording n blocks costs O(n) overall. */
+static void add_block(Extprot_Pool_Block **list, int *count, int *capacity, size_t size) {
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 8;
+    *list = realloc(*list, sizeof(Extprot_Pool_Block) * *capacity);
+  }
+  (*list)[*count].block = calloc(1, size);
+  (*list)[*count].size = size;
+  (*list)[*count].used = 0;
+  (*count)++;
+}
 
-  if (pool->blocklist == NULL) {
-    pool->blocklist = malloc(blocklistlength);
-  } else {
-    pool->blocklist = realloc(pool->blocklist, blocklistlength);
+/* Spare blocks stay in the order they were last handed out, so a
+   stream of similar messages finds the block it needs at the head of
+   the spares. Oversized allocations take the first of the next
+   SPARE_SCAN spares that is big enough, or a new block, which keeps
+   each one O(1) however many spares there are. */
+#define SPARE_SCAN 8
+
+static void *alloc_large(Extprot_Pool *pool, size_t amount) {
+  Extprot_Pool_Block *list;
+  Extprot_Pool_Block tmp;
+  int i, best = -1;
+
+  for (i = pool->blocks_in_use; i < pool->num_blocks && i < pool->blocks_in_use + SPARE_SCAN; i++) {
+    if (pool->blocklist[i].size >= amount) {
+      best = i;
+      break;
+    }
+  }
+  if (best == -1) {
+    add_block(&pool->blocklist, &pool->num_blocks, &pool->blocklist_capacity, amount);
+    note_footprint(pool, amount, 0);
+    best = pool->num_blocks - 1;
+  }
+  if (pool->stats != NULL) {
+    pool->stats->large_allocs++;
+    pool->stats->large_bytes += pool->blocklist[best].size;
+    pool->stats->bytes_reserved += pool->blocklist[best].size;
+  }
+
+  list = pool->blocklist;
+  tmp = list[best];
+  list[best] = list[pool->blocks_in_use];
+  list[pool->blocks_in_use] = tmp;
+
+  list[pool->blocks_in_use].used = amount;
+  return list[pool->blocks_in_use++].block;
+}
+
+/* Makes a zeroed page current, reusing a kept page if there is one. */
+static void next_pool_page(Extprot_Pool *pool) {
+  if (pool->pages_in_use > 0) {
+    pool->pagelist[pool->pages_in_use - 1].used = pool->alloc_used;
+    if (pool->stats != NULL) {
+      pool->stats->page_tail_waste += pool->pagesize - pool->alloc_used;
+    }
+  }
+
+  if (pool->pages_in_use == pool->num_pages) {
+    add_block(&pool->pagelist, &pool->num_pages, &pool->pagelist_capacity, pool->pagesize);
+    note_footprint(pool, pool->pagesize, 0);
+  }
+  if (pool->stats != NULL) {
+    pool->stats->pages++;
   }
 
-  pool->blocklist[pool->num_blocks] = block;
-  pool->num_blocks++;
+  pool->alloc_block = pool->pagelist[pool->pages_in_use].block;
+  pool->alloc_used = 0;
+  pool->pages_in_use++;
 }
 
 void *extprot_pool_alloc(Extprot_Pool *pool, size_t amount) {
@@ -97,12 +252,17 @@ void *extprot_pool_alloc(Extprot_Pool *pool, size_t amount) {
     return NULL;
   }
 
+  if (pool->stats != NULL) {
+    pool->stats->bytes_requested += amount;
+  }
+
   amount = (amount + 7) & (~7); /* round up to nearest 8-byte boundary */
 
   if (amount > (pool->pagesize >> 1)) {
-    void *result = calloc(1, amount);
-    record_pool_block(pool, result);
-    return result;
+    return alloc_large(pool, amount);
+  }
+  if (pool->stats != NULL) {
+    pool->stats->bytes_reserved += amount;
   }
 
   if (pool->alloc_block != NULL) {
@@ -113,11 +273,9 @@ void *extprot_pool_alloc(Extprot_Pool *pool, size_t amount) {
       pool->alloc_used += amount;
       return result;
     }
-
-    record_pool_block(pool, pool->alloc_block);
   }
 
-  pool->alloc_block = calloc(1, pool->pagesize);
+  next_pool_page(pool);
   pool->alloc_used = amount;
   return pool->alloc_block;
 }
@@ -130,6 +288,22 @@ char const *extprot_error_message(Extprot_Error error) {
     case Extprot_VintOverflow: return "vint value overflowed 64 bits";
     case Extprot_SizeTOverflow: return "vint value overflowed size_t";
     case Extprot_InvalidTag: return "Invalid tag";
+    case Extprot_BufferFull: return "Output buffer full";
+    case Extprot_BadNesting: return "Unbalanced or malformed writer nesting";
+    case Extprot_Incomplete: return "Incomplete input";
+    case Extprot_PathNotFound: return "No value at the given path";
+    case Extprot_TooDeep: return "Maximum nesting depth exceeded";
+    case Extprot_IOError: return "I/O error";
+    case Extprot_BadLog: return "Not a valid log segment";
+    case Extprot_BadChecksum: return "Checksum mismatch";
+    case Extprot_BadWireType: return "Unexpected wire type";
+    case Extprot_UnknownTag: return "Unknown tag";
+    case Extprot_MissingField: return "Missing field without a default";
+    case Extprot_BadSchema: return "Malformed schema descriptor";
+    case Extprot_BadLength: return "Length prefix disagrees with contents";
+    case Extprot_BadCount: return "Element count exceeds the bytes that follow";
+    case Extprot_OverBudget: return "Decode memory budget exceeded";
+    case Extprot_NoMemory: return "Out of memory";
     default:
       sprintf(err_buf, "Unknown error (%d)", (int) error);
       return err_buf;
@@ -138,24 +312,89 @@ char const *extprot_error_message(Extprot_Error error) {
 
 #define ALLOCO(wire_type)						\
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object)); \
+  if (o == NULL) return NULL;						\
   o->kind = (tag << 4) | (wire_type);
 
 #ifndef EXTPROT_NO_BIGNUMS
 Extprot_Object *extprot_vint(Extprot_Pool *pool, Extprot_Tag tag) {
   ALLOCO(EXTPROT_VINT);
+  o->flags |= EXTPROT_FLAG_VINT_BIG;
   o->body.vint.chain = pool->bignum_chain;
   mpz_init(o->body.vint.value);
   pool->bignum_chain = o;
   return o;
 }
+
+Extprot_Object *extprot_vint_64(Extprot_Pool *pool, Extprot_Tag tag, uint64_t num) {
+  ALLOCO(EXTPROT_VINT);
+  o->body.vint64 = num;
+  return o;
+}
+
+Extprot_Object *extprot_vint_mpz(Extprot_Pool *pool, Extprot_Tag tag, mpz_srcptr num) {
+  Extprot_Object *o;
+  if (mpz_sgn(num) >= 0 && mpz_sizeinbase(num, 2) <= 64) {
+    uint64_t v = 0;
+    mpz_export(&v, NULL, -1, sizeof(v), 0, 0, num);
+    return extprot_vint_64(pool, tag, v);
+  }
+  o = extprot_vint(pool, tag);
+  if (o != NULL) {
+    mpz_set(o->body.vint.value, num);
+  }
+  return o;
+}
+
+void extprot_vint_get_mpz(Extprot_Object const *o, mpz_ptr out) {
+  if (EXTPROT_VINT_IS_BIG(o)) {
+    mpz_set(out, o->body.vint.value);
+  } else {
+    mpz_import(out, 1, -1, sizeof(o->body.vint64), 0, 0, &o->body.vint64);
+  }
+}
 #else
 Extprot_Object *extprot_vint(Extprot_Pool *pool, Extprot_Tag tag, uint64_t num) {
   ALLOCO(EXTPROT_VINT);
   o->body.vint = num;
   return o;
 }
+
+Extprot_Object *extprot_vint_64(Extprot_Pool *pool, Extprot_Tag tag, uint64_t num) {
+  return extprot_vint(pool, tag, num);
+}
 #endif
 
+/* Whether a vint fits in 64 bits is decided by its value, not by its
+   length on the wire, so a value is always stored the same way and
+   equal keys compare equal; without bignum support the high bits of
+   wider ones are dropped. */
+Extprot_Object *extprot_vint_wire(Extprot_Pool *pool, Extprot_Tag tag,
+				  uint8_t const *bytes, size_t count)
+{
+  uint8_t const *p = bytes;
+  uint64_t v = 0;
+
+  if (extprot_read_vint(&p, bytes + count, &v) == Extprot_NoError && p == bytes + count) {
+    return extprot_vint_64(pool, tag, v);
+  }
+#ifndef EXTPROT_NO_BIGNUMS
+  {
+    Extprot_Object *o;
+    mpz_t n;
+    mpz_init(n);
+    mpz_import(n, count, -1, 1, 0, 1, bytes);
+    o = extprot_vint_mpz(pool, tag, n);
+    mpz_clear(n);
+    return o;
+  }
+#else
+  for (v = 0; count > 0; count--) {
+    v = (v << 7) | (bytes[count - 1] & 0x7f);
+  }
+  return extprot_vint_64(pool, tag, v);
+#endif
+}
+
 Extprot_Object *extprot_bits8(Extprot_Pool *pool, Extprot_Tag tag, uint8_t num) {
   ALLOCO(EXTPROT_BITS8);
   o->body.bits8 = num;
@@ -191,6 +430,7 @@ Extprot_Object *extprot_tuple_init(Extprot_Pool *pool, Extprot_Tag tag, size_t l
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len * sizeof(Extprot_Object *));
   o->kind = (tag << 4) | EXTPROT_TUPLE;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
 
   va_start(vl, len);
   for (i = 0; i < len; i++) {
@@ -203,8 +443,12 @@ Extprot_Object *extprot_tuple_init(Extprot_Pool *pool, Extprot_Tag tag, size_t l
 
 Extprot_Object *extprot_tuple(Extprot_Pool *pool, Extprot_Tag tag, size_t len) {
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len * sizeof(Extprot_Object *));
+  if (o == NULL) {
+    return NULL;
+  }
   o->kind = (tag << 4) | EXTPROT_TUPLE;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
   return o;
 }
 
@@ -214,6 +458,7 @@ Extprot_Object *extprot_htuple_init(Extprot_Pool *pool, Extprot_Tag tag, size_t
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len * sizeof(Extprot_Object *));
   o->kind = (tag << 4) | EXTPROT_HTUPLE;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
 
   va_start(vl, len);
   for (i = 0; i < len; i++) {
@@ -226,8 +471,36 @@ Extprot_Object *extprot_htuple_init(Extprot_Pool *pool, Extprot_Tag tag, size_t
 
 Extprot_Object *extprot_htuple(Extprot_Pool *pool, Extprot_Tag tag, size_t len) {
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len * sizeof(Extprot_Object *));
+  if (o == NULL) {
+    return NULL;
+  }
   o->kind = (tag << 4) | EXTPROT_HTUPLE;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
+  return o;
+}
+
+/* Width in bytes of the elements of a packed htuple with elements of
+   the given wire type, or 0 if that type cannot be packed. */
+size_t extprot_packed_width(int wire_type) {
+  switch (wire_type) {
+    case EXTPROT_BITS8: return 1;
+    case EXTPROT_BITS32: return 4;
+    case EXTPROT_BITS64_LONG:
+    case EXTPROT_BITS64_FLOAT: return 8;
+    default: return 0;
+  }
+}
+
+Extprot_Object *extprot_htuple_packed(Extprot_Pool *pool, Extprot_Tag tag,
+				      Extprot_Tag elem_tag, int wire_type,
+				      void const *data, size_t len)
+{
+  ALLOCO(EXTPROT_HTUPLE);
+  o->flags |= EXTPROT_FLAG_PACKED;
+  o->body.packed.length = len;
+  o->body.packed.elem_kind = (elem_tag << 4) | wire_type;
+  o->body.packed.data = data;
   return o;
 }
 
@@ -243,12 +516,23 @@ Extprot_Object *extprot_cstring(Extprot_Pool *pool, Extprot_Tag tag, char const
 
 Extprot_Object *extprot_bytes(Extprot_Pool *pool, Extprot_Tag tag, void const *bin, size_t len) {
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len + 1);
+  if (o == NULL) {
+    return NULL;
+  }
   o->kind = (tag << 4) | EXTPROT_BYTES;
   o->body.bytes.length = len;
   memcpy(o->body.bytes.vec, bin, len);
   return o;
 }
 
+Extprot_Object *extprot_bytes_ref(Extprot_Pool *pool, Extprot_Tag tag, void const *bin, size_t len) {
+  ALLOCO(EXTPROT_BYTES);
+  o->flags |= EXTPROT_FLAG_BYTES_REF;
+  o->body.bytes_ref.length = len;
+  o->body.bytes_ref.ptr = bin;
+  return o;
+}
+
 Extprot_Object *extprot_bytes_nocopy(Extprot_Pool *pool, Extprot_Tag tag, size_t len) {
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len + 1);
   o->kind = (tag << 4) | EXTPROT_BYTES;
@@ -257,12 +541,72 @@ Extprot_Object *extprot_bytes_nocopy(Extprot_Pool *pool, Extprot_Tag tag, size_t
   return o;
 }
 
+Extprot_Object *extprot_raw(Extprot_Pool *pool, uint32_t tag_and_type,
+			    void const *encoded, size_t len)
+{
+  Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + len + 1);
+  o->kind = tag_and_type;
+  o->flags = EXTPROT_FLAG_RAW;
+  o->body.bytes.length = len;
+  memcpy(o->body.bytes.vec, encoded, len);
+  o->body.bytes.vec[len] = '\0';
+  return o;
+}
+
+Extprot_Object *extprot_raw_ref(Extprot_Pool *pool, uint32_t tag_and_type,
+				void const *encoded, size_t len)
+{
+  Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object));
+  o->kind = tag_and_type;
+  o->flags = EXTPROT_FLAG_RAW | EXTPROT_FLAG_BYTES_REF;
+  o->body.bytes_ref.length = len;
+  o->body.bytes_ref.ptr = encoded;
+  return o;
+}
+
+/* A lazy node's slots and Extprot_Lazy, at is EXTPROT_LAZY_AT() */
+static size_t lazy_node_size(size_t at) {
+  return (offsetof(Extprot_Object, body.tuple.vec) + at * sizeof(Extprot_Object *)
+	  + sizeof(Extprot_Lazy) + 7) & ~(size_t) 7;
+}
+
+Extprot_Object *extprot_lazy_tuple(Extprot_Pool *pool, uint32_t tag_and_type,
+				   size_t n, void const *data, size_t len,
+				   unsigned flags)
+{
+  size_t at = (tag_and_type & 0xf) == EXTPROT_ASSOC ? 2 * n + 1 : n;
+  Extprot_Object *o = extprot_pool_alloc(pool, lazy_node_size(at));
+  Extprot_Lazy *l;
+
+  o->kind = tag_and_type;
+  o->flags = EXTPROT_FLAG_LAZY;
+  o->body.tuple.length = n;
+  o->body.tuple.body_length = 0;
+  l = EXTPROT_LAZY(o);
+  l->data = data;
+  l->length = len;
+  l->offsets = NULL;
+  l->missing = at == n ? n : 2 * n;
+  l->flags = flags;
+  l->depth = 1;
+  l->max_depth = 0;
+  l->budget = (size_t) -1;
+  l->raw = NULL;
+  l->raw_arg = NULL;
+  return o;
+}
+
 Extprot_Object *extprot_assoc_init(Extprot_Pool *pool, Extprot_Tag tag, size_t len, ...) {
   va_list vl;
   size_t i;
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + 2 * len * sizeof(Extprot_Object *));
+  if (o == NULL) {
+    return NULL;
+  }
   o->kind = (tag << 4) | EXTPROT_ASSOC;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
+  o->body.tuple.vec[2 * len] = NULL;	/* spare slot, for the lookup index */
 
   va_start(vl, len);
   for (i = 0; i < len; i++) {
@@ -276,7 +620,281 @@ Extprot_Object *extprot_assoc_init(Extprot_Pool *pool, Extprot_Tag tag, size_t l
 
 Extprot_Object *extprot_assoc(Extprot_Pool *pool, Extprot_Tag tag, size_t len) {
   Extprot_Object *o = extprot_pool_alloc(pool, sizeof(Extprot_Object) + 2 * len * sizeof(Extprot_Object *));
+  if (o == NULL) {
+    return NULL;
+  }
   o->kind = (tag << 4) | EXTPROT_ASSOC;
   o->body.tuple.length = len;
+  o->body.tuple.body_length = 0;
+  o->body.tuple.vec[2 * len] = NULL;	/* spare slot, for the lookup index */
   return o;
 }
+
+/* Deep copies. The copy of a tree is laid out depth-first in a single
+   block of exactly the size extprot_copy_size() gives: each node is
+   followed by its children, and bytes payloads and packed arrays sit
+   right after their node. A lazy node is followed by its offsets and
+   its undecoded bytes, and has only its decoded elements copied. */
+
+static size_t num_children(Extprot_Object const *o) {
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    return 0;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+      return (o->flags & EXTPROT_FLAG_PACKED) ? 0 : o->body.tuple.length;
+    case EXTPROT_ASSOC:
+      return 2 * o->body.tuple.length;
+    default:
+      return 0;
+  }
+}
+
+/* Bytes a node takes in a copy, its children apart */
+static size_t copy_node_size(Extprot_Object const *o) {
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    return (sizeof(Extprot_Object) + o->body.bytes.length + 1 + 7) & ~(size_t) 7;
+  }
+  if (o->flags & EXTPROT_FLAG_LAZY) {
+    Extprot_Lazy const *l = EXTPROT_LAZY(o);
+    return lazy_node_size(EXTPROT_LAZY_AT(o))
+      + (l->offsets != NULL ? (num_children(o) + 1) * sizeof(size_t) : 0)
+      + ((l->length + 7) & ~(size_t) 7);
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+      if (o->flags & EXTPROT_FLAG_PACKED) {
+	return sizeof(Extprot_Object) +
+	  ((o->body.packed.length * extprot_packed_width(o->body.packed.elem_kind & 0xf) + 7)
+	   & ~(size_t) 7);
+      }
+      return sizeof(Extprot_Object) + o->body.tuple.length * sizeof(Extprot_Object *);
+    case EXTPROT_ASSOC:
+      return sizeof(Extprot_Object) + 2 * o->body.tuple.length * sizeof(Extprot_Object *);
+    case EXTPROT_BYTES:
+      return (sizeof(Extprot_Object) + o->body.bytes.length + 1 + 7) & ~(size_t) 7;
+    default:
+      return sizeof(Extprot_Object);
+  }
+}
+
+/* Both walks keep a frame per node whose children are still being
+   visited, the first COPY_FRAMES on the C stack and deeper ones on the
+   heap, so that deep trees cannot overflow the C stack. */
+typedef struct Copy_Frame_ {
+  Extprot_Object const *o;
+  Extprot_Object *c;		/* o's copy */
+  size_t next;
+  size_t n;
+} Copy_Frame;
+
+#define COPY_FRAMES 32
+
+static Copy_Frame *push_copy_frame(Copy_Frame **stack, Copy_Frame *inline_stack,
+				   size_t *depth, size_t *capacity)
+{
+  if (*depth == *capacity) {
+    Copy_Frame *newstack;
+    if (*stack == inline_stack) {
+      newstack = malloc(2 * *capacity * sizeof(Copy_Frame));
+      if (newstack != NULL) {
+	memcpy(newstack, *stack, *depth * sizeof(Copy_Frame));
+      }
+    } else {
+      newstack = realloc(*stack, 2 * *capacity * sizeof(Copy_Frame));
+    }
+    if (newstack == NULL) {
+      return NULL;
+    }
+    *stack = newstack;
+    *capacity *= 2;
+  }
+  return &(*stack)[(*depth)++];
+}
+
+size_t extprot_copy_size(Extprot_Object const *o) {
+  Copy_Frame inline_stack[COPY_FRAMES];
+  Copy_Frame *stack = inline_stack, *f;
+  size_t depth = 0, capacity = COPY_FRAMES;
+  size_t size = copy_node_size(o);
+  Extprot_Object const *child;
+
+  f = push_copy_frame(&stack, inline_stack, &depth, &capacity);
+  f->o = o;
+  f->next = 0;
+  f->n = num_children(o);
+  while (depth > 0) {
+    f = &stack[depth - 1];
+    if (f->next == f->n) {
+      depth--;
+      continue;
+    }
+    child = f->o->body.tuple.vec[f->next++];
+    if (child == NULL) {
+      continue;
+    }
+    size += copy_node_size(child);
+    if (num_children(child) > 0) {
+      f = push_copy_frame(&stack, inline_stack, &depth, &capacity);
+      if (f == NULL) {
+	size = 0;
+	break;
+      }
+      f->o = child;
+      f->next = 0;
+      f->n = num_children(child);
+    }
+  }
+
+  if (stack != inline_stack) {
+    free(stack);
+  }
+  return size;
+}
+
+static void copy_lazy(Extprot_Object const *o, Extprot_Object *c) {
+  Extprot_Lazy const *l = EXTPROT_LAZY(o);
+  Extprot_Lazy *cl = EXTPROT_LAZY(c);
+  uint8_t *p = (uint8_t *) c + lazy_node_size(EXTPROT_LAZY_AT(o));
+
+  *cl = *l;
+  if (l->offsets != NULL) {
+    cl->offsets = (size_t *) (void *) p;
+    memcpy(cl->offsets, l->offsets, (num_children(o) + 1) * sizeof(size_t));
+    p += (num_children(o) + 1) * sizeof(size_t);
+  }
+  memcpy(p, l->data, l->length);
+  cl->data = p;
+  cl->flags |= EXTPROT_DECODE_ZERO_COPY;	/* the copy owns its bytes */
+}
+
+/* Copies o to *next, leaving the slots of its children NULL */
+static Extprot_Object *copy_node(Extprot_Pool *pool, Extprot_Object const *o, char **next) {
+  Extprot_Object *c = (Extprot_Object *) *next;
+
+  *next += copy_node_size(o);
+  c->kind = o->kind;
+  c->flags = o->flags & ~(EXTPROT_FLAG_BYTES_REF | EXTPROT_FLAG_INDEXED);
+
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    c->body.bytes.length = o->body.bytes.length;
+    memcpy(c->body.bytes.vec, EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+    c->body.bytes.vec[o->body.bytes.length] = '\0';
+    return c;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_BYTES:
+      c->body.bytes.length = o->body.bytes.length;
+      memcpy(c->body.bytes.vec, EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+      break;
+
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+    case EXTPROT_ASSOC:
+      if (o->flags & EXTPROT_FLAG_PACKED) {
+	c->body.packed = o->body.packed;
+	c->body.packed.data = c + 1;
+	memcpy(c + 1, o->body.packed.data,
+	       o->body.packed.length * extprot_packed_width(o->body.packed.elem_kind & 0xf));
+	break;
+      }
+      c->body.tuple.length = o->body.tuple.length;
+      c->body.tuple.body_length = o->body.tuple.body_length;
+      if (o->flags & EXTPROT_FLAG_LAZY) {
+	copy_lazy(o, c);
+      }
+      if ((o->kind & 0xf) == EXTPROT_ASSOC) {
+	c->body.tuple.vec[num_children(o)] = NULL;
+      }
+      break;
+
+#ifndef EXTPROT_NO_BIGNUMS
+    case EXTPROT_VINT:
+      if (EXTPROT_VINT_IS_BIG(o)) {
+	c->body.vint.chain = pool->bignum_chain;
+	mpz_init_set(c->body.vint.value, o->body.vint.value);
+	pool->bignum_chain = c;
+	break;
+      }
+      c->body.vint64 = o->body.vint64;
+      break;
+#endif
+
+    default:
+      c->body = o->body;
+      break;
+  }
+  return c;
+}
+
+Extprot_Object *extprot_copy(Extprot_Pool *pool, Extprot_Object const *o) {
+  Copy_Frame inline_stack[COPY_FRAMES];
+  Copy_Frame *stack = inline_stack, *f;
+  size_t depth = 0, capacity = COPY_FRAMES;
+  size_t size = extprot_copy_size(o);
+  Extprot_Object const *child;
+  Extprot_Object *root;
+  char *block;
+
+  if (size == 0) {
+    return NULL;
+  }
+  if (pool->stats != NULL) {
+    pool->stats->bytes_requested += size;
+  }
+  block = alloc_large(pool, size);
+  root = copy_node(pool, o, &block);
+
+  f = push_copy_frame(&stack, inline_stack, &depth, &capacity);
+  f->o = o;
+  f->c = root;
+  f->next = 0;
+  f->n = num_children(o);
+  while (depth > 0) {
+    f = &stack[depth - 1];
+    if (f->next == f->n) {
+      depth--;
+      continue;
+    }
+    child = f->o->body.tuple.vec[f->next++];
+    if (child == NULL) {
+      continue;
+    }
+    f->c->body.tuple.vec[f->next - 1] = copy_node(pool, child, &block);
+    if (num_children(child) > 0) {
+      Extprot_Object *c = f->c->body.tuple.vec[f->next - 1];
+      f = push_copy_frame(&stack, inline_stack, &depth, &capacity);
+      if (f == NULL) {
+	root = NULL;
+	break;
+      }
+      f->o = child;
+      f->c = c;
+      f->next = 0;
+      f->n = num_children(child);
+    }
+  }
+
+  if (stack != inline_stack) {
+    free(stack);
+  }
+  return root;
+}
+
+void extprot_compact(Extprot_Pool *pool) {
+  Extprot_Pool fresh;
+
+  init_extprot_pool(&fresh, pool->pagesize);
+  fresh.stats = pool->stats;
+  if (pool->root != NULL) {
+    fresh.root = extprot_copy(&fresh, pool->root);
+    if (fresh.root == NULL) {
+      empty_extprot_pool(&fresh);
+      return;
+    }
+  }
+  empty_extprot_pool(pool);
+  *pool = fresh;
+}
@@ -0,0 +1,280 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Parallel decoding of a batch of messages located by
+   extprot_scan_frames(). Each worker decodes into a pool of its own.
+   The frames are first split into one contiguous range per worker;
+   a worker that runs out steals the upper half of the largest range
+   left, so a few large messages cannot hold up the whole batch. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <assert.h>
+
+#ifndef EXTPROT_NO_THREADS
+#include <pthread.h>
+#endif
+
+#include "extprot.h"
+
+typedef struct Batch_Job_ Batch_Job;
+
+typedef struct Batch_Worker_ {
+  Batch_Job *job;
+  Extprot_Pool *pool;
+#ifndef EXTPROT_NO_THREADS
+  pthread_mutex_t lock;		/* guards next and end */
+  pthread_t thread;
+  int started;
+#endif
+  size_t next;
+  size_t end;
+  size_t failed_at;		/* lowest failing frame, or num_frames */
+  Extprot_Error error;
+} Batch_Worker;
+
+struct Batch_Job_ {
+  uint8_t const *buffer;
+  Extprot_Frame const *frames;
+  size_t num_frames;
+  Extprot_Decode_Options const *opts;
+  Extprot_Object **roots;
+  Batch_Worker *workers;
+  size_t num_workers;
+};
+
+#ifndef EXTPROT_NO_THREADS
+#define LOCK(w)		pthread_mutex_lock(&(w)->lock)
+#define UNLOCK(w)	pthread_mutex_unlock(&(w)->lock)
+#else
+#define LOCK(w)		((void) 0)
+#define UNLOCK(w)	((void) 0)
+#endif
+
+void extprot_batch_init(Extprot_Batch *b) {
+  b->num_frames = 0;
+  b->roots_capacity = 0;
+  b->roots = NULL;
+  b->num_pools = 0;
+  b->pools = NULL;
+  b->failed_at = 0;
+}
+
+void extprot_batch_free(Extprot_Batch *b) {
+  size_t i;
+  for (i = 0; i < b->num_pools; i++) {
+    empty_extprot_pool(&b->pools[i]);
+  }
+  free(b->pools);
+  free(b->roots);
+  extprot_batch_init(b);
+}
+
+/* Takes the next frame from w's own range. */
+static int take_own(Batch_Worker *w, size_t *frame) {
+  int found = 0;
+  LOCK(w);
+  if (w->next < w->end) {
+    *frame = w->next++;
+    found = 1;
+  }
+  UNLOCK(w);
+  return found;
+}
+
+/* Moves the upper half of the largest range held by another worker
+   into w's range. Ranges only ever shrink, so finding nothing to steal
+   means the batch is finished. */
+static int steal(Batch_Worker *w) {
+  Batch_Job *job = w->job;
+  size_t i;
+
+  while (1) {
+    Batch_Worker *victim = NULL;
+    size_t best = 0, lo, hi;
+
+    for (i = 0; i < job->num_workers; i++) {
+      Batch_Worker *v = &job->workers[i];
+      size_t left;
+      if (v == w) {
+	continue;
+      }
+      LOCK(v);
+      left = v->end - v->next;
+      UNLOCK(v);
+      if (left > best) {
+	best = left;
+	victim = v;
+      }
+    }
+    if (victim == NULL) {
+      return 0;
+    }
+
+    LOCK(victim);
+    lo = victim->next + (victim->end - victim->next) / 2;
+    hi = victim->end;
+    victim->end = lo;
+    UNLOCK(victim);
+    if (lo < hi) {
+      LOCK(w);
+      w->next = lo;
+      w->end = hi;
+      UNLOCK(w);
+      return 1;
+    }
+    /* The victim drained its range meanwhile; look again. */
+  }
+}
+
+static void *run_worker(void *arg) {
+  Batch_Worker *w = arg;
+  Batch_Job *job = w->job;
+  size_t i;
+
+  do {
+    while (take_own(w, &i)) {
+      Extprot_Frame const *f = &job->frames[i];
+      Extprot_Error e = extprot_decode_with(w->pool, job->buffer + f->offset,
+					    f->length, job->opts);
+      if (e) {
+	job->roots[i] = NULL;
+	if (i < w->failed_at) {
+	  w->failed_at = i;
+	  w->error = e;
+	}
+      } else {
+	job->roots[i] = w->pool->root;
+      }
+    }
+  } while (steal(w));
+
+  return NULL;
+}
+
+Extprot_Error extprot_decode_batch(Extprot_Batch *b,
+				   void const *buffer,
+				   Extprot_Frame const *frames,
+				   size_t num_frames,
+				   unsigned num_threads,
+				   Extprot_Decode_Options const *opts)
+{
+  Batch_Job job;
+  Batch_Worker *workers;
+  Extprot_Error e = Extprot_NoError;
+  size_t i;
+
+#ifdef EXTPROT_NO_THREADS
+  num_threads = 1;
+#endif
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (num_threads > num_frames && num_frames > 0) {
+    num_threads = (unsigned) num_frames;
+  }
+
+  if (num_frames > b->roots_capacity) {
+    Extprot_Object **newroots = realloc(b->roots, num_frames * sizeof(Extprot_Object *));
+    if (newroots == NULL) {
+      return Extprot_NoMemory;
+    }
+    b->roots = newroots;
+    b->roots_capacity = num_frames;
+  }
+  if (num_threads > b->num_pools) {
+    Extprot_Pool *newpools = realloc(b->pools, num_threads * sizeof(Extprot_Pool));
+    if (newpools == NULL) {
+      return Extprot_NoMemory;
+    }
+    b->pools = newpools;
+    for (i = b->num_pools; i < num_threads; i++) {
+      init_extprot_pool(&b->pools[i], 0);
+    }
+    b->num_pools = num_threads;
+  }
+  workers = malloc(num_threads * sizeof(Batch_Worker));
+  if (workers == NULL) {
+    return Extprot_NoMemory;
+  }
+  for (i = 0; i < b->num_pools; i++) {
+    reset_extprot_pool(&b->pools[i]);
+  }
+  b->num_frames = num_frames;
+  b->failed_at = num_frames;
+
+  job.buffer = buffer;
+  job.frames = frames;
+  job.num_frames = num_frames;
+  job.opts = opts;
+  job.roots = b->roots;
+  job.workers = workers;
+  job.num_workers = num_threads;
+
+  for (i = 0; i < num_threads; i++) {
+    Batch_Worker *w = &workers[i];
+    w->job = &job;
+    w->pool = &b->pools[i];
+    w->next = num_frames * i / num_threads;
+    w->end = num_frames * (i + 1) / num_threads;
+    w->failed_at = num_frames;
+    w->error = Extprot_NoError;
+#ifndef EXTPROT_NO_THREADS
+    pthread_mutex_init(&w->lock, NULL);
+    w->started = 0;
+#endif
+  }
+
+#ifndef EXTPROT_NO_THREADS
+  /* The calling thread acts as worker 0. A thread that cannot be
+     started simply leaves its range to be stolen. */
+  for (i = 1; i < num_threads; i++) {
+    workers[i].started =
+      pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) == 0;
+  }
+#endif
+  run_worker(&workers[0]);
+
+#ifndef EXTPROT_NO_THREADS
+  for (i = 1; i < num_threads; i++) {
+    if (workers[i].started) {
+      pthread_join(workers[i].thread, NULL);
+    }
+  }
+#endif
+
+  for (i = 0; i < num_threads; i++) {
+#ifndef EXTPROT_NO_THREADS
+    pthread_mutex_destroy(&workers[i].lock);
+#endif
+    if (workers[i].failed_at < b->failed_at) {
+      b->failed_at = workers[i].failed_at;
+      e = workers[i].error;
+    }
+  }
+
+  free(workers);
+  return e;
+}
@@ -0,0 +1,979 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Table-driven decoding for schemas only known at run time. A schema
+   descriptor, as written by compiler/gen_schema.ml, is
+
+     "EXTPSCH1" vint:num_messages message*
+
+     message = string:name vint:is_sum vint:num_cases
+               (string:case_name vint:num_fields (string:field_name type)*)*
+     type    = vint:code, followed for
+                 EXTPROT_T_TUPLE   by vint:n type{n}
+                 EXTPROT_T_LIST    by type
+                 EXTPROT_T_SUM     by vint:num_constants vint:num_non_constants
+                                      (vint:tag string:name){num_constants}
+                                      (vint:tag string:name vint:n type{n})*
+                 EXTPROT_T_MESSAGE by string:name
+     string  = vint:length byte*
+
+   Loading resolves message references, lays every type out the way a C
+   compiler would lay out the equivalent structs (see the type codes in
+   extprot.h), and builds tag dispatch tables for the sums. Decoding
+   then follows the tables, with the defaulting and promotion rules of
+   the OCaml reader. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "extprot.h"
+
+#define CHECK(expr)				\
+  {						\
+    Extprot_Error __e = (expr);			\
+    if (__e != Extprot_NoError) {		\
+      return __e;				\
+    }						\
+  }
+
+#define LEFT(r)		((size_t) ((r)->end - (r)->p))
+#define ALIGNOF(type)	offsetof(struct { char c; type t; }, t)
+
+#define MAGIC		"EXTPSCH1"
+#define MAGIC_LEN	8
+#define MAX_DESC_DEPTH	256	/* type nesting within a descriptor */
+#define MAX_TAG		0xffff
+#define DEFAULT_MAX_DEPTH 256
+
+/* Indexed by type code. */
+static struct {
+  size_t size;
+  size_t align;
+  int wire_type;
+} const prims[] = {
+  { 0, 0, -1 },
+  { sizeof(int), ALIGNOF(int), EXTPROT_BITS8 },
+  { sizeof(uint8_t), ALIGNOF(uint8_t), EXTPROT_BITS8 },
+  { sizeof(int64_t), ALIGNOF(int64_t), EXTPROT_VINT },
+  { sizeof(int32_t), ALIGNOF(int32_t), EXTPROT_BITS32 },
+  { sizeof(int64_t), ALIGNOF(int64_t), EXTPROT_BITS64_LONG },
+  { sizeof(double), ALIGNOF(double), EXTPROT_BITS64_FLOAT },
+  { sizeof(Extprot_String), ALIGNOF(Extprot_String), EXTPROT_BYTES }
+};
+
+#define IS_PRIM(code)	((code) >= EXTPROT_T_BOOL && (code) <= EXTPROT_T_STRING)
+
+/* Reading. Values are type-checked the way the OCaml reader checks
+   them: a primitive must carry tag 0 and the expected wire type, or be
+   the first element of a tuple (a primitive field that has since been
+   extended into a tuple). Whatever fails to match is skipped over
+   before the error is returned, so the caller can carry on with the
+   next field. */
+
+typedef struct Reader_ {
+  Extprot_Pool *pool;		/* for lists */
+  uint8_t const *p;
+  uint8_t const *end;
+} Reader;
+
+static void reader_init(Reader *r, Extprot_Pool *pool,
+			void const *buffer, size_t len)
+{
+  r->pool = pool;
+  r->p = buffer;
+  r->end = r->p + len;
+}
+
+static Extprot_Error read_vint(Reader *r, uint64_t *v) {
+  return extprot_read_vint(&r->p, r->end, v);
+}
+
+/* A value that cannot be skipped takes the rest of the input with it. */
+static Extprot_Error skip_value(Reader *r, uint64_t prefix) {
+  Extprot_Error e = extprot_skip_body(&r->p, r->end, prefix);
+  if (e != Extprot_NoError) {
+    r->p = r->end;
+  }
+  return e;
+}
+
+static Extprot_Error read_container(Reader *r, uint8_t const **end,
+				    uint64_t *nelms)
+{
+  uint64_t len;
+  CHECK(read_vint(r, &len));
+  if (len > LEFT(r)) {
+    return Extprot_EarlyEOF;
+  }
+  *end = r->p + len;
+  CHECK(read_vint(r, nelms));
+  /* every element takes at least one byte */
+  if (r->p > *end || *nelms > (uint64_t) (*end - r->p)) {
+    r->p = *end;
+    return Extprot_EarlyEOF;
+  }
+  return Extprot_NoError;
+}
+
+/* Reads the prefix of a primitive of the given wire type, leaving r at
+   its body. If the value turns out to be a tuple, r is left at its first
+   element and *eot set to the end of the tuple, where the caller should
+   resume once the element has been read. */
+static Extprot_Error prim_prefix(Reader *r, int wire_type, uint8_t const **eot) {
+  uint64_t p, nelms;
+
+  *eot = NULL;
+  CHECK(read_vint(r, &p));
+  if (p == (uint64_t) wire_type) {
+    return Extprot_NoError;
+  }
+  if ((p >> 4) != 0) {
+    skip_value(r, p);
+    return Extprot_UnknownTag;
+  }
+  if ((p & 0xf) != EXTPROT_TUPLE) {
+    skip_value(r, p);
+    return Extprot_BadWireType;
+  }
+
+  CHECK(read_container(r, eot, &nelms));
+  if (nelms >= 1 && read_vint(r, &p) == Extprot_NoError) {
+    if ((p >> 4) != 0) {
+      r->p = *eot;
+      return Extprot_UnknownTag;
+    }
+    if (p == (uint64_t) wire_type) {
+      return Extprot_NoError;
+    }
+  }
+  r->p = *eot;
+  return Extprot_BadWireType;
+}
+
+static Extprot_Error read_raw_bool(Reader *r, int *v) {
+  if (LEFT(r) < 1) {
+    return Extprot_EarlyEOF;
+  }
+  *v = *r->p++ != 0;
+  return Extprot_NoError;
+}
+
+static Extprot_Error read_raw_i8(Reader *r, uint8_t *v) {
+  if (LEFT(r) < 1) {
+    return Extprot_EarlyEOF;
+  }
+  *v = *r->p++;
+  return Extprot_NoError;
+}
+
+static Extprot_Error read_raw_rel_int(Reader *r, int64_t *v) {
+  uint64_t n;
+  CHECK(read_vint(r, &n));
+  *v = (int64_t) (n >> 1) ^ -(int64_t) (n & 1);
+  return Extprot_NoError;
+}
+
+static uint64_t get_le(uint8_t const *p, int n) {
+  uint64_t v = 0;
+  while (n--) {
+    v = (v << 8) | p[n];
+  }
+  return v;
+}
+
+static Extprot_Error read_raw_i32(Reader *r, int32_t *v) {
+  if (LEFT(r) < 4) {
+    return Extprot_EarlyEOF;
+  }
+  *v = (int32_t) (uint32_t) get_le(r->p, 4);
+  r->p += 4;
+  return Extprot_NoError;
+}
+
+static Extprot_Error read_raw_i64(Reader *r, int64_t *v) {
+  if (LEFT(r) < 8) {
+    return Extprot_EarlyEOF;
+  }
+  *v = (int64_t) get_le(r->p, 8);
+  r->p += 8;
+  return Extprot_NoError;
+}
+
+static Extprot_Error read_raw_float(Reader *r, double *v) {
+  uint64_t bits;
+  if (LEFT(r) < 8) {
+    return Extprot_EarlyEOF;
+  }
+  bits = get_le(r->p, 8);
+  memcpy(v, &bits, 8);
+  r->p += 8;
+  return Extprot_NoError;
+}
+
+/* The string references the input, which must outlive it. */
+static Extprot_Error read_raw_string(Reader *r, Extprot_String *v) {
+  uint64_t len;
+  CHECK(read_vint(r, &len));
+  if (len > LEFT(r)) {
+    return Extprot_EarlyEOF;
+  }
+  v->length = (size_t) len;
+  v->data = (char const *) r->p;
+  r->p += len;
+  return Extprot_NoError;
+}
+
+#define READ_PRIM(r, wire_type, raw)			\
+  {							\
+    uint8_t const *eot;					\
+    Extprot_Error e;					\
+    CHECK(prim_prefix((r), (wire_type), &eot));		\
+    e = (raw);						\
+    if (eot != NULL) {					\
+      (r)->p = eot;					\
+    }							\
+    return e;						\
+  }
+
+static Extprot_Error read_bool(Reader *r, int *v)
+  READ_PRIM(r, EXTPROT_BITS8, read_raw_bool(r, v))
+
+static Extprot_Error read_i8(Reader *r, uint8_t *v)
+  READ_PRIM(r, EXTPROT_BITS8, read_raw_i8(r, v))
+
+static Extprot_Error read_rel_int(Reader *r, int64_t *v)
+  READ_PRIM(r, EXTPROT_VINT, read_raw_rel_int(r, v))
+
+static Extprot_Error read_i32(Reader *r, int32_t *v)
+  READ_PRIM(r, EXTPROT_BITS32, read_raw_i32(r, v))
+
+static Extprot_Error read_i64(Reader *r, int64_t *v)
+  READ_PRIM(r, EXTPROT_BITS64_LONG, read_raw_i64(r, v))
+
+static Extprot_Error read_float(Reader *r, double *v)
+  READ_PRIM(r, EXTPROT_BITS64_FLOAT, read_raw_float(r, v))
+
+static Extprot_Error read_string(Reader *r, Extprot_String *v)
+  READ_PRIM(r, EXTPROT_BYTES, read_raw_string(r, v))
+
+typedef struct Loader_ {
+  Reader r;
+  Extprot_Pool *pool;
+  size_t depth;
+} Loader;
+
+static void *zalloc(Loader *l, size_t amount) {
+  void *p = extprot_pool_alloc(l->pool, amount);
+  if (p != NULL) {
+    memset(p, 0, amount);
+  }
+  return p;
+}
+
+/* Counts items that each take at least a byte of what is left. */
+static Extprot_Error load_count(Loader *l, size_t *n) {
+  uint64_t v;
+  CHECK(read_vint(&l->r, &v));
+  if (v > LEFT(&l->r)) {
+    return Extprot_BadSchema;
+  }
+  *n = (size_t) v;
+  return Extprot_NoError;
+}
+
+static Extprot_Error load_tag(Loader *l, uint32_t *tag) {
+  uint64_t v;
+  CHECK(read_vint(&l->r, &v));
+  if (v > MAX_TAG) {
+    return Extprot_BadSchema;
+  }
+  *tag = (uint32_t) v;
+  return Extprot_NoError;
+}
+
+static Extprot_Error load_name(Loader *l, char const **name) {
+  size_t len;
+  char *s;
+  CHECK(load_count(l, &len));
+  s = zalloc(l, len + 1);
+  if (s == NULL) {
+    return Extprot_NoMemory;
+  }
+  memcpy(s, l->r.p, len);
+  l->r.p += len;
+  *name = s;
+  return Extprot_NoError;
+}
+
+static Extprot_Error load_type(Loader *l, Extprot_Type *t);
+
+static Extprot_Error load_fields(Loader *l, Extprot_Case *c, int named) {
+  size_t i;
+  CHECK(load_count(l, &c->num_fields));
+  c->fields = zalloc(l, c->num_fields * sizeof(Extprot_Field));
+  if (c->fields == NULL && c->num_fields != 0) {
+    return Extprot_NoMemory;
+  }
+  for (i = 0; i < c->num_fields; i++) {
+    Extprot_Field *f = &c->fields[i];
+    if (named) {
+      CHECK(load_name(l, &f->name));
+    } else {
+      f->name = "";
+    }
+    f->type = zalloc(l, sizeof(Extprot_Type));
+    if (f->type == NULL) {
+      return Extprot_NoMemory;
+    }
+    CHECK(load_type(l, f->type));
+  }
+  return Extprot_NoError;
+}
+
+static Extprot_Error build_dispatch(Loader *l, size_t first, size_t count,
+				    Extprot_Case *cases, size_t *limit, int16_t **table)
+{
+  size_t i;
+
+  *limit = 0;
+  for (i = first; i < first + count; i++) {
+    if (cases[i].tag >= *limit) {
+      *limit = cases[i].tag + 1;
+    }
+  }
+  *table = zalloc(l, *limit * sizeof(int16_t));
+  if (*table == NULL && *limit != 0) {
+    return Extprot_NoMemory;
+  }
+  for (i = 0; i < *limit; i++) {
+    (*table)[i] = -1;
+  }
+  for (i = first; i < first + count; i++) {
+    if ((*table)[cases[i].tag] != -1) {
+      return Extprot_BadSchema;
+    }
+    (*table)[cases[i].tag] = (int16_t) i;
+  }
+  return Extprot_NoError;
+}
+
+static Extprot_Error load_type(Loader *l, Extprot_Type *t) {
+  uint64_t code;
+  size_t i, num_non_constants;
+  Extprot_Error e = Extprot_NoError;
+
+  if (l->depth >= MAX_DESC_DEPTH) {
+    return Extprot_BadSchema;
+  }
+  l->depth++;
+  CHECK(read_vint(&l->r, &code));
+  t->code = (int) code;
+  switch (code) {
+    case EXTPROT_T_BOOL:
+    case EXTPROT_T_BYTE:
+    case EXTPROT_T_INT:
+    case EXTPROT_T_I32:
+    case EXTPROT_T_LONG:
+    case EXTPROT_T_FLOAT:
+    case EXTPROT_T_STRING:
+      break;
+
+    case EXTPROT_T_TUPLE:
+      t->num_cases = 1;
+      t->cases = zalloc(l, sizeof(Extprot_Case));
+      if (t->cases == NULL) {
+	e = Extprot_NoMemory;
+	break;
+      }
+      t->cases[0].name = "";
+      e = load_fields(l, &t->cases[0], 0);
+      break;
+
+    case EXTPROT_T_LIST:
+      t->elem = zalloc(l, sizeof(Extprot_Type));
+      e = t->elem ? load_type(l, t->elem) : Extprot_NoMemory;
+      break;
+
+    case EXTPROT_T_SUM:
+      CHECK(load_count(l, &t->num_constants));
+      CHECK(load_count(l, &num_non_constants));
+      t->num_cases = t->num_constants + num_non_constants;
+      if (t->num_cases > 0x7fff) {
+	return Extprot_BadSchema;
+      }
+      t->cases = zalloc(l, t->num_cases * sizeof(Extprot_Case));
+      if (t->cases == NULL && t->num_cases != 0) {
+	e = Extprot_NoMemory;
+      }
+      for (i = 0; i < t->num_cases && e == Extprot_NoError; i++) {
+	CHECK(load_tag(l, &t->cases[i].tag));
+	CHECK(load_name(l, &t->cases[i].name));
+	if (i >= t->num_constants) {
+	  e = load_fields(l, &t->cases[i], 0);
+	}
+      }
+      if (e == Extprot_NoError) {
+	e = build_dispatch(l, 0, t->num_constants, t->cases,
+			   &t->enum_limit, &t->enum_dispatch);
+      }
+      if (e == Extprot_NoError) {
+	e = build_dispatch(l, t->num_constants, num_non_constants, t->cases,
+			   &t->tuple_limit, &t->tuple_dispatch);
+      }
+      break;
+
+    case EXTPROT_T_MESSAGE:
+      e = load_name(l, &t->ref);
+      break;
+
+    default:
+      e = Extprot_BadSchema;
+  }
+  l->depth--;
+  return e;
+}
+
+static Extprot_Error load_message(Loader *l, Extprot_Message_Desc *m) {
+  uint64_t is_sum;
+  Extprot_Type *t = &m->type;
+  size_t i;
+
+  CHECK(load_name(l, &m->name));
+  CHECK(read_vint(&l->r, &is_sum));
+  CHECK(load_count(l, &t->num_cases));
+  m->is_sum = is_sum != 0;
+  if (m->is_sum ? t->num_cases == 0 || t->num_cases > 0x7fff : t->num_cases != 1) {
+    return Extprot_BadSchema;
+  }
+  t->code = m->is_sum ? EXTPROT_T_SUM : EXTPROT_T_TUPLE;
+  t->cases = zalloc(l, t->num_cases * sizeof(Extprot_Case));
+  if (t->cases == NULL) {
+    return Extprot_NoMemory;
+  }
+  for (i = 0; i < t->num_cases; i++) {
+    t->cases[i].tag = (uint32_t) i;
+    CHECK(load_name(l, &t->cases[i].name));
+    CHECK(load_fields(l, &t->cases[i], 1));
+  }
+  return build_dispatch(l, 0, t->num_cases, t->cases, &t->tuple_limit, &t->tuple_dispatch);
+}
+
+static Extprot_Error resolve(Extprot_Schema *s, Extprot_Type *t) {
+  size_t i, j;
+
+  switch (t->code) {
+    case EXTPROT_T_LIST:
+      return resolve(s, t->elem);
+    case EXTPROT_T_MESSAGE:
+      t->message = (Extprot_Message_Desc *) extprot_schema_find(s, t->ref);
+      return t->message ? Extprot_NoError : Extprot_BadSchema;
+    default:
+      for (i = 0; i < t->num_cases; i++) {
+	for (j = 0; j < t->cases[i].num_fields; j++) {
+	  CHECK(resolve(s, t->cases[i].fields[j].type));
+	}
+      }
+      return Extprot_NoError;
+  }
+}
+
+static size_t align_up(size_t n, size_t align) {
+  return (n + align - 1) / align * align;
+}
+
+static Extprot_Error layout(Extprot_Type *t);
+
+static Extprot_Error layout_case(Extprot_Case *c, int *all_defaults) {
+  size_t i, offset = 0, align = 1;
+
+  *all_defaults = 1;
+  for (i = 0; i < c->num_fields; i++) {
+    Extprot_Field *f = &c->fields[i];
+    CHECK(layout(f->type));
+    offset = align_up(offset, f->type->align);
+    f->offset = offset;
+    offset += f->type->size;
+    if (f->type->align > align) {
+      align = f->type->align;
+    }
+    *all_defaults &= f->type->has_default;
+  }
+  c->size = align_up(offset, align);
+  c->align = align;
+  return Extprot_NoError;
+}
+
+/* A message embedded in itself, other than through a list, would be
+   infinitely large. */
+static Extprot_Error layout_message(Extprot_Message_Desc *m) {
+  Extprot_Type *t = &m->type;
+  int all_defaults;
+
+  if (m->layout_state == 2) {
+    return Extprot_NoError;
+  }
+  if (m->layout_state == 1) {
+    return Extprot_BadSchema;
+  }
+  m->layout_state = 1;
+  CHECK(layout(t));
+  CHECK(layout_case(&t->cases[0], &all_defaults));
+  t->has_default = all_defaults;
+  m->layout_state = 2;
+  return Extprot_NoError;
+}
+
+/* List elements are laid out afterwards, by layout_lists(), as they
+   are free to refer back to the message being laid out. */
+static Extprot_Error layout(Extprot_Type *t) {
+  size_t i, union_size = 0, union_align = 1;
+  int all_defaults;
+
+  if (IS_PRIM(t->code)) {
+    t->size = prims[t->code].size;
+    t->align = prims[t->code].align;
+    return Extprot_NoError;
+  }
+  switch (t->code) {
+    case EXTPROT_T_TUPLE:
+      CHECK(layout_case(&t->cases[0], &all_defaults));
+      t->size = t->cases[0].size;
+      t->align = t->cases[0].align;
+      t->has_default = all_defaults;
+      break;
+
+    case EXTPROT_T_LIST:
+      t->size = sizeof(Extprot_Vec);
+      t->align = ALIGNOF(Extprot_Vec);
+      t->has_default = 1;
+      break;
+
+    case EXTPROT_T_SUM:
+      for (i = t->num_constants; i < t->num_cases; i++) {
+	CHECK(layout_case(&t->cases[i], &all_defaults));
+	if (t->cases[i].size > union_size) {
+	  union_size = t->cases[i].size;
+	}
+	if (t->cases[i].align > union_align) {
+	  union_align = t->cases[i].align;
+	}
+      }
+      t->align = ALIGNOF(int) > union_align ? ALIGNOF(int) : union_align;
+      if (t->num_constants == t->num_cases) {
+	t->union_offset = t->size = sizeof(int);
+      } else {
+	t->union_offset = align_up(sizeof(int), union_align);
+	t->size = align_up(t->union_offset + union_size, t->align);
+      }
+      t->has_default = t->num_constants > 0;
+      break;
+
+    case EXTPROT_T_MESSAGE:
+      CHECK(layout_message(t->message));
+      t->size = t->message->type.size;
+      t->align = t->message->type.align;
+      t->has_default = t->message->type.has_default;
+      break;
+  }
+  return Extprot_NoError;
+}
+
+static Extprot_Error layout_lists(Extprot_Type *t) {
+  size_t i, j;
+
+  switch (t->code) {
+    case EXTPROT_T_LIST:
+      CHECK(layout(t->elem));
+      return layout_lists(t->elem);
+    case EXTPROT_T_MESSAGE:
+      return Extprot_NoError;
+    default:
+      for (i = 0; i < t->num_cases; i++) {
+	for (j = 0; j < t->cases[i].num_fields; j++) {
+	  CHECK(layout_lists(t->cases[i].fields[j].type));
+	}
+      }
+      return Extprot_NoError;
+  }
+}
+
+Extprot_Error extprot_schema_load(Extprot_Schema *s, void const *desc, size_t len) {
+  Loader l;
+  Extprot_Error e = Extprot_NoError;
+  size_t i;
+
+  init_extprot_pool(&s->pool, 0);
+  s->num_messages = 0;
+  s->messages = NULL;
+  s->max_depth = DEFAULT_MAX_DEPTH;
+
+  if (len < MAGIC_LEN || memcmp(desc, MAGIC, MAGIC_LEN) != 0) {
+    e = Extprot_BadSchema;
+    goto fail;
+  }
+  reader_init(&l.r, NULL, (uint8_t const *) desc + MAGIC_LEN, len - MAGIC_LEN);
+  l.pool = &s->pool;
+  l.depth = 0;
+
+  e = load_count(&l, &s->num_messages);
+  if (e) { goto fail; }
+  s->messages = zalloc(&l, s->num_messages * sizeof(Extprot_Message_Desc));
+  if (s->messages == NULL && s->num_messages != 0) {
+    e = Extprot_NoMemory;
+  }
+  for (i = 0; i < s->num_messages && e == Extprot_NoError; i++) {
+    e = load_message(&l, &s->messages[i]);
+  }
+  if (e == Extprot_NoError && l.r.p != l.r.end) {
+    e = Extprot_BadSchema;
+  }
+  for (i = 0; i < s->num_messages && e == Extprot_NoError; i++) {
+    e = resolve(s, &s->messages[i].type);
+  }
+  for (i = 0; i < s->num_messages && e == Extprot_NoError; i++) {
+    e = layout_message(&s->messages[i]);
+  }
+  for (i = 0; i < s->num_messages && e == Extprot_NoError; i++) {
+    e = layout_lists(&s->messages[i].type);
+  }
+  if (e == Extprot_NoError) {
+    return e;
+  }
+
+ fail:
+  extprot_schema_free(s);
+  return e == Extprot_EarlyEOF ? Extprot_BadSchema : e;
+}
+
+void extprot_schema_free(Extprot_Schema *s) {
+  empty_extprot_pool(&s->pool);
+  s->num_messages = 0;
+  s->messages = NULL;
+}
+
+Extprot_Message_Desc const *extprot_schema_find(Extprot_Schema const *s, char const *name) {
+  size_t i;
+  for (i = 0; i < s->num_messages; i++) {
+    if (strcmp(s->messages[i].name, name) == 0) {
+      return &s->messages[i];
+    }
+  }
+  return NULL;
+}
+
+Extprot_Field const *extprot_schema_field(Extprot_Message_Desc const *m, char const *name) {
+  size_t i, j;
+  for (i = 0; i < m->type.num_cases; i++) {
+    Extprot_Case const *c = &m->type.cases[i];
+    for (j = 0; j < c->num_fields; j++) {
+      if (strcmp(c->fields[j].name, name) == 0) {
+	return &c->fields[j];
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Decoding */
+
+typedef struct Decoder_ {
+  Reader r;
+  size_t depth;
+  size_t max_depth;
+} Decoder;
+
+#define FIELDS_SUM	0	/* missing fields are errors */
+#define FIELDS_TUPLE	1	/* missing fields take their defaults */
+#define FIELDS_MESSAGE	2	/* as do fields that fail to read */
+
+static Extprot_Error set_default(Extprot_Type const *t, uint8_t *dst);
+
+static Extprot_Error set_case_default(Extprot_Case const *c, uint8_t *dst) {
+  size_t i;
+  for (i = 0; i < c->num_fields; i++) {
+    CHECK(set_default(c->fields[i].type, dst + c->fields[i].offset));
+  }
+  return Extprot_NoError;
+}
+
+static Extprot_Error set_default(Extprot_Type const *t, uint8_t *dst) {
+  Extprot_Message_Desc const *m;
+
+  if (!t->has_default) {
+    return Extprot_MissingField;
+  }
+  switch (t->code) {
+    case EXTPROT_T_SUM:
+      *(int *) dst = 0;
+      return Extprot_NoError;
+    case EXTPROT_T_LIST:
+      memset(dst, 0, sizeof(Extprot_Vec));
+      return Extprot_NoError;
+    case EXTPROT_T_TUPLE:
+      return set_case_default(&t->cases[0], dst);
+    case EXTPROT_T_MESSAGE:
+      m = t->message;
+      if (m->is_sum) {
+	*(int *) dst = 0;
+	dst += m->type.union_offset;
+      }
+      return set_case_default(&m->type.cases[0], dst);
+    default:
+      return Extprot_MissingField;
+  }
+}
+
+static Extprot_Error read_prim(Reader *r, int code, void *dst) {
+  switch (code) {
+    case EXTPROT_T_BOOL: return read_bool(r, dst);
+    case EXTPROT_T_BYTE: return read_i8(r, dst);
+    case EXTPROT_T_INT: return read_rel_int(r, dst);
+    case EXTPROT_T_I32: return read_i32(r, dst);
+    case EXTPROT_T_LONG: return read_i64(r, dst);
+    case EXTPROT_T_FLOAT: return read_float(r, dst);
+    default: return read_string(r, dst);
+  }
+}
+
+static Extprot_Error read_raw_prim(Reader *r, int code, void *dst) {
+  switch (code) {
+    case EXTPROT_T_BOOL: return read_raw_bool(r, dst);
+    case EXTPROT_T_BYTE: return read_raw_i8(r, dst);
+    case EXTPROT_T_INT: return read_raw_rel_int(r, dst);
+    case EXTPROT_T_I32: return read_raw_i32(r, dst);
+    case EXTPROT_T_LONG: return read_raw_i64(r, dst);
+    case EXTPROT_T_FLOAT: return read_raw_float(r, dst);
+    default: return read_raw_string(r, dst);
+  }
+}
+
+static Extprot_Error read_value(Decoder *d, Extprot_Type const *t, uint8_t *dst);
+static Extprot_Error read_message(Decoder *d, Extprot_Message_Desc const *m, uint8_t *dst);
+
+static Extprot_Error read_fields(Decoder *d, Extprot_Case const *c, uint8_t *dst,
+				 uint64_t nelms, int mode)
+{
+  size_t i;
+  Extprot_Error e;
+
+  for (i = 0; i < c->num_fields; i++) {
+    Extprot_Type const *t = c->fields[i].type;
+    uint8_t *fd = dst + c->fields[i].offset;
+    if (i < nelms) {
+      e = read_value(d, t, fd);
+      if (mode == FIELDS_MESSAGE && e != Extprot_NoError && e != Extprot_BadWireType
+	  && t->has_default) {
+	e = set_default(t, fd);
+      }
+    } else {
+      e = mode == FIELDS_SUM ? Extprot_MissingField : set_default(t, fd);
+    }
+    CHECK(e);
+  }
+  return Extprot_NoError;
+}
+
+/* A primitive where a tuple is expected is its first element, if it
+   carries tag 0 and the rest can be defaulted. */
+static int promotable(Extprot_Case const *c, uint64_t prefix) {
+  size_t i;
+
+  if (c->num_fields == 0 || !IS_PRIM(c->fields[0].type->code)
+      || (prefix >> 4) != 0
+      || prims[c->fields[0].type->code].wire_type != (int) (prefix & 0xf)) {
+    return 0;
+  }
+  for (i = 1; i < c->num_fields; i++) {
+    if (!c->fields[i].type->has_default) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static Extprot_Error read_promoted(Decoder *d, Extprot_Case const *c, uint8_t *dst) {
+  size_t i;
+  CHECK(read_raw_prim(&d->r, c->fields[0].type->code, dst + c->fields[0].offset));
+  for (i = 1; i < c->num_fields; i++) {
+    CHECK(set_default(c->fields[i].type, dst + c->fields[i].offset));
+  }
+  return Extprot_NoError;
+}
+
+static Extprot_Error read_list(Decoder *d, Extprot_Type const *t, uint64_t prefix,
+			       Extprot_Vec *v)
+{
+  uint8_t const *eot;
+  uint64_t nelms, i;
+  size_t size = t->elem->size;
+  Extprot_Error e = Extprot_NoError;
+
+  if ((prefix & 0xf) != EXTPROT_HTUPLE) {
+    skip_value(&d->r, prefix);
+    return Extprot_BadWireType;
+  }
+  CHECK(read_container(&d->r, &eot, &nelms));
+  if (size != 0 && nelms > (uint64_t) ((size_t) -1) / size) {
+    return Extprot_SizeTOverflow;
+  }
+  v->length = (size_t) nelms;
+  v->vec = extprot_pool_alloc(d->r.pool, v->length * size);
+  if (v->vec == NULL && v->length * size != 0) {
+    d->r.p = eot;
+    return Extprot_NoMemory;
+  }
+  for (i = 0; i < nelms && e == Extprot_NoError; i++) {
+    e = read_value(d, t->elem, (uint8_t *) v->vec + i * size);
+  }
+  d->r.p = eot;
+  return e;
+}
+
+static Extprot_Error read_sum(Decoder *d, Extprot_Type const *t, uint64_t prefix,
+			      uint8_t *dst)
+{
+  uint64_t tag = prefix >> 4;
+  uint8_t const *eot;
+  uint64_t nelms;
+  Extprot_Error e;
+  int16_t n;
+
+  switch (prefix & 0xf) {
+    case EXTPROT_ENUM:
+      if (tag >= t->enum_limit || (n = t->enum_dispatch[tag]) < 0) {
+	return Extprot_UnknownTag;
+      }
+      *(int *) dst = n;
+      return Extprot_NoError;
+
+    case EXTPROT_TUPLE:
+      CHECK(read_container(&d->r, &eot, &nelms));
+      if (tag >= t->tuple_limit || (n = t->tuple_dispatch[tag]) < 0) {
+	e = Extprot_UnknownTag;
+      } else {
+	*(int *) dst = n;
+	e = read_fields(d, &t->cases[n], dst + t->union_offset, nelms, FIELDS_SUM);
+      }
+      d->r.p = eot;
+      return e;
+
+    default:
+      if (t->num_constants < t->num_cases
+	  && promotable(&t->cases[t->num_constants], prefix)) {
+	*(int *) dst = (int) t->num_constants;
+	return read_promoted(d, &t->cases[t->num_constants], dst + t->union_offset);
+      }
+      skip_value(&d->r, prefix);
+      return Extprot_BadWireType;
+  }
+}
+
+static Extprot_Error read_value(Decoder *d, Extprot_Type const *t, uint8_t *dst) {
+  uint64_t prefix, nelms;
+  uint8_t const *eot;
+  Extprot_Error e;
+
+  if (IS_PRIM(t->code)) {
+    return read_prim(&d->r, t->code, dst);
+  }
+  if (t->code == EXTPROT_T_MESSAGE) {
+    return read_message(d, t->message, dst);
+  }
+
+  if (d->max_depth != 0 && d->depth >= d->max_depth) {
+    return Extprot_TooDeep;
+  }
+  CHECK(read_vint(&d->r, &prefix));
+  d->depth++;
+  switch (t->code) {
+    case EXTPROT_T_TUPLE:
+      if ((prefix & 0xf) == EXTPROT_TUPLE) {
+	e = read_container(&d->r, &eot, &nelms);
+	if (e == Extprot_NoError) {
+	  e = read_fields(d, &t->cases[0], dst, nelms, FIELDS_TUPLE);
+	  d->r.p = eot;
+	}
+      } else if (promotable(&t->cases[0], prefix)) {
+	e = read_promoted(d, &t->cases[0], dst);
+      } else {
+	skip_value(&d->r, prefix);
+	e = Extprot_BadWireType;
+      }
+      break;
+    case EXTPROT_T_LIST:
+      e = read_list(d, t, prefix, (Extprot_Vec *) dst);
+      break;
+    default:
+      e = read_sum(d, t, prefix, dst);
+      break;
+  }
+  d->depth--;
+  return e;
+}
+
+static Extprot_Error read_message(Decoder *d, Extprot_Message_Desc const *m, uint8_t *dst) {
+  Extprot_Type const *t = &m->type;
+  uint64_t prefix, nelms, tag;
+  uint8_t const *eot;
+  Extprot_Error e;
+  int16_t n;
+
+  if (d->max_depth != 0 && d->depth >= d->max_depth) {
+    return Extprot_TooDeep;
+  }
+  CHECK(read_vint(&d->r, &prefix));
+  if ((prefix & 0xf) != EXTPROT_TUPLE) {
+    skip_value(&d->r, prefix);
+    return Extprot_BadWireType;
+  }
+  CHECK(read_container(&d->r, &eot, &nelms));
+  tag = prefix >> 4;
+  d->depth++;
+  if (tag >= t->tuple_limit || (n = t->tuple_dispatch[tag]) < 0) {
+    e = Extprot_UnknownTag;
+  } else if (m->is_sum) {
+    *(int *) dst = n;
+    e = read_fields(d, &t->cases[n], dst + t->union_offset, nelms, FIELDS_MESSAGE);
+  } else {
+    e = read_fields(d, &t->cases[0], dst, nelms, FIELDS_MESSAGE);
+  }
+  d->depth--;
+  d->r.p = eot;
+  return e;
+}
+
+Extprot_Error extprot_schema_decode(Extprot_Schema const *s,
+				    Extprot_Message_Desc const *m,
+				    Extprot_Pool *pool,
+				    void const *buffer, size_t len, void *out)
+{
+  Decoder d;
+
+  reader_init(&d.r, pool, buffer, len);
+  d.depth = 0;
+  d.max_depth = s->max_depth;
+  return read_message(&d, m, out);
+}
@@ -0,0 +1,218 @@
+/*
+Copyright (c) 2000-2004, 2007, 2009 Tony Garnock-Jones <tonyg@kcbbs.gen.nz>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/* Structural validation without decoding. One forward pass checks that
+   every value is complete, of a known wire type, and contained in its
+   parent, and that each tuple's elements fill its length prefix exactly;
+   the root must fill the buffer. The only state is the end offset and
+   remaining element count of each open tuple; the first INLINE_FRAMES
+   are kept on the C stack and deeper nesting spills to the heap, so any
+   depth the decoder takes validates, up to opts->max_depth if set.
+   Running past the input is Extprot_EarlyEOF; running past a parent, or
+   stopping short of it, is Extprot_BadLength, and a count larger than
+   the bytes after it could hold is Extprot_BadCount. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "extprot.h"
+
+typedef struct Validate_Frame_ {
+  uint8_t const *parent_end;
+  uint64_t remaining;
+} Validate_Frame;
+
+#define INLINE_FRAMES 64
+
+/* Fails unless n more bytes fit before limit */
+#define NEED(n)								\
+  if ((uint64_t) (n) > (uint64_t) (limit - p)) {			\
+    e = (uint64_t) (n) > (uint64_t) (end - p) ? Extprot_EarlyEOF : Extprot_BadLength; \
+    goto fail;								\
+  }
+
+/* Reads a vint with the decoder's kernel; single-byte vints, nearly
+   all tags, lengths and counts, take the first branch. */
+#define READ_VINT(v)							\
+  if (p < limit && *p < 0x80) {						\
+    (v) = *p++;								\
+  } else if ((e = read_vint(&p, limit, end, &(v))) != Extprot_NoError) { \
+    goto fail;								\
+  }
+
+/* The kernel's readers, run against limit. One that runs out of the
+   parent but would have fitted in the input is Extprot_BadLength. */
+static Extprot_Error read_vint(uint8_t const **pp, uint8_t const *limit,
+			       uint8_t const *end, uint64_t *val)
+{
+  uint8_t const *p = *pp;
+  Extprot_Error e = extprot_read_vint(pp, limit, val);
+  if (e == Extprot_EarlyEOF && limit != end
+      && extprot_read_vint(&p, end, val) == Extprot_NoError) {
+    e = Extprot_BadLength;
+  }
+  return e;
+}
+
+static Extprot_Error skip_body(uint8_t const **pp, uint8_t const *limit,
+			       uint8_t const *end, uint64_t kind)
+{
+  uint8_t const *p = *pp;
+  Extprot_Error e = extprot_skip_body(pp, limit, kind);
+  if (e == Extprot_EarlyEOF && limit != end
+      && extprot_skip_body(&p, end, kind) == Extprot_NoError) {
+    e = Extprot_BadLength;
+  }
+  return e;
+}
+
+Extprot_Error extprot_validate(void const *buffer,
+			       size_t len,
+			       Extprot_Decode_Options const *opts,
+			       size_t *error_at)
+{
+  uint8_t const *base = buffer;
+  uint8_t const *p = base;
+  uint8_t const *end = base + len;
+  uint8_t const *limit = end;
+  Validate_Frame inline_stack[INLINE_FRAMES];
+  Validate_Frame *stack = inline_stack;
+  size_t capacity = INLINE_FRAMES;
+  size_t depth = 0;
+  size_t max_depth = opts != NULL ? opts->max_depth : 0;
+  Extprot_Error e = Extprot_NoError;
+
+  while (1) {
+    uint64_t kind, n, count;
+
+    READ_VINT(kind);
+    switch (kind & 0xf) {
+#ifdef EXTPROT_NO_BIGNUMS
+      case EXTPROT_VINT:
+	READ_VINT(n);
+	break;
+#endif
+
+      case EXTPROT_TUPLE:
+      case EXTPROT_HTUPLE:
+      case EXTPROT_ASSOC:
+	{
+	  uint8_t const *body_end;
+
+	  READ_VINT(n);
+	  NEED(n);
+	  body_end = p + n;
+	  if (depth == max_depth && max_depth != 0) {
+	    e = Extprot_TooDeep;
+	    goto fail;
+	  }
+	  if (depth == capacity) {
+	    Validate_Frame *newstack;
+	    if (stack == inline_stack) {
+	      newstack = malloc(2 * capacity * sizeof(Validate_Frame));
+	      if (newstack != NULL) {
+		memcpy(newstack, stack, depth * sizeof(Validate_Frame));
+	      }
+	    } else {
+	      newstack = realloc(stack, 2 * capacity * sizeof(Validate_Frame));
+	    }
+	    if (newstack == NULL) {
+	      e = Extprot_NoMemory;
+	      goto fail;
+	    }
+	    stack = newstack;
+	    capacity *= 2;
+	  }
+	  stack[depth].parent_end = limit;
+	  limit = body_end;
+	  READ_VINT(count);
+	  /* every element takes at least a byte */
+	  if (count > (uint64_t) (limit - p) / ((kind & 0xf) == EXTPROT_ASSOC ? 2 : 1)) {
+	    e = Extprot_BadCount;
+	    goto fail;
+	  }
+	  if ((kind & 0xf) == EXTPROT_ASSOC) {
+	    count *= 2;
+	  }
+	  if (count > 0) {
+	    stack[depth++].remaining = count;
+	    continue;
+	  }
+	  if (p != limit) {
+	    e = Extprot_BadLength;
+	    goto fail;
+	  }
+	  limit = stack[depth].parent_end;
+	  break;
+	}
+
+#ifndef EXTPROT_NO_BIGNUMS
+      case EXTPROT_VINT:
+#endif
+      case EXTPROT_BITS8:
+      case EXTPROT_BITS32:
+      case EXTPROT_BITS64_LONG:
+      case EXTPROT_BITS64_FLOAT:
+      case EXTPROT_ENUM:
+      case EXTPROT_BYTES:
+	if ((e = skip_body(&p, limit, end, kind)) != Extprot_NoError) {
+	  goto fail;
+	}
+	break;
+
+      default:
+	e = Extprot_InvalidTag;
+	goto fail;
+    }
+
+    while (1) {
+      if (depth == 0) {
+	if (p != end) {
+	  e = Extprot_BadLength;
+	  goto fail;
+	}
+	goto done;
+      }
+      if (--stack[depth - 1].remaining > 0) {
+	break;
+      }
+      if (p != limit) {
+	e = Extprot_BadLength;
+	goto fail;
+      }
+      limit = stack[--depth].parent_end;
+    }
+  }
+
+ fail:
+  if (error_at != NULL) {
+    *error_at = (size_t) (p - base);
+  }
+ done:
+  if (stack != inline_stack) {
+    free(stack);
+  }
+  return e;
+}
@@ -30,3 +30,5 @@
 (check_write " 001 003 001 002 000")
 (check_write " 001 003 001 002 065")
 (check_write " 001 018 001 007 015 002 003 004 097 098 099 100 000 000 003 002 101 102 000 001")
+(check_write " 001 120 001 001 117 001 001 114 001 001 111 001 001 108 001 001 105 001 001 102 001 001 099 001 001 096 001 001 093 001 001 090 001 001 087 001 001 084 001 001 081 001 001 078 001 001 075 001 001 072 001 001 069 001 001 066 001 001 063 001 001 060 001 001 057 001 001 054 001 001 051 001 001 048 001 001 045 001 001 042 001 001 039 001 001 036 001 001 033 001 001 030 001 001 027 001 001 024 001 001 021 001 001 018 001 001 015 001 001 012 001 001 009 001 001 006 001 001 003 001 002 007")
+(check_write " 001 019 001 005 016 003 004 001 000 000 000 004 002 000 000 000 004 003 000 000 000")
@@ -26,6 +26,7 @@ THE SOFTWARE.
 #include <sys/types.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
 
 #include "extprot.h"
 
@@ -68,11 +69,13 @@ static void dump(int indent, Extprot_Object *o) {
     case EXTPROT_VINT:
       printf("vint ");
 #ifndef EXTPROT_NO_BIGNUMS
-      mpz_out_str(stdout, 10, o->body.vint.value);
-      fputc('\n', stdout);
-#else
-      printf("%llu\n", o->body.vint);
+      if (EXTPROT_VINT_IS_BIG(o)) {
+	mpz_out_str(stdout, 10, o->body.vint.value);
+	fputc('\n', stdout);
+	break;
+      }
 #endif
+      printf("%llu\n", (unsigned long long) EXTPROT_VINT_64(o));
       break;
 
     case EXTPROT_BITS8:
@@ -104,7 +107,7 @@ static void dump(int indent, Extprot_Object *o) {
 
     case EXTPROT_BYTES:
       printf("binary %u\n", (unsigned) o->body.bytes.length);
-      iprintf(indent + 2, ">>>%*s<<<\n", o->body.bytes.length, o->body.bytes.vec);
+      iprintf(indent + 2, ">>>%.*s<<<\n", (int) o->body.bytes.length, EXTPROT_BYTES_DATA(o));
       break;
 
     case EXTPROT_ASSOC:
@@ -117,6 +120,938 @@ static void dump(int indent, Extprot_Object *o) {
   }
 }
 
+static void check_same_encoding(Extprot_Object *a, Extprot_Object *b, char const *what) {
+  size_t len = extprot_compute_length(a);
+  void *abuf, *bbuf;
+  if (extprot_compute_length(b) != len) {
+    fprintf(stderr, "Error: %s: length differs\n", what);
+    exit(1);
+  }
+  abuf = malloc(len);
+  bbuf = malloc(len);
+  extprot_encode(a, abuf);
+  extprot_encode(b, bbuf);
+  if (memcmp(abuf, bbuf, len) != 0) {
+    fprintf(stderr, "Error: %s: encoding differs\n", what);
+    exit(1);
+  }
+  free(abuf);
+  free(bbuf);
+}
+
+/* Feeds msg to a fresh stream decoder in chunks of at most step bytes,
+   returning the first result other than Extprot_Incomplete. */
+static Extprot_Error stream_in_chunks(Extprot_Pool *pool, Extprot_Decode_Options const *opts,
+				      uint8_t const *msg, size_t len, size_t step)
+{
+  Extprot_Stream_Decoder d;
+  Extprot_Error e = Extprot_Incomplete;
+  size_t at = 0, n, consumed;
+
+  extprot_stream_init_with(&d, pool, opts);
+  while (at < len && e == Extprot_Incomplete) {
+    n = len - at < step ? len - at : step;
+    e = extprot_stream_feed(&d, msg + at, n, &consumed);
+    at += consumed;
+  }
+  extprot_stream_free(&d);
+  return e;
+}
+
+/* Ways of decoding a whole message, none of which may change what it
+   encodes to: the flags and, if set, an ample max_bytes are passed to
+   extprot_decode_with(), or to the stream decoder fed a byte at a time. */
+typedef struct Decode_Feature_ {
+  char const *what;
+  unsigned flags;
+  int budget;
+  int stream;
+} Decode_Feature;
+
+static Decode_Feature const decode_features[] = {
+  { "incremental decode", 0, 0, 1 },
+  { "zero-copy decode", EXTPROT_DECODE_ZERO_COPY, 0, 0 },
+  { "packed decode", EXTPROT_DECODE_PACK_ARRAYS, 0, 0 },
+  { "indexed decode", EXTPROT_DECODE_INDEX_ASSOC, 0, 0 },
+  { "budgeted decode", 0, 1, 0 },
+  { "budgeted incremental decode", 0, 1, 1 },
+};
+
+static void check_decoded(Extprot_Object *expected, uint8_t const *buffer, size_t len,
+			  Decode_Feature const *feature)
+{
+  Extprot_Pool pool;
+  Extprot_Decode_Options opts;
+  Extprot_Error e;
+
+  init_extprot_pool(&pool, 0);
+  extprot_decode_options_init(&opts);
+  opts.flags = feature->flags;
+  if (feature->budget) {
+    opts.max_bytes = 64 * len + 4096;
+  }
+  if (feature->stream) {
+    e = stream_in_chunks(&pool, &opts, buffer, len, 1);
+  } else {
+    e = extprot_decode_with(&pool, buffer, len, &opts);
+  }
+  if (e) { die(feature->what, e); }
+  check_same_encoding(expected, pool.root, feature->what);
+  empty_extprot_pool(&pool);
+}
+
+static void check_decodes(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  size_t i;
+  for (i = 0; i < sizeof(decode_features) / sizeof(decode_features[0]); i++) {
+    check_decoded(expected, buffer, len, &decode_features[i]);
+  }
+}
+
+static void count_objects(Extprot_Object *o, uint64_t *counts, size_t depth, size_t *max_depth) {
+  size_t i, n = 0;
+  counts[o->kind & 0xf]++;
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE: n = o->body.tuple.length; break;
+    case EXTPROT_ASSOC: n = o->body.tuple.length * 2; break;
+  }
+  if (n > 0 && depth + 1 > *max_depth) {
+    *max_depth = depth + 1;
+  }
+  for (i = 0; i < n; i++) {
+    count_objects(o->body.tuple.vec[i], counts, depth + 1, max_depth);
+  }
+}
+
+/* Decodes with statistics on and checks them against the tree. */
+static void check_stats(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  Extprot_Pool pool;
+  Extprot_Stats stats;
+  uint64_t counts[16];
+  size_t max_depth = 0;
+  Extprot_Error e;
+  int i;
+
+  extprot_stats_init(&stats);
+  init_extprot_pool(&pool, 0);
+  extprot_pool_set_stats(&pool, &stats);
+  e = extprot_decode(&pool, buffer, len);
+  if (e) { die("extprot_decode", e); }
+
+  memset(counts, 0, sizeof(counts));
+  count_objects(pool.root, counts, 0, &max_depth);
+  for (i = 0; i < 16; i++) {
+    if (counts[i] != stats.objects[i]) {
+      fprintf(stderr, "stats: %u objects of type %d, counted %u\n",
+	      (unsigned) stats.objects[i], i, (unsigned) counts[i]);
+      exit(1);
+    }
+  }
+  empty_extprot_pool(&pool);
+  if (stats.decodes != 1 || stats.max_depth != max_depth ||
+      stats.bytes_requested > stats.bytes_reserved ||
+      stats.peak_footprint == 0 || stats.footprint != 0) {
+    fprintf(stderr, "stats: inconsistent counters\n");
+    exit(1);
+  }
+}
+
+/* Scans two copies of the message followed by all but its last byte. */
+static void check_frames(uint8_t const *buffer, size_t len) {
+  Extprot_Frame frames[3];
+  size_t n, consumed, i;
+  uint8_t *batch = malloc(3 * len);
+  Extprot_Error e;
+
+  for (i = 0; i < 3; i++) {
+    memcpy(batch + i * len, buffer, len);
+  }
+  e = extprot_scan_frames(batch, 3 * len - 1, frames, 3, &n, &consumed);
+  if (e) { die("extprot_scan_frames", e); }
+  if (n != 2 || consumed != 2 * len) {
+    fprintf(stderr, "scan: %u frames ending at %u\n", (unsigned) n, (unsigned) consumed);
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (frames[i].offset != i * len || frames[i].length != len ||
+	frames[i].tag_and_type != buffer[0]) {
+      fprintf(stderr, "scan: bad frame %u\n", (unsigned) i);
+      exit(1);
+    }
+  }
+  free(batch);
+}
+
+/* Decodes many copies of the message on several threads, twice over
+   so that the second batch reuses the pools of the first. */
+static void check_batch(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  enum { COPIES = 64 };
+  Extprot_Frame frames[COPIES];
+  Extprot_Batch b;
+  size_t n, consumed, i;
+  int round;
+  uint8_t *batch = malloc(COPIES * len);
+  Extprot_Error e;
+
+  for (i = 0; i < COPIES; i++) {
+    memcpy(batch + i * len, buffer, len);
+  }
+  e = extprot_scan_frames(batch, COPIES * len, frames, COPIES, &n, &consumed);
+  if (e) { die("extprot_scan_frames", e); }
+
+  extprot_batch_init(&b);
+  for (round = 0; round < 2; round++) {
+    e = extprot_decode_batch(&b, batch, frames, n, 4, NULL);
+    if (e) { die("extprot_decode_batch", e); }
+    for (i = 0; i < n; i++) {
+      check_same_encoding(expected, b.roots[i], "batch decode");
+    }
+  }
+  extprot_batch_free(&b);
+  free(batch);
+}
+
+/* Writes the message to a log segment three times and reads it back
+   through the mapping, first before the index has been written. */
+static void check_log(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  Extprot_Log_Writer w;
+  Extprot_Log log;
+  Extprot_Pool pool;
+  Extprot_Decode_Options opts;
+  Extprot_Error e;
+  size_t n;
+  int closed;
+
+  if (extprot_crc32c("123456789", 9) != 0xe3069283) {
+    fprintf(stderr, "crc32c: wrong check value\n");
+    exit(1);
+  }
+
+  e = extprot_log_create(&w, "test_log.tmp");
+  if (e) { die("extprot_log_create", e); }
+  extprot_log_append(&w, buffer, len);
+  extprot_log_append_object(&w, expected);
+  extprot_log_append(&w, buffer, len);
+  fflush(w.f);
+
+  init_extprot_pool(&pool, 0);
+  extprot_decode_options_init(&opts);
+  opts.flags |= EXTPROT_DECODE_ZERO_COPY;
+  for (closed = 0; closed < 2; closed++) {
+    if (closed) {
+      e = extprot_log_close(&w);
+      if (e) { die("extprot_log_close", e); }
+    }
+    e = extprot_log_open(&log, "test_log.tmp");
+    if (e) { die("extprot_log_open", e); }
+    if (log.count != 3 || log.owns_index == closed) {
+      fprintf(stderr, "log: %u messages, owns_index %d\n", (unsigned) log.count, log.owns_index);
+      exit(1);
+    }
+    for (n = 0; n < log.count; n++) {
+      void const *msg;
+      size_t msglen;
+      e = extprot_log_get(&log, n, &msg, &msglen);
+      if (e) { die("extprot_log_get", e); }
+      e = extprot_decode_with(&pool, msg, msglen, &opts);
+      if (e) { die("extprot_decode_with", e); }
+      check_same_encoding(expected, pool.root, "log read");
+    }
+    {
+      void const *msg;
+      size_t msglen;
+      e = extprot_log_get(&log, log.count, &msg, &msglen);
+      if (e != Extprot_BadLog) { die("out of range extprot_log_get", e); }
+    }
+    extprot_log_unmap(&log);
+  }
+  empty_extprot_pool(&pool);
+  remove("test_log.tmp");
+}
+
+/* Layouts test_schema.proto should produce. */
+struct t_point {
+  Extprot_String name;
+  struct { int64_t f0; int f1; } xy;
+  struct { int which; union { struct { double f0; } B; } u; } kind;
+  Extprot_Vec tags;
+};
+
+struct t_shape {
+  int which;
+  union {
+    struct { double r; } Circle;
+    struct { int64_t side; struct t_point origin; } Square;
+  } u;
+};
+
+/* Written by extprotc -l schema; see the Makefile. */
+#define SCHEMA_FILE "test_schema.schema"
+
+/* With kind_tag < 0, kind is written as the tuple B 2.5; otherwise as a
+   bare 1.5 with that tag, which only promotes to B when the tag is 0. */
+static void write_point(Extprot_Writer *w, char const *name, int kind_tag) {
+  extprot_writer_begin_tuple(w, 0);
+  extprot_writer_cstring(w, 0, name);
+  extprot_writer_begin_tuple(w, 0);
+  extprot_writer_rel_int(w, 0, -3);
+  extprot_writer_bits8(w, 0, 1);
+  extprot_writer_end(w);
+  if (kind_tag >= 0) {
+    extprot_writer_bits64_float(w, kind_tag, 1.5);
+    extprot_writer_begin_htuple(w, 0);
+    extprot_writer_bits64_long(w, 0, 7);
+    extprot_writer_bits64_long(w, 0, 8);
+    extprot_writer_end(w);
+  } else {
+    extprot_writer_begin_tuple(w, 0);
+    extprot_writer_bits64_float(w, 0, 2.5);
+    extprot_writer_end(w);
+  }
+  extprot_writer_end(w);
+}
+
+static void check_schema(void) {
+  Extprot_Schema schema;
+  Extprot_Message_Desc const *point, *shape;
+  Extprot_Pool pool;
+  Extprot_Writer w;
+  struct t_point p;
+  struct t_shape sh;
+  Extprot_Error e;
+  char *desc;
+  long len;
+  FILE *f;
+
+  f = fopen(SCHEMA_FILE, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open %s\n", SCHEMA_FILE);
+    exit(1);
+  }
+  fseek(f, 0, SEEK_END);
+  len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  desc = malloc(len);
+  if (desc == NULL || fread(desc, 1, len, f) != (size_t) len) {
+    fprintf(stderr, "Could not read %s\n", SCHEMA_FILE);
+    exit(1);
+  }
+  fclose(f);
+
+  e = extprot_schema_load(&schema, desc, len - 1);
+  if (e != Extprot_BadSchema) { die("truncated extprot_schema_load", e); }
+  e = extprot_schema_load(&schema, desc, len);
+  if (e) { die("extprot_schema_load", e); }
+  free(desc);
+  point = extprot_schema_find(&schema, "point");
+  shape = extprot_schema_find(&schema, "shape");
+  if (point == NULL || shape == NULL
+      || point->type.size != sizeof(struct t_point)
+      || shape->type.size != sizeof(struct t_shape)
+      || shape->type.union_offset != offsetof(struct t_shape, u)
+      || extprot_schema_field(point, "tags")->offset != offsetof(struct t_point, tags)
+      || extprot_schema_field(shape, "origin")->offset
+	 != offsetof(struct t_shape, u.Square.origin) - offsetof(struct t_shape, u)) {
+    fprintf(stderr, "schema: unexpected layout\n");
+    exit(1);
+  }
+
+  init_extprot_pool(&pool, 0);
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_begin_tuple(&w, 1);
+  extprot_writer_rel_int(&w, 0, 9);
+  write_point(&w, "p", -1);
+  extprot_writer_end(&w);
+  e = extprot_schema_decode(&schema, shape, &pool, w.buffer, w.used, &sh);
+  if (e) { die("extprot_schema_decode", e); }
+  if (sh.which != 1 || sh.u.Square.side != 9
+      || sh.u.Square.origin.name.length != 1 || sh.u.Square.origin.name.data[0] != 'p'
+      || sh.u.Square.origin.xy.f0 != -3 || sh.u.Square.origin.xy.f1 != 1
+      || sh.u.Square.origin.kind.which != 1 || sh.u.Square.origin.kind.u.B.f0 != 2.5
+      || sh.u.Square.origin.tags.length != 0) {
+    fprintf(stderr, "schema: wrong shape decoded\n");
+    exit(1);
+  }
+
+  extprot_writer_reset(&w);
+  write_point(&w, "q", 0);
+  e = extprot_schema_decode(&schema, point, &pool, w.buffer, w.used, &p);
+  if (e) { die("extprot_schema_decode", e); }
+  if (p.kind.which != 1 || p.kind.u.B.f0 != 1.5 || p.tags.length != 2
+      || ((int64_t *) p.tags.vec)[1] != 8) {
+    fprintf(stderr, "schema: wrong point decoded\n");
+    exit(1);
+  }
+
+  e = extprot_schema_decode(&schema, shape, &pool, w.buffer, w.used, &sh);
+  if (e != Extprot_BadWireType) { die("mismatched extprot_schema_decode", e); }
+
+  extprot_writer_reset(&w);
+  write_point(&w, "r", 1);
+  e = extprot_schema_decode(&schema, point, &pool, w.buffer, w.used, &p);
+  if (e != Extprot_BadWireType) { die("tagged extprot_schema_decode", e); }
+
+  extprot_writer_free(&w);
+  empty_extprot_pool(&pool);
+  extprot_schema_free(&schema);
+}
+
+/* Every key of every assoc in o must look up the same value through
+   the index as through a scan. */
+static void check_assoc(Extprot_Object *o, Extprot_Pool *pool) {
+  size_t i, n;
+
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE: n = o->body.tuple.length; break;
+    case EXTPROT_ASSOC: n = o->body.tuple.length * 2; break;
+    default: return;
+  }
+  if (o->flags & EXTPROT_FLAG_PACKED) {
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    check_assoc(o->body.tuple.vec[i], pool);
+  }
+  if ((o->kind & 0xf) == EXTPROT_ASSOC) {
+    for (i = 0; i < o->body.tuple.length; i++) {
+      Extprot_Object *k = o->body.tuple.vec[2 * i];
+      if (extprot_assoc_get(NULL, o, k) != extprot_assoc_get(pool, o, k)) {
+	fprintf(stderr, "assoc: index and scan disagree on key %u\n", (unsigned) i);
+	exit(1);
+      }
+    }
+    if (!(o->flags & EXTPROT_FLAG_INDEXED)
+	|| extprot_assoc_get_bytes(pool, o, "no such key", 11) != NULL) {
+      fprintf(stderr, "assoc: bad index\n");
+      exit(1);
+    }
+  }
+}
+
+/* A large map, keyed both ways. */
+static void check_assoc_large(void) {
+  Extprot_Pool pool;
+  Extprot_Object *by_name, *by_num, *by_pair, *v;
+  char key[16];
+  size_t i, n = 5000;
+
+  init_extprot_pool(&pool, 0);
+  by_name = extprot_assoc(&pool, 0, n);
+  by_num = extprot_assoc(&pool, 0, n);
+  for (i = 0; i < n; i++) {
+    sprintf(key, "key%u", (unsigned) i);
+    by_name->body.tuple.vec[2 * i] = extprot_cstring(&pool, 0, key);
+    by_name->body.tuple.vec[2 * i + 1] = extprot_vint_64(&pool, 0, i);
+    by_num->body.tuple.vec[2 * i] = extprot_vint_64(&pool, 0, i * 7919);
+    by_num->body.tuple.vec[2 * i + 1] = by_name->body.tuple.vec[2 * i];
+  }
+  extprot_assoc_build_index(&pool, by_num);
+  for (i = 0; i < n; i++) {
+    sprintf(key, "key%u", (unsigned) i);
+    v = extprot_assoc_get_bytes(&pool, by_name, key, strlen(key));
+    if (v == NULL || EXTPROT_VINT_64(v) != i
+	|| extprot_assoc_get_vint(NULL, by_num, i * 7919) != by_name->body.tuple.vec[2 * i]) {
+      fprintf(stderr, "assoc: lookup of %s failed\n", key);
+      exit(1);
+    }
+  }
+  if (extprot_assoc_get_vint(&pool, by_num, 1) != NULL
+      || extprot_assoc_get_vint(&pool, by_name, 0) != NULL) {
+    fprintf(stderr, "assoc: found a missing key\n");
+    exit(1);
+  }
+
+  /* tuple keys, found by their encodings */
+  by_pair = extprot_assoc(&pool, 0, 16);
+  for (i = 0; i < 16; i++) {
+    by_pair->body.tuple.vec[2 * i] =
+      extprot_tuple_init(&pool, i % 2, 2, extprot_vint_64(&pool, 0, i / 2),
+			 by_name->body.tuple.vec[2 * i]);
+    by_pair->body.tuple.vec[2 * i + 1] = extprot_vint_64(&pool, 0, i);
+  }
+  for (i = 0; i < 16; i++) {
+    sprintf(key, "key%u", (unsigned) i);
+    v = extprot_assoc_get(i % 3 ? &pool : NULL, by_pair,
+			  extprot_tuple_init(&pool, i % 2, 2, extprot_vint_64(&pool, 0, i / 2),
+					     extprot_cstring(&pool, 0, key)));
+    if (v == NULL || EXTPROT_VINT_64(v) != i) {
+      fprintf(stderr, "assoc: lookup of tuple key %u failed\n", (unsigned) i);
+      exit(1);
+    }
+  }
+  if (extprot_assoc_get(&pool, by_pair,
+			extprot_tuple_init(&pool, 1, 2, extprot_vint_64(&pool, 0, 0),
+					   extprot_cstring(&pool, 0, "key0"))) != NULL) {
+    fprintf(stderr, "assoc: tuple key matched despite its tag\n");
+    exit(1);
+  }
+#ifndef EXTPROT_NO_BIGNUMS
+  {
+    mpz_t big;
+    mpz_init(big);
+    mpz_ui_pow_ui(big, 2, 70);
+    v = extprot_assoc_init(&pool, 0, 2, extprot_vint_64(&pool, 0, 1), by_name,
+			   extprot_vint_mpz(&pool, 0, big), by_num);
+    if (extprot_assoc_get(&pool, v, extprot_vint_mpz(&pool, 0, big)) != by_num) {
+      fprintf(stderr, "assoc: lookup of a bignum key failed\n");
+      exit(1);
+    }
+    mpz_clear(big);
+  }
+#endif
+
+  /* a key of 64 bits takes ten bytes on the wire, and must still be
+     found by value once decoded */
+  {
+    Extprot_Decode_Options opts;
+    Extprot_Writer w;
+    Extprot_Error e;
+    uint64_t wide = ((uint64_t) 1 << 63) + 5;
+
+    extprot_writer_init(&w, NULL, 0);
+    extprot_writer_begin_assoc(&w, 0);
+    extprot_writer_vint(&w, 0, wide);
+    extprot_writer_cstring(&w, 0, "wide");
+    extprot_writer_end(&w);
+    extprot_decode_options_init(&opts);
+    for (i = 0; i < 2; i++) {
+      opts.flags = i ? EXTPROT_DECODE_INDEX_ASSOC : 0;
+      e = extprot_decode_with(&pool, w.buffer, w.used, &opts);
+      if (e) { die("extprot_decode_with", e); }
+      if (extprot_assoc_get_vint(&pool, pool.root, wide) == NULL) {
+	fprintf(stderr, "assoc: lookup of a 64-bit key failed\n");
+	exit(1);
+      }
+    }
+    extprot_writer_free(&w);
+  }
+  empty_extprot_pool(&pool);
+}
+
+/* Copies a zero-copy, packed, indexed decode out of its pool, then
+   releases the pool and the input before comparing; and compacts a
+   second decode in place. Either way the result must be one block. */
+static void check_copy(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  Extprot_Pool src, dst;
+  Extprot_Decode_Options opts;
+  Extprot_Object *copy;
+  uint8_t *input;
+  size_t size;
+  Extprot_Error e;
+  int pass;
+
+  extprot_decode_options_init(&opts);
+  opts.flags |= EXTPROT_DECODE_ZERO_COPY | EXTPROT_DECODE_PACK_ARRAYS | EXTPROT_DECODE_INDEX_ASSOC;
+  for (pass = 0; pass < 2; pass++) {
+    input = malloc(len);
+    memcpy(input, buffer, len);
+    init_extprot_pool(&src, 0);
+    e = extprot_decode_with(&src, input, len, &opts);
+    if (e) { die("extprot_decode_with", e); }
+    size = extprot_copy_size(src.root);
+    if (pass == 0) {
+      init_extprot_pool(&dst, 0);
+      copy = extprot_copy(&dst, src.root);
+      empty_extprot_pool(&src);
+    } else {
+      extprot_compact(&src);
+      dst = src;
+      copy = dst.root;
+    }
+    free(input);
+    check_same_encoding(expected, copy, "copy");
+    if (dst.num_pages != 0 || dst.num_blocks != 1 || dst.blocklist[0].size != size
+	|| (void *) copy != (void *) dst.blocklist[0].block) {
+      fprintf(stderr, "copy: not a single %u byte block\n", (unsigned) size);
+      exit(1);
+    }
+    empty_extprot_pool(&dst);
+  }
+}
+
+static int raw_at_depth(void *arg, size_t depth, size_t index, uint32_t tag_and_type) {
+  (void) index;
+  (void) tag_and_type;
+  return depth == *(size_t *) arg;
+}
+
+static size_t count_raw(Extprot_Object const *o) {
+  size_t i, n, count = 0;
+
+  if (o->flags & EXTPROT_FLAG_RAW) {
+    return 1;
+  }
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE: n = o->body.tuple.length; break;
+    case EXTPROT_ASSOC: n = o->body.tuple.length * 2; break;
+    default: return 0;
+  }
+  if (o->flags & EXTPROT_FLAG_PACKED) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    count += count_raw(o->body.tuple.vec[i]);
+  }
+  return count;
+}
+
+/* Decodes keeping every value at one depth raw, then checks that the
+   partly raw tree, its gather encoding and its copy all encode back to
+   the input, as does the input handed to extprot_writer_raw. A lazy
+   decode, once expanded, must keep the same values raw. */
+static void check_raw(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  Extprot_Pool pool, dst;
+  Extprot_Decode_Options opts;
+  Extprot_Gather g;
+  Extprot_Writer w;
+  Extprot_Error e;
+  size_t depth, i, used;
+  uint8_t *flat = malloc(len);
+
+  extprot_decode_options_init(&opts);
+  opts.raw = raw_at_depth;
+  opts.raw_arg = &depth;
+  for (depth = 0; depth < 4; depth++) {
+    opts.flags = (depth & 1) ? EXTPROT_DECODE_ZERO_COPY : 0;
+    init_extprot_pool(&pool, 0);
+    e = extprot_decode_with(&pool, buffer, len, &opts);
+    if (e) { die("extprot_decode_with", e); }
+    check_same_encoding(expected, pool.root, "raw decode");
+    if (depth == 0 && extprot_assoc_get_vint(&pool, pool.root, 1) != NULL) {
+      fprintf(stderr, "Error: lookup in a raw root succeeded\n");
+      exit(1);
+    }
+
+    extprot_gather_init(&g, 1);
+    e = extprot_encode_gather(&g, pool.root);
+    if (e) { die("extprot_encode_gather", e); }
+    for (i = 0, used = 0; i < g.iov_count && used + g.iov[i].iov_len <= len; i++) {
+      memcpy(flat + used, g.iov[i].iov_base, g.iov[i].iov_len);
+      used += g.iov[i].iov_len;
+    }
+    if (i != g.iov_count || used != len || memcmp(flat, buffer, len) != 0) {
+      fprintf(stderr, "Error: gather encoding of raw nodes differs\n");
+      exit(1);
+    }
+    extprot_gather_free(&g);
+
+    init_extprot_pool(&dst, 0);
+    check_same_encoding(expected, extprot_copy(&dst, pool.root), "raw copy");
+    opts.flags |= EXTPROT_DECODE_LAZY;
+    e = extprot_decode_with(&dst, buffer, len, &opts);
+    if (!e) e = extprot_expand(&dst, dst.root, 1);
+    if (e) { die("lazy raw extprot_decode_with", e); }
+    if (count_raw(dst.root) != count_raw(pool.root)) {
+      fprintf(stderr, "Error: lazy decode kept %u values raw at depth %u, not %u\n",
+	      (unsigned) count_raw(dst.root), (unsigned) depth, (unsigned) count_raw(pool.root));
+      exit(1);
+    }
+    empty_extprot_pool(&dst);
+    empty_extprot_pool(&pool);
+  }
+
+  /* a raw assoc has no pairs to look up */
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_begin_assoc(&w, 0);
+  extprot_writer_vint(&w, 0, 1);
+  extprot_writer_cstring(&w, 0, "one");
+  extprot_writer_end(&w);
+  init_extprot_pool(&pool, 0);
+  {
+    Extprot_Object *ra = extprot_raw(&pool, EXTPROT_ASSOC, w.buffer, w.used);
+    if (extprot_assoc_get_vint(&pool, ra, 1) != NULL
+	|| extprot_assoc_build_index(&pool, ra) != Extprot_BadWireType) {
+      fprintf(stderr, "Error: raw assoc was looked up\n");
+      exit(1);
+    }
+  }
+  empty_extprot_pool(&pool);
+  extprot_writer_free(&w);
+
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_raw(&w, buffer, len);
+  if (w.error) { die("extprot_writer_raw", w.error); }
+  if (w.used != len || memcmp(w.buffer, buffer, len) != 0) {
+    fprintf(stderr, "Error: extprot_writer_raw output differs\n");
+    exit(1);
+  }
+  extprot_writer_free(&w);
+  free(flat);
+}
+
+/* Reads every other element of a lazy decode, alternating which half
+   from one level to the next, and compares each with the full decode. */
+static void check_lazy_walk(Extprot_Object *expected, Extprot_Object *o,
+			    Extprot_Pool *pool, size_t depth)
+{
+  Extprot_Object *elem;
+  Extprot_Error e;
+  size_t i, n;
+
+  switch (expected->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE: n = expected->body.tuple.length; break;
+    case EXTPROT_ASSOC: n = expected->body.tuple.length * 2; break;
+    default: return;
+  }
+  for (i = depth & 1; i < n; i += 2) {
+    e = extprot_tuple_get(pool, o, i, &elem);
+    if (e) { die("extprot_tuple_get", e); }
+    check_same_encoding(expected->body.tuple.vec[i], elem, "lazy element");
+    check_lazy_walk(expected->body.tuple.vec[i], elem, pool, depth + 1);
+  }
+}
+
+/* Decodes lazily, then checks the encoding when untouched, partly read,
+   copied, and fully expanded. */
+static void check_lazy(Extprot_Object *expected, uint8_t const *buffer, size_t len) {
+  Extprot_Pool pool, dst;
+  Extprot_Decode_Options opts;
+  Extprot_Object *copy;
+  Extprot_Error e;
+  int pass;
+
+  extprot_decode_options_init(&opts);
+  for (pass = 0; pass < 2; pass++) {
+    opts.flags = EXTPROT_DECODE_LAZY | (pass ? EXTPROT_DECODE_ZERO_COPY : 0);
+    init_extprot_pool(&pool, 0);
+    e = extprot_decode_with(&pool, buffer, len, &opts);
+    if (e) { die("extprot_decode_with", e); }
+    check_same_encoding(expected, pool.root, "lazy decode");
+    check_lazy_walk(expected, pool.root, &pool, 0);
+    check_same_encoding(expected, pool.root, "partly read lazy decode");
+
+    init_extprot_pool(&dst, 0);
+    copy = extprot_copy(&dst, pool.root);
+    empty_extprot_pool(&pool);
+    check_same_encoding(expected, copy, "lazy copy");
+    e = extprot_expand(&dst, copy, 1);
+    if (e) { die("extprot_expand", e); }
+    if (copy->flags & EXTPROT_FLAG_LAZY) {
+      fprintf(stderr, "Error: expanded node still lazy\n");
+      exit(1);
+    }
+    check_same_encoding(expected, copy, "expanded lazy copy");
+    check_assoc(copy, &dst);
+    empty_extprot_pool(&dst);
+  }
+}
+
+/* Event handlers that write every value back out through a writer */
+typedef struct Event_Copy_ {
+  Extprot_Writer w;
+  uint8_t const *input;
+  size_t events;
+} Event_Copy;
+
+static int copy_scalar(void *arg, Extprot_Tag tag, int wire_type, uint64_t value, size_t pos) {
+  Extprot_Writer *w = &((Event_Copy *) arg)->w;
+  double d;
+  (void) pos;
+  switch (wire_type) {
+    case EXTPROT_VINT: extprot_writer_vint(w, tag, value); break;
+    case EXTPROT_BITS8: extprot_writer_bits8(w, tag, (uint8_t) value); break;
+    case EXTPROT_BITS32: extprot_writer_bits32(w, tag, (uint32_t) value); break;
+    case EXTPROT_BITS64_LONG: extprot_writer_bits64_long(w, tag, (int64_t) value); break;
+    case EXTPROT_BITS64_FLOAT:
+      memcpy(&d, &value, 8);
+      extprot_writer_bits64_float(w, tag, d);
+      break;
+    case EXTPROT_ENUM: extprot_writer_enum(w, tag); break;
+  }
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int copy_bytes(void *arg, Extprot_Tag tag, int wire_type,
+		      uint8_t const *data, size_t len, size_t pos)
+{
+  Event_Copy *c = arg;
+  if (wire_type == EXTPROT_BYTES) {
+    extprot_writer_bytes(&c->w, tag, data, len);
+  } else {
+    extprot_writer_raw(&c->w, c->input + pos, data + len - (c->input + pos));
+  }
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int copy_tuple(void *arg, Extprot_Tag tag, size_t count, size_t pos) {
+  (void) count; (void) pos;
+  extprot_writer_begin_tuple(&((Event_Copy *) arg)->w, tag);
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int copy_htuple(void *arg, Extprot_Tag tag, size_t count, size_t pos) {
+  (void) count; (void) pos;
+  extprot_writer_begin_htuple(&((Event_Copy *) arg)->w, tag);
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int copy_assoc(void *arg, Extprot_Tag tag, size_t count, size_t pos) {
+  (void) count; (void) pos;
+  extprot_writer_begin_assoc(&((Event_Copy *) arg)->w, tag);
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int copy_end(void *arg, Extprot_Tag tag, int wire_type, size_t pos) {
+  (void) tag; (void) wire_type; (void) pos;
+  extprot_writer_end(&((Event_Copy *) arg)->w);
+  return EXTPROT_EVENT_CONTINUE;
+}
+
+static int count_begin(void *arg, Extprot_Tag tag, size_t count, size_t pos) {
+  (void) tag; (void) count; (void) pos;
+  ((Event_Copy *) arg)->events++;
+  return EXTPROT_EVENT_SKIP;
+}
+
+static int count_scalar(void *arg, Extprot_Tag tag, int wire_type, uint64_t value, size_t pos) {
+  (void) tag; (void) wire_type; (void) value; (void) pos;
+  ((Event_Copy *) arg)->events++;
+  return EXTPROT_EVENT_STOP;
+}
+
+/* Writes the events back out, which must reproduce the input; then
+   checks that skipping at the root, or stopping at the first scalar,
+   sees exactly one event. */
+static void check_events(uint8_t const *buffer, size_t len) {
+  Extprot_Events ev;
+  Event_Copy c;
+  Extprot_Error e;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.on_scalar = copy_scalar;
+  ev.on_bytes = copy_bytes;
+  ev.on_begin_tuple = copy_tuple;
+  ev.on_begin_htuple = copy_htuple;
+  ev.on_begin_assoc = copy_assoc;
+  ev.on_end = copy_end;
+  c.input = buffer;
+  extprot_writer_init(&c.w, NULL, 0);
+  e = extprot_decode_events(buffer, len, NULL, &ev, &c);
+  if (e) { die("extprot_decode_events", e); }
+  if (c.w.error) { die("extprot_writer", c.w.error); }
+  if (c.w.used != len || memcmp(c.w.buffer, buffer, len) != 0) {
+    fprintf(stderr, "Error: events do not reproduce the input\n");
+    exit(1);
+  }
+  extprot_writer_free(&c.w);
+
+  memset(&ev, 0, sizeof(ev));
+  ev.on_scalar = count_scalar;
+  ev.on_begin_tuple = ev.on_begin_htuple = ev.on_begin_assoc = count_begin;
+  c.events = 0;
+  e = extprot_decode_events(buffer, len, NULL, &ev, &c);
+  if (e) { die("extprot_decode_events", e); }
+  if (c.events != 1) {
+    fprintf(stderr, "Error: %u events seen past a skip or stop\n", (unsigned) c.events);
+    exit(1);
+  }
+}
+
+/* The message must validate, while every truncation of it must not;
+   and whatever validates after flipping a byte must also decode. */
+static void check_validate(uint8_t const *buffer, size_t len) {
+  static uint8_t const miscounted[] = { 0x01, 0x03, 0x01, 0x0a, 0x0a };
+  Extprot_Pool pool;
+  uint8_t *copy = malloc(len);
+  size_t i, at;
+  Extprot_Error e;
+
+  e = extprot_validate(buffer, len, NULL, &at);
+  if (e) { die("extprot_validate", e); }
+  for (i = 0; i < len; i++) {
+    if (extprot_validate(buffer, i, NULL, &at) == Extprot_NoError || at > i) {
+      fprintf(stderr, "Error: truncation to %u bytes validated\n", (unsigned) i);
+      exit(1);
+    }
+  }
+
+  init_extprot_pool(&pool, 0);
+  memcpy(copy, buffer, len);
+  for (i = 0; i < len; i++) {
+    copy[i] ^= 0x81;
+    if (extprot_validate(copy, len, NULL, NULL) == Extprot_NoError) {
+      e = extprot_decode(&pool, copy, len);
+      if (e) { die("extprot_decode of validated input", e); }
+      reset_extprot_pool(&pool);
+    }
+    copy[i] = buffer[i];
+  }
+  empty_extprot_pool(&pool);
+  free(copy);
+
+  e = extprot_validate(miscounted, sizeof(miscounted), NULL, &at);
+  if (e != Extprot_BadLength || at != 4) {
+    fprintf(stderr, "Error: miscounted tuple gave %s at %u\n",
+	    extprot_error_message(e), (unsigned) at);
+    exit(1);
+  }
+}
+
+/* A budget too small for the root must fail, whole or incrementally;
+   decode_features has a generous one succeed. */
+static void check_budget(uint8_t const *buffer, size_t len) {
+  Extprot_Pool pool;
+  Extprot_Decode_Options opts;
+  Extprot_Error e;
+
+  init_extprot_pool(&pool, 0);
+  extprot_decode_options_init(&opts);
+  opts.max_bytes = 1;
+  e = extprot_decode_with(&pool, buffer, len, &opts);
+  if (e == Extprot_OverBudget) {
+    reset_extprot_pool(&pool);
+    e = stream_in_chunks(&pool, &opts, buffer, len, 1);
+  }
+  if (e != Extprot_OverBudget) {
+    fprintf(stderr, "Error: tiny budget gave %s\n", extprot_error_message(e));
+    exit(1);
+  }
+  empty_extprot_pool(&pool);
+}
+
+/* Projects out every subvalue of o in turn and compares it with the
+   corresponding part of the fully decoded tree, then again keeping
+   values raw at the subvalue's depth, which must leave it raw. The
+   scratch pool is reset, rather than emptied, between projections. */
+static void check_paths(Extprot_Object *o, uint8_t const *buffer, size_t len,
+			Extprot_Pool *pool, size_t *path, size_t depth)
+{
+  Extprot_Decode_Options opts;
+  Extprot_Error e;
+  size_t i, n, raw_depth = depth + 1;
+
+  switch (o->kind & 0xf) {
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE: n = o->body.tuple.length; break;
+    case EXTPROT_ASSOC: n = o->body.tuple.length * 2; break;
+    default: return;
+  }
+
+  for (i = 0; i < n && depth < 16; i++) {
+    path[depth] = i;
+    reset_extprot_pool(pool);
+    e = extprot_decode_path(pool, buffer, len, path, depth + 1, NULL);
+    if (e) { die("extprot_decode_path", e); }
+    check_same_encoding(o->body.tuple.vec[i], pool->root, "projected decode");
+
+    reset_extprot_pool(pool);
+    extprot_decode_options_init(&opts);
+    opts.raw = raw_at_depth;
+    opts.raw_arg = &raw_depth;
+    e = extprot_decode_path(pool, buffer, len, path, depth + 1, &opts);
+    if (e) { die("extprot_decode_path (raw)", e); }
+    if (!(pool->root->flags & EXTPROT_FLAG_RAW)) {
+      fprintf(stderr, "Error: projected value decoded at the wrong depth\n");
+      exit(1);
+    }
+    check_same_encoding(o->body.tuple.vec[i], pool->root, "raw projected decode");
+    check_paths(o->body.tuple.vec[i], buffer, len, pool, path, depth + 1);
+  }
+}
+
 static Extprot_Object *read_one(Extprot_Pool *pool, char const *testName) {
   long len;
   uint8_t *buffer;
@@ -143,11 +1078,115 @@ static Extprot_Object *read_one(Extprot_Pool *pool, char const *testName) {
 
   e = extprot_decode(pool, buffer, len);
   if (e) { die("extprot_decode", e); }
+  check_decodes(pool->root, buffer, len);
+  check_stats(pool->root, buffer, len);
+  check_frames(buffer, len);
+  check_batch(pool->root, buffer, len);
+  check_log(pool->root, buffer, len);
+  check_assoc(pool->root, pool);
+  check_copy(pool->root, buffer, len);
+  check_raw(pool->root, buffer, len);
+  check_lazy(pool->root, buffer, len);
+  check_events(buffer, len);
+  check_validate(buffer, len);
+  check_budget(buffer, len);
+  {
+    Extprot_Pool scratch;
+    size_t path[16];
+    init_extprot_pool(&scratch, 0);
+    check_paths(pool->root, buffer, len, &scratch, path, 0);
+    empty_extprot_pool(&scratch);
+  }
 
   fclose(f);
   return pool->root;
 }
 
+static void write_streamed(Extprot_Writer *w, Extprot_Object *o) {
+  Extprot_Tag tag = o->kind >> 4;
+  size_t i;
+  switch (o->kind & 0xf) {
+    case EXTPROT_VINT:
+      if (EXTPROT_VINT_IS_BIG(o)) {
+	extprot_writer_object(w, o);
+      } else {
+	extprot_writer_vint(w, tag, EXTPROT_VINT_64(o));
+      }
+      break;
+    case EXTPROT_BITS8: extprot_writer_bits8(w, tag, o->body.bits8); break;
+    case EXTPROT_BITS32: extprot_writer_bits32(w, tag, o->body.bits32); break;
+    case EXTPROT_BITS64_LONG: extprot_writer_bits64_long(w, tag, o->body.bits64_long); break;
+    case EXTPROT_BITS64_FLOAT: extprot_writer_bits64_float(w, tag, o->body.bits64_float); break;
+    case EXTPROT_ENUM: extprot_writer_enum(w, tag); break;
+    case EXTPROT_BYTES:
+      extprot_writer_bytes(w, tag, EXTPROT_BYTES_DATA(o), o->body.bytes.length);
+      break;
+    case EXTPROT_TUPLE:
+    case EXTPROT_HTUPLE:
+      if ((o->kind & 0xf) == EXTPROT_TUPLE) {
+	extprot_writer_begin_tuple(w, tag);
+      } else {
+	extprot_writer_begin_htuple(w, tag);
+      }
+      for (i = 0; i < o->body.tuple.length; i++) {
+	write_streamed(w, o->body.tuple.vec[i]);
+      }
+      extprot_writer_end(w);
+      break;
+    case EXTPROT_ASSOC:
+      extprot_writer_begin_assoc(w, tag);
+      for (i = 0; i < o->body.tuple.length * 2; i++) {
+	write_streamed(w, o->body.tuple.vec[i]);
+      }
+      extprot_writer_end(w);
+      break;
+  }
+}
+
+static void check_streamed(Extprot_Object *o, void const *expected, size_t len) {
+  Extprot_Writer w;
+  extprot_writer_init(&w, NULL, 0);
+  write_streamed(&w, o);
+  if (w.error) { die("extprot_writer", w.error); }
+  if (w.used != len || memcmp(w.buffer, expected, len) != 0) {
+    fprintf(stderr, "Error: streaming writer output differs from extprot_encode\n");
+    exit(1);
+  }
+  extprot_writer_free(&w);
+}
+
+/* Flattens the iovecs of a gather encoding, referencing every
+   non-empty bytes payload, and compares them with extprot_encode; then
+   again with the iovecs capped at 3 and at 1. */
+static void check_gather(Extprot_Object *o, void const *expected, size_t len) {
+  static size_t const max_iov[] = { 0, 3, 1 };	/* 0 keeps the default */
+  Extprot_Gather g;
+  Extprot_Error e;
+  uint8_t *flat = malloc(len);
+  size_t i, j, used;
+
+  extprot_gather_init(&g, 1);
+  for (j = 0; j < sizeof(max_iov) / sizeof(max_iov[0]); j++) {
+    if (max_iov[j] != 0) {
+      g.max_iov = max_iov[j];
+    }
+    e = extprot_encode_gather(&g, o);
+    if (e) { die("extprot_encode_gather", e); }
+    for (i = 0, used = 0; i < g.iov_count && used + g.iov[i].iov_len <= len; i++) {
+      memcpy(flat + used, g.iov[i].iov_base, g.iov[i].iov_len);
+      used += g.iov[i].iov_len;
+    }
+    if (i != g.iov_count || used != len || g.length != len || g.iov_count > g.max_iov ||
+	memcmp(flat, expected, len) != 0) {
+      fprintf(stderr, "Error: gather encoding with at most %u iovecs differs from extprot_encode\n",
+	      (unsigned) g.max_iov);
+      exit(1);
+    }
+  }
+  extprot_gather_free(&g);
+  free(flat);
+}
+
 static void write_one(Extprot_Object *o, char const *testName) {
   char buf[1024];
   FILE *f;
@@ -165,15 +1204,361 @@ static void write_one(Extprot_Object *o, char const *testName) {
   printf("Encoding as %u bytes...\n", (unsigned) len);
   out_buffer = malloc(len);
   extprot_encode(o, out_buffer);
+  check_streamed(o, out_buffer, len);
+  check_gather(o, out_buffer, len);
   fwrite(out_buffer, len, 1, f);
   fclose(f);
 }
 
+/* Counts that the bytes after them cannot hold must be refused before
+   anything is allocated for them, and a budget kept to, by every way of
+   reading a message, the stream decoder however the bytes are split. */
+static void check_hostile(void) {
+  static uint8_t const huge_tuple[] = { 0x01, 0x05, 0xff, 0xff, 0xff, 0xff, 0x0f };
+  static uint8_t const short_assoc[] = { 0x07, 0x02, 0x01, 0x0a };
+  static uint8_t const inner[] = { 0x01, 0x08, 0x01, 0x05, 0x05, 0xff, 0xff, 0xff, 0xff, 0x0f };
+  static struct { uint8_t const *msg; size_t len; } const cases[] = {
+    { huge_tuple, sizeof(huge_tuple) },
+    { short_assoc, sizeof(short_assoc) },
+    { inner, sizeof(inner) },
+  };
+  static unsigned const flags[] = { 0, EXTPROT_DECODE_LAZY, EXTPROT_DECODE_PACK_ARRAYS };
+  Extprot_Pool pool;
+  Extprot_Decode_Options opts;
+  Extprot_Stream_Decoder d;
+  Extprot_Writer w;
+  Extprot_Events ev;
+  Extprot_Error e;
+  size_t i, j, consumed;
+  size_t path[1] = { 0 };
+
+  init_extprot_pool(&pool, 0);
+  extprot_decode_options_init(&opts);
+  memset(&ev, 0, sizeof(ev));
+  for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    for (j = 0; j < sizeof(flags) / sizeof(flags[0]); j++) {
+      opts.flags = flags[j];
+      e = extprot_decode_with(&pool, cases[i].msg, cases[i].len, &opts);
+      if (e == Extprot_NoError && (flags[j] & EXTPROT_DECODE_LAZY)) {
+	e = extprot_expand(&pool, pool.root, 1);	/* nested counts are read late */
+      }
+      if (e != Extprot_BadCount) {
+	fprintf(stderr, "Error: hostile count %u decoded with flags %u\n", (unsigned) i, flags[j]);
+	exit(1);
+      }
+      reset_extprot_pool(&pool);
+    }
+    extprot_stream_init(&d, &pool);
+    if (extprot_stream_feed(&d, cases[i].msg, cases[i].len, &consumed) != Extprot_BadCount
+	|| extprot_decode_events(cases[i].msg, cases[i].len, NULL, &ev, NULL) != Extprot_BadCount
+	|| extprot_validate(cases[i].msg, cases[i].len, NULL, NULL) != Extprot_BadCount
+	|| (i == 2 && extprot_decode_path(&pool, cases[i].msg, cases[i].len, path, 1, NULL)
+	    != Extprot_BadCount)) {
+      fprintf(stderr, "Error: hostile count %u accepted\n", (unsigned) i);
+      exit(1);
+    }
+    extprot_stream_free(&d);
+    reset_extprot_pool(&pool);
+    if (stream_in_chunks(&pool, NULL, cases[i].msg, cases[i].len, 1) != Extprot_BadCount) {
+      fprintf(stderr, "Error: hostile count %u accepted a byte at a time\n", (unsigned) i);
+      exit(1);
+    }
+    reset_extprot_pool(&pool);
+  }
+
+  /* 64 vints, well formed, but more than 256 bytes of nodes */
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_begin_tuple(&w, 0);
+  for (i = 0; i < 64; i++) {
+    extprot_writer_vint(&w, 0, i);
+  }
+  extprot_writer_end(&w);
+  opts.flags = 0;
+  opts.max_bytes = 256;
+  for (j = 1; j <= w.used; j *= 4) {
+    if (stream_in_chunks(&pool, &opts, w.buffer, w.used, j) != Extprot_OverBudget) {
+      fprintf(stderr, "Error: stream decoder fed %u bytes at a time ignored its budget\n",
+	      (unsigned) j);
+      exit(1);
+    }
+    reset_extprot_pool(&pool);
+  }
+  if (extprot_decode_with(&pool, w.buffer, w.used, &opts) != Extprot_OverBudget) {
+    fprintf(stderr, "Error: extprot_decode_with ignored its budget\n");
+    exit(1);
+  }
+  opts.max_bytes = 8;		/* less than the one node on the path */
+  if (extprot_decode_path(&pool, w.buffer, w.used, path, 1, &opts) != Extprot_OverBudget) {
+    fprintf(stderr, "Error: extprot_decode_path ignored its budget\n");
+    exit(1);
+  }
+  extprot_writer_free(&w);
+  empty_extprot_pool(&pool);
+}
+
+/* The stream decoder takes memory only as the bytes that need it
+   arrive, within the budget, and keeps every element inside its
+   parent. */
+static void check_stream_limits(void) {
+  /* a 4 GiB string, and a 4 GiB tuple of 256M elements, cut short */
+  static uint8_t const huge_bytes[] = { 0x03, 0xff, 0xff, 0xff, 0xff, 0x0f, 'a', 'b', 'c' };
+  static uint8_t const huge_count[] = {
+    0x01, 0xff, 0xff, 0xff, 0xff, 0x0f, 0xff, 0xff, 0xff, 0x7f, 0x00, 0x01
+  };
+  /* a string longer than its tuple, and a tuple longer than its element */
+  static uint8_t const long_child[] = { 0x01, 0x04, 0x01, 0x03, 0x05, 'h', 'e', 'l', 'l', 'o' };
+  static uint8_t const short_child[] = { 0x01, 0x04, 0x01, 0x00, 0x05, 0x00 };
+  Extprot_Pool pool;
+  Extprot_Decode_Options opts;
+  Extprot_Stats stats;
+
+  extprot_stats_init(&stats);
+  init_extprot_pool(&pool, 0);
+  extprot_pool_set_stats(&pool, &stats);
+  extprot_decode_options_init(&opts);
+  if (stream_in_chunks(&pool, &opts, huge_bytes, sizeof(huge_bytes), 2) != Extprot_Incomplete
+      || stream_in_chunks(&pool, &opts, huge_count, sizeof(huge_count), 2) != Extprot_Incomplete
+      || stats.bytes_requested > 64) {
+    fprintf(stderr, "Error: declared sizes allocated ahead of the data\n");
+    exit(1);
+  }
+
+  opts.max_bytes = 4096;
+  if (stream_in_chunks(&pool, &opts, huge_bytes, sizeof(huge_bytes), 2) != Extprot_OverBudget
+      || stream_in_chunks(&pool, &opts, huge_count, sizeof(huge_count), 2) != Extprot_OverBudget) {
+    fprintf(stderr, "Error: stream decoder went over its budget\n");
+    exit(1);
+  }
+
+  if (stream_in_chunks(&pool, NULL, long_child, sizeof(long_child), 1) != Extprot_BadLength
+      || stream_in_chunks(&pool, NULL, short_child, sizeof(short_child), 1) != Extprot_BadLength) {
+    fprintf(stderr, "Error: stream decoder let an element leave its tuple\n");
+    exit(1);
+  }
+  empty_extprot_pool(&pool);
+}
+
+/* Every reader goes through the same vint kernel, so all of them take
+   a full 64-bit vint and all of them refuse a tenth byte above 1. */
+static void check_vints(void) {
+  static uint8_t const overlong[] = {
+    0x81, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x02, 0x00
+  };
+  Extprot_Pool pool;
+  Extprot_Writer w;
+  Extprot_Stream_Decoder d;
+  Extprot_Events ev;
+  Extprot_Frame frame;
+  Extprot_Error e;
+  size_t n, consumed;
+
+  init_extprot_pool(&pool, 0);
+  extprot_writer_init(&w, NULL, 0);
+  extprot_writer_begin_tuple(&w, 0);
+  extprot_writer_vint(&w, 0, ~(uint64_t) 0);
+  extprot_writer_vint(&w, 1, (uint64_t) 1 << 63);
+  extprot_writer_end(&w);
+  e = extprot_decode(&pool, w.buffer, w.used);
+  if (e) { die("64-bit extprot_decode", e); }
+  check_decodes(pool.root, w.buffer, w.used);
+  check_events(w.buffer, w.used);
+  check_validate(w.buffer, w.used);
+  extprot_writer_free(&w);
+
+  memset(&ev, 0, sizeof(ev));
+  extprot_stream_init(&d, &pool);
+  if (extprot_decode(&pool, overlong, sizeof(overlong)) != Extprot_VintOverflow
+      || extprot_validate(overlong, sizeof(overlong), NULL, NULL) != Extprot_VintOverflow
+      || extprot_decode_events(overlong, sizeof(overlong), NULL, &ev, NULL) != Extprot_VintOverflow
+      || extprot_scan_frames(overlong, sizeof(overlong), &frame, 1, &n, &consumed)
+	 != Extprot_VintOverflow
+      || extprot_stream_feed(&d, overlong, sizeof(overlong), &consumed) != Extprot_VintOverflow) {
+    fprintf(stderr, "Error: overlong vint accepted\n");
+    exit(1);
+  }
+  extprot_stream_free(&d);
+  empty_extprot_pool(&pool);
+}
+
+/* Oversized allocations of one size are served from the same blocks
+   after a reset, and blocks outgrown by later, bigger allocations are
+   dropped once the spares pass EXTPROT_POOL_SPARE_LIMIT. */
+static void check_spares(void) {
+  Extprot_Pool pool;
+  Extprot_Stats stats;
+  size_t cycle, i, size, used, footprint = 0;
+
+  extprot_stats_init(&stats);
+  init_extprot_pool(&pool, 0);
+  extprot_pool_set_stats(&pool, &stats);
+  for (cycle = 1; cycle <= 20; cycle++) {
+    size = (cycle + 1) / 2 * 8192;
+    for (i = 0; i < 32; i++) {
+      memset(extprot_pool_alloc(&pool, size), 1, size);
+    }
+    used = 32 * size;
+    if (cycle % 2 == 0 && stats.footprint != footprint) {
+      fprintf(stderr, "Error: repeated allocations grew the pool to %u bytes\n",
+	      (unsigned) stats.footprint);
+      exit(1);
+    }
+    reset_extprot_pool(&pool);
+    footprint = stats.footprint;
+    if (footprint > (used > EXTPROT_POOL_SPARE_LIMIT ? used : EXTPROT_POOL_SPARE_LIMIT)) {
+      fprintf(stderr, "Error: pool kept %u bytes after a reset\n", (unsigned) footprint);
+      exit(1);
+    }
+  }
+  empty_extprot_pool(&pool);
+}
+
+/* Encodes n nested one-element tuples around a vint 42, building
+   from the inside out; returns the offset of the message in buf. */
+static size_t nested_tuples(uint8_t *buf, size_t size, size_t n) {
+  size_t at = size, i, body, k;
+  uint8_t len[10];
+
+  buf[--at] = 42;
+  buf[--at] = 0x00;
+  for (i = 0; i < n; i++) {
+    buf[--at] = 1;
+    body = size - at;
+    for (k = 0; body >= 0x80; body >>= 7) {
+      len[k++] = (uint8_t) (body | 0x80);
+    }
+    len[k++] = (uint8_t) body;
+    at -= k;
+    memcpy(buf + at, len, k);
+    buf[--at] = EXTPROT_TUPLE;
+  }
+  return at;
+}
+
+/* Writes the chain nested_tuples() encodes with the streaming writer,
+   into buf if it is not NULL. */
+static Extprot_Error write_nested(Extprot_Writer *w, uint8_t *buf, size_t size, size_t n) {
+  size_t i;
+
+  extprot_writer_init(w, buf, size);
+  for (i = 0; i < n; i++) {
+    extprot_writer_begin_tuple(w, 0);
+  }
+  extprot_writer_vint(w, 0, 42);
+  for (i = 0; i < n; i++) {
+    extprot_writer_end(w);
+  }
+  return w->error;
+}
+
+/* A chain of n nested one-element tuples decodes and validates with
+   max_depth n but not n - 1, eagerly, lazily or incrementally, copies
+   intact, and is written by the streaming writer exactly as encoded. n
+   is well past the frames decode() keeps on the C stack, and deep
+   enough that expanding or copying it by recursion would overflow the
+   C stack. */
+static void check_depth(void) {
+  Extprot_Pool pool, dst;
+  Extprot_Decode_Options opts;
+  Extprot_Object *o;
+  Extprot_Error e;
+  Extprot_Writer w;
+  size_t i, n = 100000, size = 6 * n + 2, at, len;
+  uint8_t *buf = malloc(size), *out;
+  unsigned lazy;
+  int copy;
+
+  at = nested_tuples(buf, size, n);
+  len = size - at;
+  init_extprot_pool(&pool, 0);
+  extprot_decode_options_init(&opts);
+  for (lazy = 0; lazy <= EXTPROT_DECODE_LAZY; lazy += EXTPROT_DECODE_LAZY) {
+    opts.flags = lazy;
+    opts.max_depth = n;
+    e = extprot_decode_with(&pool, buf + at, len, &opts);
+    if (!e) e = extprot_expand(&pool, pool.root, 1);
+    if (e) { die("deep extprot_decode_with", e); }
+    init_extprot_pool(&dst, 0);
+    for (copy = 0; copy < 2; copy++) {
+      o = copy ? extprot_copy(&dst, pool.root) : pool.root;
+      for (i = 0; i < n; i++) {
+	o = o->body.tuple.vec[0];
+      }
+      if (EXTPROT_VINT_64(o) != 42) {
+	fprintf(stderr, "Error: wrong value at depth %u\n", (unsigned) n);
+	exit(1);
+      }
+    }
+    empty_extprot_pool(&dst);
+    reset_extprot_pool(&pool);
+
+    opts.max_depth = n - 1;
+    e = extprot_decode_with(&pool, buf + at, len, &opts);
+    if (!e && lazy) e = extprot_expand(&pool, pool.root, 1);
+    if (e != Extprot_TooDeep) { die("too deep extprot_decode_with", e); }
+    reset_extprot_pool(&pool);
+  }
+
+  opts.flags = 0;
+  opts.max_depth = n;
+  if (extprot_validate(buf + at, len, NULL, NULL) != Extprot_NoError
+      || extprot_validate(buf + at, len, &opts, NULL) != Extprot_NoError) {
+    fprintf(stderr, "Error: a chain that decodes did not validate\n");
+    exit(1);
+  }
+  opts.max_depth = n - 1;
+  e = extprot_validate(buf + at, len, &opts, NULL);
+  if (e != Extprot_TooDeep) { die("too deep extprot_validate", e); }
+
+  opts.max_depth = n;
+  e = stream_in_chunks(&pool, &opts, buf + at, len, 4096);
+  if (e) { die("deep extprot_stream_feed", e); }
+  reset_extprot_pool(&pool);
+  opts.max_depth = n - 1;
+  e = stream_in_chunks(&pool, &opts, buf + at, len, 4096);
+  if (e != Extprot_TooDeep) { die("too deep extprot_stream_feed", e); }
+  reset_extprot_pool(&pool);
+
+  /* almost every level's prefix outgrows what the writer reserves */
+  out = malloc(len);
+  if (write_nested(&w, NULL, 0, n) != Extprot_NoError
+      || w.used != len || memcmp(w.buffer, buf + at, len) != 0) {
+    fprintf(stderr, "Error: streaming writer got a deep chain wrong\n");
+    exit(1);
+  }
+  extprot_writer_free(&w);
+  if (write_nested(&w, out, len, n) != Extprot_NoError || memcmp(out, buf + at, len) != 0
+      || write_nested(&w, out, len - 1, n) != Extprot_BufferFull) {
+    fprintf(stderr, "Error: streaming writer needs more than the encoding's length\n");
+    exit(1);
+  }
+  extprot_writer_free(&w);
+  free(out);
+
+  /* each level is charged against what its parent left of the budget */
+  opts.flags = EXTPROT_DECODE_LAZY | EXTPROT_DECODE_ZERO_COPY;
+  opts.max_depth = 0;
+  opts.max_bytes = 4096;
+  e = extprot_decode_with(&pool, buf + at, len, &opts);
+  if (e) { die("budgeted lazy extprot_decode_with", e); }
+  e = extprot_expand(&pool, pool.root, 1);
+  if (e != Extprot_OverBudget) { die("budgeted extprot_expand", e); }
+
+  empty_extprot_pool(&pool);
+  free(buf);
+}
+
 int main(int argc, char *argv[]) {
   Extprot_Pool p;
   int i;
 
   printf("test_extprot: extprot version %s\n", extprot_version());
+  check_schema();
+  check_assoc_large();
+  check_hostile();
+  check_stream_limits();
+  check_vints();
+  check_depth();
+  check_spares();
 
   for (i = 1; i < argc; i++) {
     Extprot_Object *o;
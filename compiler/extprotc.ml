@@ -4,6 +4,7 @@ open ExtList
 open ExtString
 
 module G = Gencode.Make(Gen_OCaml)
+module GS = Gencode.Make(Gen_schema)
 module PP = Gencode.Prettyprint
 
 let (|>) x f = f x
@@ -12,12 +13,15 @@ let (@@) f x = f x
 let file = ref None
 let output = ref None
 let generators = ref None
+let lang = ref "ocaml"
 let dump_decls = ref false
 
 let arg_spec =
   Arg.align
     [
       "-o", Arg.String (fun f -> output := Some f), "FILE Set output file.";
+      "-l", Arg.Symbol (["ocaml"; "schema"], (fun l -> lang := l)),
+        " Target language (default: ocaml); schema writes a binary descriptor.";
       "-g", Arg.String (fun gs -> generators := Some (String.nsplit gs ",")),
         "LIST Generators to use (comma-separated).";
       "--debug", Arg.Set dump_decls, " Dump message definitions."
@@ -59,13 +63,18 @@ let () =
   Option.may
     (fun file ->
        let output = match !output with
-           None -> Filename.chop_extension file ^ ".ml"
+           None ->
+             Filename.chop_extension file ^ (if !lang = "schema" then ".schema" else ".ml")
          | Some f -> f in
-       let och = open_out output in
+       let och = open_out_bin output in
        let decls = Parser.print_synerr Parser.parse_file file in
          begin
            match Ptypes.check_declarations decls with
-               [] -> G.generate_code ?generators:!generators decls |> output_string och
+               [] ->
+                 let generate_code = match !lang with
+                     "schema" -> GS.generate_code
+                   | _ -> G.generate_code
+                 in generate_code ?generators:!generators decls |> output_string och
              | errors -> Ptypes.print_errors stderr errors
          end;
          if !dump_decls then inspect_decls decls (Gencode.collect_bindings decls))
@@ -0,0 +1,102 @@
+(* Binary schema descriptors, loaded at run time by extprot_schema_load()
+   in the C library; the layout is described in c/extprot_schema.c. *)
+
+open Ptypes
+open Gencode
+open ExtList
+
+type container = {
+  c_name : string;
+  c_desc : string;
+}
+
+(* Type codes, as in the EXTPROT_T_* enum of c/extprot.h *)
+let t_bool = 1
+let t_byte = 2
+let t_int = 3
+let t_i32 = 4
+let t_long = 5
+let t_float = 6
+let t_string = 7
+let t_tuple = 8
+let t_list = 9
+let t_sum = 10
+let t_message = 11
+
+let add_vint b n =
+  let rec loop n =
+    if n < 128 then Buffer.add_char b (Char.chr n)
+    else begin
+      Buffer.add_char b (Char.chr ((n land 127) lor 128));
+      loop (n lsr 7)
+    end
+  in loop n
+
+let add_string b s =
+  add_vint b (String.length s);
+  Buffer.add_string b s
+
+let rec add_type b = function
+    Vint (Bool, _) -> add_vint b t_bool
+  | Vint (Int8, _) -> add_vint b t_byte
+  | Vint (Int, _) -> add_vint b t_int
+  | Bitstring32 _ -> add_vint b t_i32
+  | Bitstring64 (Long, _) -> add_vint b t_long
+  | Bitstring64 (Float, _) -> add_vint b t_float
+  | Bytes _ -> add_vint b t_string
+  | Tuple (lltys, _) ->
+      add_vint b t_tuple;
+      add_types b lltys
+  | Htuple (_, llty, _) ->
+      add_vint b t_list;
+      add_type b llty
+  | Sum (constant, non_constant, _) ->
+      add_vint b t_sum;
+      add_vint b (List.length constant);
+      add_vint b (List.length non_constant);
+      List.iter (fun c -> add_vint b c.const_tag; add_string b c.const_name) constant;
+      List.iter
+        (fun (c, lltys) ->
+           add_vint b c.const_tag;
+           add_string b c.const_name;
+           add_types b lltys)
+        non_constant
+  | Message (name, _) ->
+      add_vint b t_message;
+      add_string b name
+
+and add_types b lltys =
+  add_vint b (List.length lltys);
+  List.iter (add_type b) lltys
+
+let add_case b name fields =
+  add_string b name;
+  add_vint b (List.length fields);
+  List.iter (fun (fname, _, llty) -> add_string b fname; add_type b llty) fields
+
+let generate_container bindings = function
+    Type_decl _ -> None
+  | Message_decl (msgname, mexpr, _) ->
+      let b = Buffer.create 128 in
+        add_string b msgname;
+        begin match Gencode.low_level_msg_def bindings mexpr with
+            Record_single fields ->
+              add_vint b 0;
+              add_vint b 1;
+              add_case b "" fields
+          | Record_sum cases ->
+              add_vint b 1;
+              add_vint b (List.length cases);
+              List.iter (fun (c, fields) -> add_case b c fields) cases
+        end;
+        Some { c_name = msgname; c_desc = Buffer.contents b }
+
+let generate_code containers =
+  let b = Buffer.create 1024 in
+    Buffer.add_string b "EXTPSCH1";
+    add_vint b (List.length containers);
+    List.iter (fun c -> Buffer.add_string b c.c_desc) containers;
+    Buffer.contents b
+
+let msgdecl_generators : (string * _ msgdecl_generator) list = []
+let typedecl_generators : (string * _ typedecl_generator) list = []